@@ -0,0 +1,121 @@
+/*
+ * checks of binary protocol requests against a running magent, see make test
+ *
+ * usage: bintest port
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int port;
+
+static int
+connect_agent(void)
+{
+	struct sockaddr_in addr;
+	struct timeval tv = { 2, 0 };
+	int fd;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (void *) &tv, sizeof(tv));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	addr.sin_port = htons(port);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* 24 bytes request header, no extras or key */
+static void
+header(unsigned char *h, unsigned char opcode, unsigned int bodylen)
+{
+	memset(h, 0, 24);
+	h[0] = 0x80;
+	h[1] = opcode;
+	h[8] = bodylen >> 24;
+	h[9] = (bodylen >> 16) & 0xff;
+	h[10] = (bodylen >> 8) & 0xff;
+	h[11] = bodylen & 0xff;
+}
+
+/* NOOP is replied with one 24 bytes header */
+static int
+check_noop(void)
+{
+	unsigned char h[24], r[64];
+	int fd, n = 0, len;
+
+	if ((fd = connect_agent()) < 0) return 1;
+
+	header(h, 0x0a, 0);
+	write(fd, h, 24);
+	while (n < 24 && (len = read(fd, r + n, sizeof(r) - n)) > 0)
+		n += len;
+	close(fd);
+
+	if (n != 24 || r[0] != 0x81 || r[1] != 0x0a) {
+		fprintf(stderr, "NOOP: %d bytes replied\n", n);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* body length wrapping 24 + length around 2^32 must close connection, and reply nothing */
+static int
+check_bodylen(unsigned int bodylen)
+{
+	unsigned char h[24], r[4096];
+	int fd, n = 0, len;
+
+	if ((fd = connect_agent()) < 0) return 1;
+
+	header(h, 0x0a, bodylen);
+	write(fd, h, 24);
+	while ((len = read(fd, r, sizeof(r))) > 0)
+		n += len;
+	close(fd);
+
+	if (len < 0 || n > 0) {
+		fprintf(stderr, "BODY LENGTH 0x%08x: %d bytes replied, %s\n", bodylen, n, len < 0 ? "not closed" : "closed");
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int lens[] = { 0xffffffe8, 0xfffffff0, 0xffffffff, 0x80000000 };
+	int i, fails = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s port\n", argv[0]);
+		return 2;
+	}
+	port = atoi(argv[1]);
+
+	fails += check_noop();
+	for (i = 0; i < (int) (sizeof(lens) / sizeof(lens[0])); i ++)
+		fails += check_bodylen(lens[i]);
+	fails += check_noop();
+
+	printf("bintest: %d failed\n", fails);
+	return fails ? 1 : 0;
+}
@@ -11,6 +11,12 @@
 
 static const char resivion[] __attribute__((used)) = { "$Id$" };
 
+#define KETAMA_BATCH 64 /* keys hashed by one ketama_md5_batch() */
+#define KETAMA_BUCKET_BITS 20 /* max bucket index of ring, 4MB */
+#define MAGLEV_SMALL 65537 /* prime sizes of maglev table, at least 100 slots for each server */
+#define MAGLEV_LARGE 655373
+#define MAGLEV_HUGE 6553621
+
 typedef unsigned char md5_byte_t; /* 8-bit byte */
 typedef unsigned int md5_word_t; /* 32-bit word */
 
@@ -353,16 +359,261 @@ static void ketama_md5_digest( const char* in, unsigned char md5pword[16] )
 	md5_finish( &md5state, md5pword );
 }
 
-static unsigned int ketama_hashi( const char* inString )
+/* MD5 of many keys at once, one key in each lane of vectors of MD5_LANES words.
+ * GCC vector extensions, built for SSE2 and AVX2 and picked when loaded (ifunc),
+ * other compilers use md5_process() for every key.
+ */
+#if defined(__GNUC__) && (__GNUC__ >= 6 || defined(__clang__))
+#define MD5_SIMD 1
+#define MD5_LANES 8
+#define MD5_LANE_BLOCKS 4 /* keys up to 247 bytes, longer ones use md5_process() */
+
+/* ketamatest builds each target on its own with MD5_CLONES set */
+#ifndef MD5_CLONES
+#if defined(__x86_64__) && defined(__linux__)
+#define MD5_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define MD5_CLONES
+#endif
+#endif
+
+typedef md5_word_t md5_vec __attribute__((vector_size(MD5_LANES * 4)));
+typedef int md5_mask __attribute__((vector_size(MD5_LANES * 4)));
+
+#define VF(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define VG(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define VH(x, y, z) ((x) ^ (y) ^ (z))
+#define VI(x, y, z) ((y) ^ ((x) | ~(z)))
+#define VSET(f, a, b, c, d, k, s, Ti)\
+  a += f(b, c, d) + X[k] + (md5_word_t)(Ti);\
+  a = ((a << s) | (a >> (32 - s))) + b
+
+static void MD5_CLONES md5_lanes(const char **in, const size_t *len, int n, md5_byte_t (*digest)[16])
 {
-	unsigned char digest[16], ret;
-	ketama_md5_digest( inString, digest );
-	ret = ( digest[3] << 24 )
-						| ( digest[2] << 16 )
-						| ( digest[1] <<  8 )
-						|   digest[0];
-
-	return ret;
+	md5_byte_t buf[MD5_LANES][MD5_LANE_BLOCKS * 64];
+	md5_vec a, b, c, d, aa, bb, cc, dd, X[16];
+	md5_mask live;
+	int nblocks[MD5_LANES], maxblocks = 0, i, j, k;
+	md5_word_t bits;
+
+	/* padded messages */
+	for (i = 0; i < MD5_LANES; i ++) {
+		nblocks[i] = 0;
+		if (i >= n) continue;
+
+		nblocks[i] = (len[i] + 8) / 64 + 1;
+		if (nblocks[i] > maxblocks) maxblocks = nblocks[i];
+
+		memcpy(buf[i], in[i], len[i]);
+		memset(buf[i] + len[i], 0, nblocks[i] * 64 - len[i]);
+		buf[i][len[i]] = 0x80;
+		bits = (md5_word_t)(len[i] << 3);
+		for (j = 0; j < 4; j ++)
+			buf[i][nblocks[i] * 64 - 8 + j] = (md5_byte_t)(bits >> (j * 8));
+	}
+
+	for (i = 0; i < MD5_LANES; i ++) {
+		a[i] = 0x67452301;
+		b[i] = T_MASK ^ 0x10325476;
+		c[i] = T_MASK ^ 0x67452301;
+		d[i] = 0x10325476;
+	}
+
+	for (k = 0; k < maxblocks; k ++) {
+		for (j = 0; j < 16; j ++) {
+			for (i = 0; i < MD5_LANES; i ++) {
+				const md5_byte_t *xp = buf[i] + k * 64 + j * 4;
+				X[j][i] = (k < nblocks[i]) ? xp[0] + (xp[1] << 8) + (xp[2] << 16) + ((md5_word_t)xp[3] << 24) : 0;
+			}
+		}
+
+		aa = a; bb = b; cc = c; dd = d;
+
+		VSET(VF, a, b, c, d,  0,  7,  T1); VSET(VF, d, a, b, c,  1, 12,  T2);
+		VSET(VF, c, d, a, b,  2, 17,  T3); VSET(VF, b, c, d, a,  3, 22,  T4);
+		VSET(VF, a, b, c, d,  4,  7,  T5); VSET(VF, d, a, b, c,  5, 12,  T6);
+		VSET(VF, c, d, a, b,  6, 17,  T7); VSET(VF, b, c, d, a,  7, 22,  T8);
+		VSET(VF, a, b, c, d,  8,  7,  T9); VSET(VF, d, a, b, c,  9, 12, T10);
+		VSET(VF, c, d, a, b, 10, 17, T11); VSET(VF, b, c, d, a, 11, 22, T12);
+		VSET(VF, a, b, c, d, 12,  7, T13); VSET(VF, d, a, b, c, 13, 12, T14);
+		VSET(VF, c, d, a, b, 14, 17, T15); VSET(VF, b, c, d, a, 15, 22, T16);
+
+		VSET(VG, a, b, c, d,  1,  5, T17); VSET(VG, d, a, b, c,  6,  9, T18);
+		VSET(VG, c, d, a, b, 11, 14, T19); VSET(VG, b, c, d, a,  0, 20, T20);
+		VSET(VG, a, b, c, d,  5,  5, T21); VSET(VG, d, a, b, c, 10,  9, T22);
+		VSET(VG, c, d, a, b, 15, 14, T23); VSET(VG, b, c, d, a,  4, 20, T24);
+		VSET(VG, a, b, c, d,  9,  5, T25); VSET(VG, d, a, b, c, 14,  9, T26);
+		VSET(VG, c, d, a, b,  3, 14, T27); VSET(VG, b, c, d, a,  8, 20, T28);
+		VSET(VG, a, b, c, d, 13,  5, T29); VSET(VG, d, a, b, c,  2,  9, T30);
+		VSET(VG, c, d, a, b,  7, 14, T31); VSET(VG, b, c, d, a, 12, 20, T32);
+
+		VSET(VH, a, b, c, d,  5,  4, T33); VSET(VH, d, a, b, c,  8, 11, T34);
+		VSET(VH, c, d, a, b, 11, 16, T35); VSET(VH, b, c, d, a, 14, 23, T36);
+		VSET(VH, a, b, c, d,  1,  4, T37); VSET(VH, d, a, b, c,  4, 11, T38);
+		VSET(VH, c, d, a, b,  7, 16, T39); VSET(VH, b, c, d, a, 10, 23, T40);
+		VSET(VH, a, b, c, d, 13,  4, T41); VSET(VH, d, a, b, c,  0, 11, T42);
+		VSET(VH, c, d, a, b,  3, 16, T43); VSET(VH, b, c, d, a,  6, 23, T44);
+		VSET(VH, a, b, c, d,  9,  4, T45); VSET(VH, d, a, b, c, 12, 11, T46);
+		VSET(VH, c, d, a, b, 15, 16, T47); VSET(VH, b, c, d, a,  2, 23, T48);
+
+		VSET(VI, a, b, c, d,  0,  6, T49); VSET(VI, d, a, b, c,  7, 10, T50);
+		VSET(VI, c, d, a, b, 14, 15, T51); VSET(VI, b, c, d, a,  5, 21, T52);
+		VSET(VI, a, b, c, d, 12,  6, T53); VSET(VI, d, a, b, c,  3, 10, T54);
+		VSET(VI, c, d, a, b, 10, 15, T55); VSET(VI, b, c, d, a,  1, 21, T56);
+		VSET(VI, a, b, c, d,  8,  6, T57); VSET(VI, d, a, b, c, 15, 10, T58);
+		VSET(VI, c, d, a, b,  6, 15, T59); VSET(VI, b, c, d, a, 13, 21, T60);
+		VSET(VI, a, b, c, d,  4,  6, T61); VSET(VI, d, a, b, c, 11, 10, T62);
+		VSET(VI, c, d, a, b,  2, 15, T63); VSET(VI, b, c, d, a,  9, 21, T64);
+
+		/* lanes with shorter keys keep their digest */
+		for (i = 0; i < MD5_LANES; i ++)
+			live[i] = (k < nblocks[i]) ? -1 : 0;
+
+		a = ((a + aa) & (md5_vec)live) | (aa & ~(md5_vec)live);
+		b = ((b + bb) & (md5_vec)live) | (bb & ~(md5_vec)live);
+		c = ((c + cc) & (md5_vec)live) | (cc & ~(md5_vec)live);
+		d = ((d + dd) & (md5_vec)live) | (dd & ~(md5_vec)live);
+	}
+
+	for (i = 0; i < n; i ++) {
+		for (j = 0; j < 4; j ++) {
+			digest[i][j] = (md5_byte_t)(a[i] >> (j * 8));
+			digest[i][4 + j] = (md5_byte_t)(b[i] >> (j * 8));
+			digest[i][8 + j] = (md5_byte_t)(c[i] >> (j * 8));
+			digest[i][12 + j] = (md5_byte_t)(d[i] >> (j * 8));
+		}
+	}
+}
+#endif
+
+/* MD5 of n strings, same digests as ketama_md5_digest() */
+static void ketama_md5_batch(const char **in, int n, md5_byte_t (*digest)[16])
+{
+#ifdef MD5_SIMD
+	const char *lin[MD5_LANES];
+	size_t len[MD5_LANES];
+	int idx[MD5_LANES], i, j, cnt = 0;
+	md5_byte_t out[MD5_LANES][16];
+
+	if (n == 1) {
+		ketama_md5_digest(in[0], digest[0]);
+		return;
+	}
+
+	for (i = 0; i < n; i ++) {
+		len[cnt] = strlen(in[i]);
+		if (len[cnt] + 9 > MD5_LANE_BLOCKS * 64) {
+			ketama_md5_digest(in[i], digest[i]);
+			continue;
+		}
+
+		lin[cnt] = in[i];
+		idx[cnt ++] = i;
+		if (cnt < MD5_LANES && i < n - 1) continue;
+
+		md5_lanes(lin, len, cnt, out);
+		for (j = 0; j < cnt; j ++)
+			memcpy(digest[idx[j]], out[j], 16);
+		cnt = 0;
+	}
+
+	if (cnt > 0) {
+		md5_lanes(lin, len, cnt, out);
+		for (j = 0; j < cnt; j ++)
+			memcpy(digest[idx[j]], out[j], 16);
+	}
+#else
+	int i;
+
+	for (i = 0; i < n; i ++)
+		ketama_md5_digest(in[i], digest[i]);
+#endif
+}
+
+/* MurmurHash64A by Austin Appleby, public domain,
+ * bytes read little-endian so rings are the same on all hosts
+ */
+unsigned long long murmur_hash64(const char *key, size_t len, unsigned long long seed)
+{
+	const unsigned long long m = 0xc6a4a7935bd1e995ULL;
+	const int r = 47;
+	const unsigned char *data = (const unsigned char *)key;
+	const unsigned char *end = data + (len & ~(size_t)7);
+	unsigned long long h = seed ^ (len * m), k;
+
+	for (; data != end; data += 8) {
+		k = (unsigned long long)data[0] | ((unsigned long long)data[1] << 8)
+			| ((unsigned long long)data[2] << 16) | ((unsigned long long)data[3] << 24)
+			| ((unsigned long long)data[4] << 32) | ((unsigned long long)data[5] << 40)
+			| ((unsigned long long)data[6] << 48) | ((unsigned long long)data[7] << 56);
+
+		k *= m;
+		k ^= k >> r;
+		k *= m;
+
+		h ^= k;
+		h *= m;
+	}
+
+	switch (len & 7) {
+	case 7: h ^= (unsigned long long)data[6] << 48;
+	case 6: h ^= (unsigned long long)data[5] << 40;
+	case 5: h ^= (unsigned long long)data[4] << 32;
+	case 4: h ^= (unsigned long long)data[3] << 24;
+	case 3: h ^= (unsigned long long)data[2] << 16;
+	case 2: h ^= (unsigned long long)data[1] << 8;
+	case 1: h ^= (unsigned long long)data[0];
+		h *= m;
+	}
+
+	h ^= h >> r;
+	h *= m;
+	h ^= h >> r;
+
+	return h;
+}
+
+/* first 8 bytes of MD5 digest, little-endian */
+static unsigned long long ketama_digest64(const unsigned char d[16])
+{
+	unsigned long long h = 0;
+	int i;
+
+	for (i = 7; i >= 0; i --)
+		h = (h << 8) | d[i];
+
+	return h;
+}
+
+/* 4 ring points out of two 64-bit hashes, in the byte order of MD5 digests */
+static void ketama_murmur_digest(const char *in, unsigned char digest[16])
+{
+	unsigned long long h[2];
+	unsigned int w;
+	int i, j;
+
+	h[0] = murmur_hash64(in, strlen(in), 0);
+	h[1] = murmur_hash64(in, strlen(in), 1);
+	for (i = 0; i < 4; i ++) {
+		w = (i & 1) ? (unsigned int)h[i / 2] : (unsigned int)(h[i / 2] >> 32);
+		for (j = 0; j < 4; j ++)
+			digest[i * 4 + j] = (unsigned char)(w >> (j * 8));
+	}
+}
+
+/* 64-bit hash of key, its low 32 bits are the ring point of ketama */
+static unsigned long long ketama_key64(struct ketama *ring, const char *key)
+{
+	unsigned char d[16];
+	unsigned long long h;
+
+	if (ring->hash == KETAMA_HASH_MURMUR) {
+		h = murmur_hash64(key, strlen(key), 0);
+		return (h >> 32) | (h << 32);
+	}
+
+	ketama_md5_digest(key, d);
+	return ketama_digest64(d);
 }
 
 static int ketama_compare(const void *p1, const void *p2)
@@ -379,6 +630,75 @@ static int ketama_compare(const void *p1, const void *p2)
 	return 0;
 }
 
+/* Maglev lookup table, servers take turns filling their preferred empty slots,
+ * heavier servers take more turns
+ */
+static int create_maglev(struct ketama *ring)
+{
+	unsigned int *offset, *skip, *next, m, c, filled = 0;
+	double *credit;
+	int i, maxweight = 0;
+
+	m = MAGLEV_SMALL;
+	if ((unsigned int)ring->count * 100 > MAGLEV_SMALL) m = MAGLEV_LARGE;
+	if ((unsigned int)ring->count * 100 > MAGLEV_LARGE) m = MAGLEV_HUGE;
+
+	ring->table = (int *)malloc(sizeof(int) * m);
+	offset = (unsigned int *)malloc(sizeof(unsigned int) * ring->count * 3);
+	credit = (double *)calloc(sizeof(double), ring->count);
+	if (ring->table == NULL || offset == NULL || credit == NULL) {
+		free(offset);
+		free(credit);
+		return 1;
+	}
+	skip = offset + ring->count;
+	next = skip + ring->count;
+
+	ring->tablesize = m;
+	for (c = 0; c < m; c ++)
+		ring->table[c] = -1;
+
+	for (i = 0; i < ring->count; i ++) {
+		offset[i] = murmur_hash64(ring->name[i], strlen(ring->name[i]), 0) % m;
+		skip[i] = murmur_hash64(ring->name[i], strlen(ring->name[i]), 1) % (m - 1) + 1;
+		next[i] = 0;
+		if (ring->weight[i] > maxweight) maxweight = ring->weight[i];
+	}
+
+	while (filled < m) {
+		for (i = 0; i < ring->count && filled < m; i ++) {
+			credit[i] += (double)ring->weight[i] / maxweight;
+			if (credit[i] < 1.0) continue;
+			credit[i] -= 1.0;
+
+			do {
+				c = (offset[i] + (unsigned long long)next[i] * skip[i]) % m;
+				next[i] ++;
+			} while (ring->table[c] >= 0);
+
+			ring->table[c] = i;
+			filled ++;
+		}
+	}
+
+	free(offset);
+	free(credit);
+	return 0;
+}
+
+static int create_rendezvous(struct ketama *ring)
+{
+	int i;
+
+	ring->seeds = (unsigned long long *)malloc(sizeof(unsigned long long) * ring->count);
+	if (ring->seeds == NULL) return 1;
+
+	for (i = 0; i < ring->count; i ++)
+		ring->seeds[i] = murmur_hash64(ring->name[i], strlen(ring->name[i]), 0);
+
+	return 0;
+}
+
 /* return 1 if failed
  * return 0 if successed
  */
@@ -388,76 +708,331 @@ int create_ketama(struct ketama *ring, int step)
 	int i, k, ks, h;
 	unsigned int cont = 0;
 	float pct;
-	char temp[256];
-	unsigned char digest[16];
+	char temps[KETAMA_BATCH][256];
+	const char *names[KETAMA_BATCH];
+	unsigned char digests[KETAMA_BATCH][16];
+	unsigned int b;
+	int j, n, bits;
 
 	if (ring == NULL || ring->count <= 0 || ring->totalweight <= 0) return 1;
 
-	if (step == 0) step = 500;
-	dot = (struct dot *)calloc(ring->count*step*4, sizeof(struct dot));
+	ring->down = (unsigned char *)calloc(ring->count, 1);
+	if (ring->down == NULL) return 1;
+
+	switch (ring->engine) {
+	case KETAMA_ENGINE_JUMP:
+		return 0;
+	case KETAMA_ENGINE_MAGLEV:
+		return create_maglev(ring);
+	case KETAMA_ENGINE_RENDEZVOUS:
+		return create_rendezvous(ring);
+	}
+
+	if (step <= 0) step = 500;
+	dot = (struct dot *)calloc((ring->count*step + ring->count)*4, sizeof(struct dot));
 	if (dot == NULL) return 1;
 
 	for (i = 0; i < ring->count; i ++) {
 		pct = (float) ring->weight[i] / (float) ring->totalweight;
 		ks = (int) floorf(pct * step *(float) ring->count); /* divide by 4 for 4 part */
-		for (k = 0; k < ks; k ++) {
-			snprintf(temp, 255, "%s-%d", ring->name[i], k);
-			ketama_md5_digest(temp, digest);
-			for (h = 0; h < 4; h ++) {
-					dot[cont].point = ( digest[3+h*4] << 24 ) | ( digest[2+h*4] << 16 )
-					   		| ( digest[1+h*4] <<  8 ) | digest[h*4];
+		if (ks <= 0 && ring->weight[i] > 0) ks = 1; /* light servers still get keys */
+
+		/* hash KETAMA_BATCH points at once */
+		for (k = 0; k < ks; k += n) {
+			n = (ks - k < KETAMA_BATCH) ? ks - k : KETAMA_BATCH;
+			for (j = 0; j < n; j ++) {
+				snprintf(temps[j], 255, "%s-%d", ring->name[i], k + j);
+				names[j] = temps[j];
+			}
+
+			if (ring->hash == KETAMA_HASH_MURMUR) {
+				for (j = 0; j < n; j ++)
+					ketama_murmur_digest(names[j], digests[j]);
+			} else {
+				ketama_md5_batch(names, n, digests);
+			}
+
+			for (j = 0; j < n; j ++) {
+				for (h = 0; h < 4; h ++) {
+					dot[cont].point = ( digests[j][3+h*4] << 24 ) | ( digests[j][2+h*4] << 16 )
+							| ( digests[j][1+h*4] <<  8 ) | digests[j][h*4];
 					dot[cont].srvid = i;
 					cont ++;
+				}
 			}
 		}
 	}
 
 	qsort( (void*) dot, cont, sizeof( struct dot ), ketama_compare );
-	ring->dot = dot;
 	ring->numpoints = cont;
 
+	/* about one point for each bucket */
+	for (bits = 1; bits < KETAMA_BUCKET_BITS && (1U << bits) < cont; bits ++) ;
+	ring->bucketbits = bits;
+
+	ring->points = (unsigned int *)malloc(sizeof(unsigned int) * cont);
+	ring->srvids = (int *)malloc(sizeof(int) * cont);
+	ring->buckets = (unsigned int *)malloc(sizeof(unsigned int) * ((1U << bits) + 1));
+	if (ring->points == NULL || ring->srvids == NULL || ring->buckets == NULL) {
+		free(dot);
+		return 1;
+	}
+
+	for (k = 0; k < (int)cont; k ++) {
+		ring->points[k] = dot[k].point;
+		ring->srvids[k] = dot[k].srvid;
+	}
+	free(dot);
+
+	/* first point >= b << (32 - bits) */
+	for (b = 0, k = 0; b < (1U << bits); b ++) {
+		while (k < (int)cont && (ring->points[k] >> (32 - bits)) < b)
+			k ++;
+		ring->buckets[b] = k;
+	}
+	ring->buckets[b] = cont;
+
 	return 0;
 }
 
+/* index of the first point >= h, or of the first one of ring if h is beyond the last */
+static unsigned int ketama_index(struct ketama *ring, unsigned int h)
+{
+	const unsigned int *base;
+	unsigned int lo, n, half, idx;
+
+	lo = ring->buckets[h >> (32 - ring->bucketbits)];
+	n = ring->buckets[(h >> (32 - ring->bucketbits)) + 1] - lo;
+
+	/* branchless binary search in bucket */
+	base = ring->points + lo;
+	if (n > 0) {
+		while (n > 1) {
+			half = n / 2;
+			base = (base[half - 1] < h) ? base + half : base;
+			n -= half;
+		}
+		base += (*base < h);
+	}
+
+	idx = base - ring->points;
+	if (idx >= ring->numpoints) idx = 0;
+
+	return idx;
+}
+
 /* return -1 if failed
- * return index + 1 if success
+ * return server index of ring point h if success
  */
-int get_server(struct ketama *ring, const char *key)
+static int ketama_lookup(struct ketama *ring, unsigned int h)
 {
-	unsigned int highp, maxp, lowp=0, midp, midval, midval1;
-	unsigned int h = ketama_hashi( key );
+	if (h == 0 || ring->numpoints == 0) return -1;
 
-	if (ring == NULL || key == NULL) return -1;
+	return ring->srvids[ketama_index(ring, h)];
+}
+
+/* jump consistent hash by Lamping and Veach */
+static int jump_lookup(unsigned long long key, int buckets)
+{
+	long long b = -1, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (long long)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+	}
+
+	return (int)b;
+}
+
+/* 64-bit finalizer of splitmix64 */
+static unsigned long long mix64(unsigned long long h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
 
-	maxp = highp = ring->numpoints;
+/* server with the highest score weight / -ln(u), u uniform in (0, 1) from key and server,
+ * skipping servers in down if not NULL
+ */
+static int rendezvous_lookup(struct ketama *ring, unsigned long long key, const unsigned char *down)
+{
+	double score, best = -1.0, u;
+	int i, srv = -1;
+
+	for (i = 0; i < ring->count; i ++) {
+		if (down && down[i]) continue;
+		u = ((mix64(key ^ ring->seeds[i]) >> 11) + 0.5) / 9007199254740992.0; /* 2^53 */
+		score = ring->weight[i] / -log(u);
+		if (score > best) {
+			best = score;
+			srv = i;
+		}
+	}
+
+	return srv;
+}
+
+/* expected share of keys of each server, 0.0 - 1.0 */
+void ketama_shares(struct ketama *ring, double *share)
+{
+	unsigned int k, prev;
+	int i;
+
+	for (i = 0; i < ring->count; i ++)
+		share[i] = 0.0;
+
+	switch (ring->engine) {
+	case KETAMA_ENGINE_JUMP:
+		for (i = 0; i < ring->count; i ++)
+			share[i] = 1.0 / ring->count;
+		break;
+	case KETAMA_ENGINE_MAGLEV:
+		for (k = 0; k < ring->tablesize; k ++)
+			share[ring->table[k]] += 1.0 / ring->tablesize;
+		break;
+	case KETAMA_ENGINE_RENDEZVOUS:
+		for (i = 0; i < ring->count; i ++)
+			share[i] = (double) ring->weight[i] / ring->totalweight;
+		break;
+	default:
+		/* each point owns the arc after the point before it, the first wraps around */
+		if (ring->numpoints == 0) break;
+		prev = ring->points[ring->numpoints - 1];
+		for (k = 0; k < ring->numpoints; k ++) {
+			share[ring->srvids[k]] += (double)(unsigned int)(ring->points[k] - prev) / 4294967296.0;
+			prev = ring->points[k];
+		}
+		if (ring->numpoints == 1)
+			share[ring->srvids[0]] = 1.0;
+		break;
+	}
+}
+
+/* server after srv for key hash h which is not down, srv if all are down */
+static int ketama_next(struct ketama *ring, unsigned long long h, int srv)
+{
+	unsigned int k, idx;
+	int i, r, up;
+
+	switch (ring->engine) {
+	case KETAMA_ENGINE_JUMP:
+		/* jump again with other keys */
+		for (i = 1; i <= ring->count; i ++) {
+			r = jump_lookup(mix64(h + i), ring->count);
+			if (ring->down[r] == 0) return r;
+		}
+
+		/* many servers down, jump over the ones still up */
+		for (i = 0, up = 0; i < ring->count; i ++)
+			if (ring->down[i] == 0) up ++;
+		if (up == 0) break;
+
+		r = jump_lookup(mix64(h + ring->count + 1), up);
+		for (i = 0; i < ring->count; i ++)
+			if (ring->down[i] == 0 && r -- == 0) return i;
+		break;
+	case KETAMA_ENGINE_MAGLEV:
+		for (k = 1; k < ring->tablesize; k ++) {
+			r = ring->table[(h + k) % ring->tablesize];
+			if (ring->down[r] == 0) return r;
+		}
+		break;
+	case KETAMA_ENGINE_RENDEZVOUS:
+		r = rendezvous_lookup(ring, h, ring->down);
+		if (r >= 0) return r;
+		break;
+	default:
+		/* next points of ring */
+		idx = ketama_index(ring, (unsigned int)h);
+		for (k = 1; k < ring->numpoints; k ++) {
+			r = ring->srvids[(idx + k) % ring->numpoints];
+			if (ring->down[r] == 0) return r;
+		}
+		break;
+	}
+
+	/* server without points or table entries, next index which is up */
+	for (i = 1; i < ring->count; i ++) {
+		r = (srv + i) % ring->count;
+		if (ring->down[r] == 0) return r;
+	}
+
+	return srv;
+}
 
-	while (h) {
-		midp = (unsigned int)((lowp+highp)/2);
-		if (midp == maxp)
-			return ring->dot[0].srvid;
+/* return -1 if failed
+ * return server index of key hash h if success
+ */
+static int ketama_select(struct ketama *ring, unsigned long long h)
+{
+	int srv;
 
-		midval = ring->dot[midp].point;
-		midval1 = (midp == 0?0: ring->dot[midp-1].point);
+	switch (ring->engine) {
+	case KETAMA_ENGINE_JUMP:
+		srv = jump_lookup(h, ring->count);
+		break;
+	case KETAMA_ENGINE_MAGLEV:
+		srv = ring->table[h % ring->tablesize];
+		break;
+	case KETAMA_ENGINE_RENDEZVOUS:
+		srv = rendezvous_lookup(ring, h, NULL);
+		break;
+	default:
+		srv = ketama_lookup(ring, (unsigned int)h);
+		break;
+	}
+
+	if (srv >= 0 && ring->down[srv])
+		srv = ketama_next(ring, h, srv);
 
-		if (h <= midval && h > midval1)
-			return ring->dot[midp].srvid;
+	return srv;
+}
 
-		if (midval < h)
-			lowp = midp + 1;
-		else
-			highp = midp - 1;
+/* return -1 if failed
+ * return server index if success
+ */
+int get_server(struct ketama *ring, const char *key)
+{
+	if (ring == NULL || key == NULL) return -1;
+
+	return ketama_select(ring, ketama_key64(ring, key));
+}
+
+/* server indexes of n keys at once, -1 if failed */
+void get_servers(struct ketama *ring, const char **keys, int n, int *srv)
+{
+	unsigned char digests[KETAMA_BATCH][16];
+	int i, j, cnt;
+
+	if (ring == NULL || keys == NULL || ring->hash != KETAMA_HASH_MD5) {
+		for (i = 0; i < n; i ++)
+			srv[i] = get_server(ring, keys[i]);
+		return;
+	}
 
-		if (lowp > highp)
-			return ring->dot[0].srvid;
+	for (i = 0; i < n; i += cnt) {
+		cnt = (n - i < KETAMA_BATCH) ? n - i : KETAMA_BATCH;
+		ketama_md5_batch(keys + i, cnt, digests);
+		for (j = 0; j < cnt; j ++)
+			srv[i + j] = ketama_select(ring, ketama_digest64(digests[j]));
 	}
-	return -1;
 }
 
 void free_ketama(struct ketama *k)
 {
 	int i;
 	if (k == NULL) return;
-	if (k->dot) free(k->dot);
+	free(k->points);
+	free(k->srvids);
+	free(k->buckets);
+	free(k->table);
+	free(k->seeds);
+	free(k->down);
 	if (k->name) {
 		for (i = 0; i < k->count; i++)
 			free(k->name[i]);
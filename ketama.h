@@ -1,22 +1,54 @@
 #ifndef _KETAMA_H
 #define _KETAMA_H
 
+/* hash functions of keys and ring points */
+#define KETAMA_HASH_MD5 0 /* same ring as other ketama clients */
+#define KETAMA_HASH_MURMUR 1 /* 64-bit MurmurHash64A, much faster */
+
+/* how keys are distributed over servers */
+#define KETAMA_ENGINE_RING 0 /* ketama continuum */
+#define KETAMA_ENGINE_JUMP 1 /* jump consistent hash, servers only added/removed at the end */
+#define KETAMA_ENGINE_MAGLEV 2 /* Maglev lookup table */
+#define KETAMA_ENGINE_RENDEZVOUS 3 /* weighted rendezvous (highest random weight) */
+
 struct dot {
 	unsigned int point;
 	int srvid;
 };
 
 struct ketama {
+	/* sorted ring, points and their servers in separate arrays */
 	unsigned int numpoints;
-	struct dot *dot;
+	unsigned int *points;
+	int *srvids;
+
+	/* buckets[b] is the first point with top bits b, lookups search one bucket */
+	unsigned int *buckets;
+	int bucketbits;
 
 	int count;
 	char **name;
 	int *weight;
 	int totalweight;
+
+	int hash; /* KETAMA_HASH_MD5 or KETAMA_HASH_MURMUR */
+	int engine; /* KETAMA_ENGINE_* */
+
+	/* maglev lookup table */
+	int *table;
+	unsigned int tablesize;
+
+	/* rendezvous hash of each server name */
+	unsigned long long *seeds;
+
+	/* servers set down by caller, their keys go to the next server which is not */
+	unsigned char *down;
 };
 
 int create_ketama(struct ketama *, int);
 void free_ketama(struct ketama *);
 int get_server(struct ketama *, const char *);
+void get_servers(struct ketama *, const char **, int, int *);
+void ketama_shares(struct ketama *, double *);
+unsigned long long murmur_hash64(const char *, size_t, unsigned long long);
 #endif
@@ -0,0 +1,368 @@
+/*
+ * checks and benchmarks of ketama.c, md5, ring lookup and down servers, see make test and make bench
+ *
+ * usage: ketamatest [bench]
+ *
+ * ketama.c is included for its static functions, MD5_TARGET names the
+ * MD5_CLONES target it is built for
+ */
+
+#include "ketama.c"
+
+#include <sys/time.h>
+
+#ifndef MD5_TARGET
+#define MD5_TARGET "dispatch"
+#endif
+
+static unsigned int seed = 2463534242U;
+
+/* xorshift, same keys every run */
+static unsigned int
+next_rand(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* key of len random bytes, never '\0' */
+static void
+random_key(char *key, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i ++)
+		key[i] = (char) (next_rand() % 255 + 1);
+	key[len] = '\0';
+}
+
+/* ------------- md5 ------------- */
+
+#define MD5_KEYS 4096
+
+/* ketama_md5_batch() against ketama_md5_digest(), random and edge lengths, batches of 1...MD5_KEYS
+ * return number of mismatches
+ */
+static int
+test_md5(void)
+{
+	static const int edges[] = { 0, 1, 55, 56, 57, 63, 64, 65, 119, 120, 127, 128, 183, 184, 238, 239, 246, 247, 248, 255, 300, 1000 };
+	static char keys[MD5_KEYS][1024];
+	static const char *in[MD5_KEYS];
+	static unsigned char batch[MD5_KEYS][16], single[16];
+	unsigned char abc[16];
+	int i, n, round, fails = 0, nedges = sizeof(edges) / sizeof(edges[0]);
+
+	/* known answer, RFC 1321 */
+	ketama_md5_digest("abc", abc);
+	if (memcmp(abc, "\x90\x01\x50\x98\x3c\xd2\x4f\xb0\xd6\x96\x3f\x7d\x28\xe1\x7f\x72", 16)) {
+		fprintf(stderr, "md5(\"abc\") is wrong\n");
+		fails ++;
+	}
+
+	for (round = 0; round < 64; round ++) {
+		n = (round < 16) ? round + 1 : next_rand() % MD5_KEYS + 1;
+
+		for (i = 0; i < n; i ++) {
+			if (round % 2 == 0)
+				random_key(keys[i], edges[(round / 2 + i) % nedges]);
+			else
+				random_key(keys[i], next_rand() % 300);
+			in[i] = keys[i];
+		}
+
+		ketama_md5_batch(in, n, batch);
+
+		for (i = 0; i < n; i ++) {
+			ketama_md5_digest(in[i], single);
+			if (memcmp(single, batch[i], 16)) {
+				if (fails < 10)
+					fprintf(stderr, "md5 %s: key %d of %d, length %d, batch digest differs\n",
+							MD5_TARGET, i, n, (int) strlen(in[i]));
+				fails ++;
+			}
+		}
+	}
+
+	return fails;
+}
+
+/* keys/s of ketama_md5_digest() and ketama_md5_batch(), keys like "<ip>:<port>-<n>" of ring points */
+static void
+bench_md5(void)
+{
+	static char keys[KETAMA_BATCH][32];
+	static const char *in[KETAMA_BATCH];
+	static unsigned char digests[KETAMA_BATCH][16];
+	double t, single, batch;
+	int i, round, rounds = 20000;
+
+	for (i = 0; i < KETAMA_BATCH; i ++) {
+		snprintf(keys[i], sizeof(keys[i]), "10.0.0.%d:11211-%d", i % 250, (int) (next_rand() % 1000));
+		in[i] = keys[i];
+	}
+
+	t = now();
+	for (round = 0; round < rounds; round ++)
+		for (i = 0; i < KETAMA_BATCH; i ++)
+			ketama_md5_digest(in[i], digests[i]);
+	single = rounds * KETAMA_BATCH / (now() - t);
+
+	t = now();
+	for (round = 0; round < rounds; round ++)
+		ketama_md5_batch(in, KETAMA_BATCH, digests);
+	batch = rounds * KETAMA_BATCH / (now() - t);
+
+	printf("md5 %s: ketama_md5_digest %.2fM keys/s, ketama_md5_batch %.2fM keys/s, %.2fx\n",
+			MD5_TARGET, single / 1e6, batch / 1e6, batch / single);
+}
+
+/* ------------- ring lookup ------------- */
+
+/* binary search of ketama_lookup() before buckets, reference of its results */
+static int
+old_lookup(struct ketama *ring, unsigned int h)
+{
+	unsigned int highp, maxp, lowp = 0, midp, midval, midval1;
+
+	maxp = highp = ring->numpoints;
+	while (h) {
+		midp = (unsigned int) ((lowp + highp) / 2);
+		if (midp == maxp)
+			return ring->srvids[0];
+		midval = ring->points[midp];
+		midval1 = (midp == 0 ? 0 : ring->points[midp - 1]);
+		if (h <= midval && h > midval1)
+			return ring->srvids[midp];
+		if (midval < h)
+			lowp = midp + 1;
+		else
+			highp = midp - 1;
+		if (lowp > highp)
+			return ring->srvids[0];
+	}
+	return -1;
+}
+
+/* ring of cnt servers with engine, weights 50...149 */
+static struct ketama *
+new_ring(int cnt, int engine)
+{
+	struct ketama *ring;
+	char name[32];
+	int i;
+
+	ring = (struct ketama *) calloc(sizeof(struct ketama), 1);
+	if (ring == NULL) return NULL;
+
+	ring->count = cnt;
+	ring->weight = (int *) calloc(sizeof(int), cnt);
+	ring->name = (char **) calloc(sizeof(char *), cnt);
+	if (ring->weight == NULL || ring->name == NULL) {
+		free_ketama(ring);
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i ++) {
+		snprintf(name, sizeof(name), "10.%d.%d.%d:11211", i / 65536, (i / 256) % 256, i % 256);
+		ring->name[i] = strdup(name);
+		ring->weight[i] = 50 + i % 100;
+		ring->totalweight += ring->weight[i];
+	}
+
+	ring->hash = KETAMA_HASH_MD5;
+	ring->engine = engine;
+	if (create_ketama(ring, 500)) {
+		free_ketama(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+static int
+check_lookup(struct ketama *ring, unsigned int h)
+{
+	int a = ketama_lookup(ring, h), b = old_lookup(ring, h);
+
+	if (a == b) return 0;
+
+	fprintf(stderr, "lookup of %u on ring of %d points: %d, old lookup %d\n", h, ring->numpoints, a, b);
+	return 1;
+}
+
+/* ketama_lookup() against old_lookup(), on each point, next to it, at both ends and random points
+ * return number of mismatches
+ */
+static int
+test_lookup(int cnt)
+{
+	struct ketama *ring;
+	unsigned int i, p;
+	int fails = 0;
+
+	ring = new_ring(cnt, KETAMA_ENGINE_RING);
+	if (ring == NULL) {
+		fprintf(stderr, "can't create ring of %d servers\n", cnt);
+		return 1;
+	}
+
+	fails += check_lookup(ring, 0);
+	fails += check_lookup(ring, 1);
+	fails += check_lookup(ring, 0xffffffff);
+
+	for (i = 0; i < ring->numpoints && fails < 10; i ++) {
+		p = ring->points[i];
+		fails += check_lookup(ring, p);
+		fails += check_lookup(ring, p - 1);
+		fails += check_lookup(ring, p + 1);
+	}
+
+	/* past the last point, wraps to the first */
+	for (p = ring->points[ring->numpoints - 1]; p != 0 && fails < 10; p += (0xffffffff - p) / 4 + 1)
+		fails += check_lookup(ring, p);
+
+	for (i = 0; i < 1000000 && fails < 10; i ++)
+		fails += check_lookup(ring, next_rand());
+
+	free_ketama(ring);
+	return fails;
+}
+
+/* ------------- down servers ------------- */
+
+/* no key goes to a down server while one is up, keys of up servers don't move
+ * return number of failed rings
+ */
+static int
+test_down(int engine, int cnt)
+{
+	static int owner[10000];
+	struct ketama *ring;
+	char key[32];
+	int i, k, srv, round, up, fails = 0;
+
+	ring = new_ring(cnt, engine);
+	if (ring == NULL) {
+		fprintf(stderr, "can't create ring of %d servers, engine %d\n", cnt, engine);
+		return 1;
+	}
+
+	for (k = 0; k < 10000; k ++) {
+		snprintf(key, sizeof(key), "key:%d", k);
+		owner[k] = get_server(ring, key);
+	}
+
+	/* one down, all but one down, about half down */
+	for (round = 0; round < 3 * cnt; round ++) {
+		for (i = 0, up = 0; i < cnt; i ++) {
+			if (round < cnt)
+				ring->down[i] = (i == round);
+			else if (round < 2 * cnt)
+				ring->down[i] = (i != round - cnt);
+			else
+				ring->down[i] = next_rand() % 2;
+			if (ring->down[i] == 0) up ++;
+		}
+		if (up == 0) continue;
+
+		for (k = 0; k < 10000; k ++) {
+			snprintf(key, sizeof(key), "key:%d", k);
+			srv = get_server(ring, key);
+			if (srv < 0 || srv >= cnt || ring->down[srv] || (ring->down[owner[k]] == 0 && srv != owner[k])) {
+				fprintf(stderr, "engine %d, %d servers, %d up: key %s -> %d, owner %d%s\n",
+						engine, cnt, up, key, srv, owner[k], (srv >= 0 && srv < cnt && ring->down[srv]) ? " which is down" : "");
+				fails ++;
+				break;
+			}
+		}
+	}
+
+	free_ketama(ring);
+	return fails;
+}
+
+/* lookups/s of old_lookup() and ketama_lookup() */
+static void
+bench_lookup(int cnt)
+{
+	static unsigned int hs[1 << 16];
+	struct ketama *ring;
+	double t, old, nowrate;
+	int i, round, rounds = 100, sum = 0;
+
+	ring = new_ring(cnt, KETAMA_ENGINE_RING);
+	if (ring == NULL) return;
+
+	for (i = 0; i < (1 << 16); i ++)
+		hs[i] = next_rand();
+
+	t = now();
+	for (round = 0; round < rounds; round ++)
+		for (i = 0; i < (1 << 16); i ++)
+			sum += old_lookup(ring, hs[i]);
+	old = rounds * (1 << 16) / (now() - t);
+
+	t = now();
+	for (round = 0; round < rounds; round ++)
+		for (i = 0; i < (1 << 16); i ++)
+			sum -= ketama_lookup(ring, hs[i]);
+	nowrate = rounds * (1 << 16) / (now() - t);
+
+	printf("lookup %d servers, %u points: old %.2fM lookups/s, ketama_lookup %.2fM lookups/s, %.2fx%s\n",
+			cnt, ring->numpoints, old / 1e6, nowrate / 1e6, nowrate / old, sum ? " (MISMATCH)" : "");
+	free_ketama(ring);
+}
+
+int
+main(int argc, char **argv)
+{
+	int i, fails = 0;
+
+#if defined(__x86_64__) && defined(__GNUC__)
+	/* built for a target this cpu doesn't have */
+	if (strcmp(MD5_TARGET, "avx2") == 0 && !__builtin_cpu_supports("avx2")) {
+		printf("ketamatest %s: skipped, no avx2\n", MD5_TARGET);
+		return 0;
+	}
+#endif
+
+	if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+		bench_md5();
+		/* ring lookup doesn't depend on md5 target */
+		if (strcmp(MD5_TARGET, "dispatch") == 0) {
+			bench_lookup(3);
+			bench_lookup(50);
+			bench_lookup(1000);
+		}
+		return 0;
+	}
+
+	fails += test_md5();
+	if (strcmp(MD5_TARGET, "dispatch") == 0) {
+		fails += test_lookup(1);
+		fails += test_lookup(3);
+		fails += test_lookup(50);
+		fails += test_lookup(1000);
+
+		for (i = KETAMA_ENGINE_RING; i <= KETAMA_ENGINE_RENDEZVOUS; i ++) {
+			fails += test_down(i, 2);
+			fails += test_down(i, 4);
+			fails += test_down(i, 50);
+		}
+	}
+
+	printf("ketamatest %s: %d failed\n", MD5_TARGET, fails);
+	return fails ? 1 : 0;
+}
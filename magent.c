@@ -45,12 +45,12 @@ SUCH DAMAGE.
 
 #if defined(__FreeBSD__) || (defined(__APPLE__) && defined(__MACH__) )
 #include <sys/uio.h>
-#include <limits.h>
 #else
 #include <getopt.h>
 #endif
 
 #include <unistd.h>
+#include <limits.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -64,12 +64,25 @@ SUCH DAMAGE.
 #include <stdlib.h>
 #include <fcntl.h>
 #include <time.h>
-#include <sys/ioctl.h>
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <event.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifndef RWF_NOWAIT
+#define RWF_NOWAIT 0x00000008
+#endif
+#endif
+#endif
+
 #include "ketama.h"
 
 #define VERSION "0.6"
@@ -83,22 +96,99 @@ SUCH DAMAGE.
 #define BYTES_TOKEN 4
 #define KEY_MAX_LENGTH 250
 #define BUFFER_PIECE_SIZE 16
+#define BUFFER_CLASS_MIN 64 /* smallest size class of buffers */
+#define BUFFER_CLASSES 15 /* size classes 64 bytes ... 1M, bigger buffers are not cached */
+#define BUFFER_CACHE_SIZE (1<<20) /* max free bytes kept by one size class */
+#define MAX_PIPELINE 128 /* max commands in flight for one client */
+#define MAX_FREE_OBJECTS 1024 /* max free conn/server/command/query structs kept by one thread */
+#define URING_ENTRIES 256 /* writes submitted by one io_uring_enter() */
+#define URING_IOVS 64 /* max buffers of one write in io_uring */
+#define NCACHE_SEGMENTS 16 /* near cache is split by key hash, one lock each */
+#define NCACHE_SKETCH 4096 /* key frequency counters of one segment */
+#define NCACHE_ADMIT 2 /* requests of key seen before caching it */
+#define KEY_STAMPS 4096 /* last update of keys, by key hash */
+#define PENDING_BUCKETS 1024 /* hash table of GET keys in flight for one worker */
+#define HOTKEY_SAMPLE 8 /* one of every 8 key requests/replies is counted */
+#define HOTKEY_SLOTS 32 /* keys tracked for one memcached server */
+#define HOTKEY_SHOW 10 /* keys shown by stats hotkeys */
+#define HOTKEY_WINDOW 60 /* seconds, counts are halved after it */
+#define HEALTH_INTERVAL 2 /* seconds between probes of memcached servers */
+#define HEALTH_TIMEOUT 1 /* seconds for each step of probe */
+#define ADMIN_TIMEOUT 2 /* seconds for whole http request of admin port, see -a */
+#define WHEEL_TICK 10 /* milliseconds of one slot of timing wheel, see -T */
+#define WHEEL_SLOTS 512 /* power of 2, deadlines further away go round again */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS) /* buckets of each power of 2 microseconds, within 6% */
+#define LATENCY_BUCKETS (28 * LATENCY_SUB) /* up to 2^31 microseconds */
+
+/* memcached binary protocol of clients, commands are proxied as ascii ones */
+#define BIN_REQ_MAGIC 0x80
+#define BIN_RES_MAGIC 0x81
+#define BIN_HEADER_LEN 24
+#define BIN_BODY_MAX (1 << 30) /* longer requests are refused, lengths never overflow */
+
+#define BIN_CMD_GET 0x00
+#define BIN_CMD_SET 0x01
+#define BIN_CMD_ADD 0x02
+#define BIN_CMD_REPLACE 0x03
+#define BIN_CMD_DELETE 0x04
+#define BIN_CMD_INCREMENT 0x05
+#define BIN_CMD_DECREMENT 0x06
+#define BIN_CMD_QUIT 0x07
+#define BIN_CMD_GETQ 0x09
+#define BIN_CMD_NOOP 0x0a
+#define BIN_CMD_VERSION 0x0b
+#define BIN_CMD_GETK 0x0c
+#define BIN_CMD_GETKQ 0x0d
+#define BIN_CMD_APPEND 0x0e
+#define BIN_CMD_PREPEND 0x0f
+#define BIN_CMD_SETQ 0x11
+#define BIN_CMD_ADDQ 0x12
+#define BIN_CMD_REPLACEQ 0x13
+#define BIN_CMD_DELETEQ 0x14
+#define BIN_CMD_INCREMENTQ 0x15
+#define BIN_CMD_DECREMENTQ 0x16
+#define BIN_CMD_QUITQ 0x17
+#define BIN_CMD_APPENDQ 0x19
+#define BIN_CMD_PREPENDQ 0x1a
+
+#define BIN_STATUS_OK 0x00
+#define BIN_STATUS_KEY_ENOENT 0x01
+#define BIN_STATUS_KEY_EEXISTS 0x02
+#define BIN_STATUS_E2BIG 0x03
+#define BIN_STATUS_EINVAL 0x04
+#define BIN_STATUS_NOT_STORED 0x05
+#define BIN_STATUS_DELTA_BADVAL 0x06
+#define BIN_STATUS_UNKNOWN_COMMAND 0x81
+#define BIN_STATUS_ENOMEM 0x82
+#define BIN_STATUS_ETMPFAIL 0x86
 
 #define UNUSED(x) ( (void)(x) )
 #define STEP 5
 
 /* structure definitions */
+struct uring;
 typedef struct conn conn;
 typedef struct matrix matrix;
 typedef struct list list;
 typedef struct buffer buffer;
 typedef struct server server;
+typedef struct query query;
+typedef struct command command;
+
+/* deadline on timing wheel of worker, linked if prev is not NULL */
+struct wtimer
+{
+	struct wtimer *prev, *next;
+	unsigned long long expire; /* in ticks */
+	void (*fire)(void *);
+	void *arg;
+};
 
 typedef enum
 {
 	CLIENT_COMMAND,
-	CLIENT_NREAD, /* MORE CLIENT DATA */
-	CLIENT_TRANSCATION
+	CLIENT_NREAD /* MORE CLIENT DATA */
 } client_state_t;
 
 typedef enum
@@ -109,6 +199,17 @@ typedef enum
 	SERVER_ERROR
 } server_state_t;
 
+/* commands timed by stats latency */
+typedef enum
+{
+	LATENCY_GET,
+	LATENCY_MULTIGET,
+	LATENCY_STORAGE,
+	LATENCY_INCRDECR,
+	LATENCY_DELETE,
+	LATENCY_CLASSES
+} latency_class_t;
+
 struct buffer
 {
 	char *ptr;
@@ -120,6 +221,13 @@ struct buffer
 	struct buffer *next;
 };
 
+/* free buffers of one size class, each thread has its own */
+struct buffer_cache
+{
+	buffer *first;
+	size_t bytes;
+};
+
 /* list to buffers */
 struct list
 {
@@ -132,8 +240,9 @@ struct server
 {
 	int sfd;
 	server_state_t state;
-	struct event ev;
-	int ev_flags;
+	struct event ev; /* read */
+	struct event wev; /* write */
+	int ev_flags; /* EV_READ/EV_WRITE added */
 	
 	matrix *owner;
 
@@ -149,27 +258,93 @@ struct server
 	 */
 	int valuebytes;
 	int has_response_header:1;
-	int remove_trail:1;
+
+	/* data block of VALUE being read, moved to client when finished */
+	buffer *value;
 
 	/* input buffer */
 	list *request;
-	/* output buffer */
-	list *response;
 
 	int pool_idx;
+
+	/* queries written or waiting to be written, replied in FIFO order */
+	query *qhead;
+	query *qtail;
+
+	/* noreply queries, done when request data is written */
+	query *whead;
+	query *wtail;
+
+	/* persistent connection shared by many clients */
+	unsigned int is_mux:1;
+	int mux_idx;
+
+	struct server *next; /* free list */
+
+	/* request data waiting for flush_servers() */
+	unsigned int flushing:1;
+	struct server *flushnext;
+
+	/* with -T, deadlines in ticks, 0 if not running */
+	unsigned long long wexpire; /* connect, or write of pending request */
+	unsigned long long rexpire; /* next reply of queries */
+	struct wtimer timer;
+
+	unsigned long long stamp; /* connect() started, microseconds, see stats latency */
 };
 
-struct conn
+/* one client request in flight on a memcached server connection */
+struct query
 {
-	/* client part */
-	int cfd;
-	client_state_t state;
-	struct event ev;
-	int ev_flags;
+	struct command *cmd; /* NULL if nobody waits for the reply */
+	struct server *srv;
 
-	/* command buffer */
-	char line[BUFFERLEN+1];
-	int pos;
+	/* get/gets keys served by this query */
+	int *keyidx; /* indexes into cmd->keys */
+	int keycnt;
+	int keypos; /* keys before keypos are finished */
+	int curkey; /* position of VALUE being read, -1 to discard */
+
+	unsigned int is_get:1;
+	unsigned int is_backup:1;
+	unsigned int replied:1; /* first byte of reply seen */
+	unsigned int no_reply:1; /* done when written, see server_written() */
+
+	unsigned long long stamp; /* queued, microseconds, see stats latency */
+
+	struct query *next; /* next query on the same server */
+	struct query *cprev, *cnext; /* queries of the same command */
+
+	/* with -G, a leader sends GET keys for other commands too */
+	struct pending *pend; /* one for each key of leader, NULL if not shared */
+	struct query *subs; /* queries of commands waiting for keys of leader */
+	struct query *subnext;
+	int leadpos; /* key waited for, index into keyidx of leader */
+};
+
+/* GET key in flight other commands may join, see -G */
+struct pending
+{
+	struct pending *hnext;
+	unsigned int hash;
+	unsigned int linked:1;
+
+	unsigned long long stamp; /* update_clock when GET started */
+	query *q;
+	int pos; /* index into keyidx of q */
+};
+
+/* binary request of client, each key of a batched GET has one */
+struct binreq
+{
+	unsigned char opcode;
+	unsigned int opaque; /* as sent, network order */
+};
+
+/* one client command, pipelined commands are replied in order */
+struct command
+{
+	struct conn *client;
 
 	int storebytes; /* bytes stored by CAS/SET/ADD/... command */
 
@@ -181,19 +356,71 @@ struct conn
 		unsigned int no_reply:1;
 		unsigned int is_update_cmd:1;
 		unsigned int is_backup:1;
-		unsigned int is_last_key:1;
+		unsigned int is_quit:1;
+		unsigned int is_delete_cmd:1;
+		unsigned int done:1;
 	} flag;
 
 	int keycount; /* GET/GETS multi keys */
-	int keyidx;
 	char **keys;
 
+	/* GET/GETS VALUE blocks, one list per key in client order */
+	list *values;
+	unsigned long long stamp; /* update_clock when GET started */
+	/* queries in flight */
+	query *queries;
+
 	/* input buffer */
-	list *request;
+	list request;
+	/* output buffer, moved to client when all commands before finished */
+	list response;
+
+	struct wtimer timer; /* whole transaction, see -T */
+
+	/* started, microseconds, 0 if not timed, see stats latency */
+	unsigned long long started;
+	latency_class_t latclass;
+
+	/* binary requests replied by this command, NULL for ascii clients */
+	struct binreq *bin;
+	int nbin;
+
+	struct command *next;
+};
+
+struct conn
+{
+	/* client part */
+	int cfd;
+	client_state_t state;
+	struct event ev; /* read */
+	struct event wev; /* write */
+	int ev_flags; /* EV_READ/EV_WRITE added */
+
+	/* command buffer */
+	char line[BUFFERLEN+1];
+	int pos;
+
+	/* commands in flight, the last one is reading data block in CLIENT_NREAD */
+	command *cmds;
+	command *cmdtail;
+	int ncmds;
+
+	unsigned int processing:1; /* inside process_commands() */
+	unsigned int closed:1; /* closed while processing, free later */
+
+	/* protocol is told by the first byte client sends */
+	unsigned int detected:1;
+	unsigned int binary:1;
+
 	/* output buffer */
 	list *response;
 
-	struct server *srv;
+	struct conn *next; /* free list */
+
+	/* response waiting for flush_servers(), see -U */
+	unsigned int flushing:1;
+	struct conn *flushnext;
 };
 
 /* memcached server structure */
@@ -201,11 +428,146 @@ struct matrix
 {
 	char *ip;
 	int port;
+	int weight; /* share of keys with ketama, see -s ip:port:weight */
 	struct sockaddr_in dstaddr;
 
 	int size;
 	int used;
 	struct server **pool;
+
+	/* persistent multiplexed connections, see -m */
+	struct server **mux;
+	int muxnext;
+
+	int idx; /* index in servers of worker, -1 if removed by reload */
+	int conns; /* connections of worker, removed server is freed with the last one */
+	struct matrix *conf; /* in servers of worker, the one of cluster with health */
+
+	/* health, in servers of cluster, see -E */
+	int fails; /* failed connections and probes in a row */
+	int down; /* ejected from routing until it works again */
+	int probing; /* probe in flight, main loop only */
+};
+
+/* memcached servers and their key distribution, replaced as a whole by reload, see -F */
+struct cluster
+{
+	struct matrix *matrixs; /* addresses and weights, pools are in workers */
+	int matrixcnt;
+	struct ketama *ketama;
+
+	struct matrix *backups;
+	int backupcnt;
+	struct ketama *backupkt;
+
+	int refs; /* workers using it, and one while it is the newest */
+};
+
+/* health check of memcached server from main loop, see -E */
+struct probe
+{
+	struct cluster *cl;
+	struct matrix *m; /* in servers of cl */
+	int fd;
+	struct event ev;
+	int sent; /* "version" written */
+	char buf[64];
+	int pos;
+};
+
+/* VALUE block of one hot key, see -c */
+struct ncitem
+{
+	struct ncitem *hnext; /* hash chain */
+	struct ncitem *prev, *next; /* lru list, head is the newest */
+
+	unsigned int hash;
+	time_t expire;
+	size_t size; /* bytes charged to cache */
+	size_t len; /* bytes of VALUE block */
+	size_t casoff, caslen; /* " <cas unique>" in VALUE line, caslen is 0 if cached from get */
+	char *key;
+
+	/* "VALUE <key> <flags> <bytes> [<cas unique>]\r\n<data block>\r\n" followed by key */
+	char data[];
+};
+
+struct ncsegment
+{
+	pthread_mutex_t lock;
+
+	struct ncitem **table;
+	unsigned int tsize; /* power of 2 */
+	unsigned int items;
+	size_t bytes;
+
+	struct ncitem *head, *tail;
+
+	/* update_clock of last update, older GET values are not cached */
+	unsigned long long stamp;
+
+	/* approximate requests of keys, for admission and eviction */
+	unsigned char sketch[NCACHE_SKETCH];
+	unsigned int counts;
+};
+
+/* key counted by heavy hitter summary */
+struct hotkey
+{
+	char key[KEY_MAX_LENGTH + 1];
+	unsigned long long count; /* estimated, may be too high by count of replaced key */
+};
+
+/* heavy hitters of one memcached server in one worker, see stats hotkeys */
+struct hotkeys
+{
+	struct hotkey reqs[HOTKEY_SLOTS];
+	struct hotkey bytes[HOTKEY_SLOTS];
+	time_t since; /* start of counting */
+};
+
+/* log-linear latency histogram, see stats latency */
+struct histogram
+{
+	unsigned long long counts[LATENCY_BUCKETS];
+	unsigned long long n;
+	unsigned long long sum; /* microseconds */
+	unsigned long long max;
+};
+
+/* latencies of one memcached server in one worker */
+struct latency
+{
+	struct histogram connect; /* connect() until connected */
+	struct histogram first; /* query queued until first byte of reply */
+	struct histogram total; /* query queued until whole reply */
+};
+
+/* counters of all workers, see stats */
+struct counters
+{
+	unsigned long long requests, syscalls;
+	unsigned long long cmd_get, cmd_gets, cmd_set, cmd_cas, cmd_incr_decr, cmd_delete, cmd_other;
+	unsigned long long get_hits, get_misses;
+	unsigned long long client_read, client_written;
+	unsigned long long failovers;
+	long long buffered;
+	unsigned long long ncache_hits, ncache_misses, coalesced, timeouts;
+};
+
+/* counters of one memcached server in one worker, see stats */
+struct srvstat
+{
+	unsigned long long hits, misses; /* GET keys */
+	unsigned long long bytes_read, bytes_written;
+	unsigned long long reuses, connects; /* connections from keep alive pool or new */
+};
+
+/* hot key merged from all workers */
+struct hotrate
+{
+	char key[KEY_MAX_LENGTH + 1];
+	double rate;
 };
 
 typedef struct token_s
@@ -214,39 +576,156 @@ typedef struct token_s
 	size_t length;
 } token_t;
 
+/* worker thread, owns one event base, its client connections and
+ * private copies of cluster servers holding its keep alive pools
+ */
+typedef struct worker
+{
+	pthread_t tid;
+	struct event_base *base;
+
+	struct cluster *cl;
+	struct matrix **matrixs;
+	struct matrix **backups;
+
+	/* new client fds handed off by the accept thread */
+	int notify[2];
+	struct event notify_ev;
+
+	/* servers with request data to write, see send_query() */
+	struct server *flushq;
+	struct event flush_ev;
+
+	/* with -U, clients with responses to write and io_uring writing them */
+	struct conn *cflushq;
+	struct uring *ring;
+
+	/* client commands and read/writev/socket/connect calls, for stats */
+	unsigned long long requests;
+	unsigned long long syscalls;
+
+	/* client commands by type, GET keys replied, bytes and retries on backup servers */
+	unsigned long long cmd_get, cmd_gets, cmd_set, cmd_cas, cmd_incr_decr, cmd_delete, cmd_other;
+	unsigned long long get_hits, get_misses;
+	unsigned long long client_read, client_written;
+	unsigned long long failovers;
+	long long buffered; /* bytes of buffers in use */
+
+	/* one for each memcached server, swapped by reload under hotlock,
+	 * counted without it, stats reads a snapshot which may miss the latest
+	 */
+	struct srvstat *srvstats;
+
+	/* GET keys served by near cache or sent to memcached servers */
+	unsigned long long ncache_hits;
+	unsigned long long ncache_misses;
+
+	/* GET keys in flight and keys joining them, see -G */
+	struct pending **pendings;
+	unsigned long long coalesced;
+
+	/* heavy hitters, one for each memcached server, locked for stats and reload */
+	struct hotkeys *hotkeys;
+	pthread_mutex_t hotlock;
+	unsigned int hotrand; /* sampling, never 0 */
+
+	/* latencies, one for each memcached server and one for each command class,
+	 * swapped by reload and cleared under hotlock when latepoch is behind latency_epoch,
+	 * counted without it like srvstats
+	 */
+	struct latency *latency;
+	struct histogram cmdlat[LATENCY_CLASSES];
+	int latepoch;
+
+	/* with -T, deadlines of servers and commands */
+	struct wtimer *wheel; /* WHEEL_SLOTS list heads */
+	unsigned long long wtick; /* slots before it are done */
+	int wcount;
+	struct event wheel_ev;
+	unsigned long long timeouts;
+} worker;
+
 /* static variables */
+static int adminport = 0, adminfd = -1; /* http port of metrics, see -a */
+static unsigned long long totalconns = 0, rejectconns = 0; /* accepted and refused by -n, main loop only */
 static int port = 11211, maxconns = 4096, curconns = 0, sockfd = -1, verbose_mode = 0, use_ketama = 0;
 static struct event ev_master;
+static struct event_base *main_base = NULL; /* accept and timer */
 
-static struct matrix *matrixs = NULL; /* memcached server list */
-static int matrixcnt = 0;
-static struct ketama *ketama = NULL;
-
-static struct matrix *backups= NULL; /* backup memcached server list */
-static int backupcnt = 0;
-static struct ketama *backupkt = NULL;
+static struct cluster *cluster = NULL; /* newest memcached server list */
+static pthread_mutex_t cluster_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *conffile = NULL; /* server list reloaded on SIGHUP, see -F */
+static struct event ev_reload;
+static struct event ev_term, ev_int;
 
 static char *socketpath = NULL;
 static int unixfd = -1;
 static struct event ev_unix;
 
 static int maxidle = 20; /* max keep alive connections for one memcached server */
+static int muxconns = 0; /* persistent pipelined connections for one memcached server, 0 is off */
+static int use_uring = 0; /* write with io_uring, batched for one loop */
+
+static int nthreads = 1; /* worker threads, 1 means everything runs in main loop */
+static struct worker *workers = NULL;
+static int nextworker = 0;
+static __thread struct worker *curworker = NULL;
+static __thread struct buffer_cache buffer_caches[BUFFER_CLASSES];
+
+/* free structs kept for reuse by each thread */
+static __thread conn *free_conns = NULL;
+static __thread struct server *free_servers = NULL;
+static __thread command *free_commands = NULL;
+static __thread query *free_queries = NULL;
+static __thread int nfree_conns = 0, nfree_servers = 0, nfree_commands = 0, nfree_queries = 0;
 
 static struct event ev_timer;
 time_t cur_ts;
+
+static struct ncsegment *ncache = NULL; /* near cache of hot keys, NULL is off */
+static size_t ncache_size = 0;
+static int ncache_ttl = 1;
+static int hashfunc = KETAMA_HASH_MD5; /* hash of keys, see -H */
+static int engine = KETAMA_ENGINE_RING; /* distribution of keys over servers, see -d */
+static int vnodes = 500; /* virtual nodes of each server on ketama ring, see -V */
+static int eject_fails = 0; /* eject server after failures in a row, 0 is off, see -E */
+static int reroute = 0; /* keys of ejected servers go to the next server, see -R */
+static int coalesce = 0; /* concurrent GETs of one key share one query, see -G */
+static int latency_epoch = 0; /* bumped by stats latency reset */
+static time_t latency_since = 0;
+static int connect_timeout = 0, write_timeout = 0, read_timeout = 0, total_timeout = 0; /* milliseconds, 0 is off, see -T */
+
+/* counts update commands, key_stamps[] keeps the last one for keys of same hash */
+static unsigned long long update_clock = 0;
+static unsigned long long key_stamps[KEY_STAMPS];
 char cur_ts_str[128];
 
 static void drive_client(const int, const short, void *);
-static void drive_backup_server(const int, const short, void *);
-static void drive_memcached_server(const int, const short, void *);
-static void finish_transcation(conn *);
-static void do_transcation(conn *);
-static void start_magent_transcation(conn *);
-static void out_string(conn *, const char *);
-static void process_update_response(conn *);
-static void process_get_response(conn *, int);
+static void drive_server(const int, const short, void *);
+static void finish_transcation(command *);
+static void do_transcation(command *);
+static void start_magent_transcation(command *);
+static void out_string(command *, const char *);
+static int process_update_response(struct server *, query *);
+static int process_get_response(struct server *, query *);
+static void finish_value(struct server *, query *);
 static void append_buffer_to_list(list *, buffer *);
-static void try_backup_server(conn *);
+static void try_backup_server(command *);
+static void dispatch_get_keys(command *, int *, int, int);
+static void finish_get_transcation(command *);
+static void finish_query(query *);
+static void coalesce_unlink(struct pending *);
+static int process_commands(conn *, command *);
+static void server_set_event(struct server *, int);
+static void server_fail(struct server *);
+static void flush_servers(const int, const short, void *);
+static void server_close(struct server *);
+static void server_result(struct server *, int);
+static void server_timeout(void *);
+static void command_timeout(void *);
+static void binary_reply(command *);
+static int binary_data_end(command *);
+static int read_data_block(conn *, command *);
 
 static const char resivion[] __attribute__((used)) = { "$Id$" };
 
@@ -258,14 +737,29 @@ show_help(void)
 		   "  -u uid\n" 
 		   "  -g gid\n"
 		   "  -p port, default is 11211. (0 to disable tcp support)\n"
-		   "  -s ip:port, set memcached server ip and port\n"
-		   "  -b ip:port, set backup memcached server ip and port\n"
+		   "  -s ip:port[:weight], set memcached server ip and port, weight of keys with -k/-d, default is 100, must be the same for all with -d jump\n"
+		   "  -b ip:port[:weight], set backup memcached server ip and port\n"
+		   "  -F file, read servers from file instead of -s/-b, reloaded on SIGHUP, lines are \"server ip:port[:weight]\" or \"backup ip:port[:weight]\"\n"
 		   "  -l ip, local bind ip address, default is 0.0.0.0\n"
 		   "  -n number, set max connections, default is 4096\n"
 		   "  -D don't go to background\n"
-		   "  -k use ketama key allocation algorithm\n"
+		   "  -k use ketama key allocation algorithm, same as -d ketama\n"
+		   "  -d ketama|jump|maglev|rendezvous, consistent hashing of keys, jump only allows adding/removing the last servers and has no weights\n"
+		   "  -V number, virtual nodes of each server on ketama ring, 4 points for each, default is 500\n"
+		   "  -H md5|murmur, hash of keys, default is md5 for ketama and djb otherwise, murmur is faster but routes keys differently\n"
 		   "  -f file, unix socket path to listen on. default is off\n"
 		   "  -i number, set max keep alive connections for one memcached server, default is 20\n"
+		   "  -t number, set worker threads, default is 1\n"
+		   "  -m number, pipeline requests over number persistent connections for one memcached server, default is 0(off)\n"
+		   "  -U write to clients and memcached servers with io_uring, batched for one event loop (linux only)\n"
+		   "  -c number, cache hot keys of GET/GETS in number megabytes, default is 0(off)\n"
+		   "  -e seconds, expire time of cached keys, default is 1\n"
+		   "  -G coalesce concurrent GETs of the same key into one request\n"
+		   "  -E number, eject memcached server after number failed connections in a row, probe it to rejoin, default is 0(off)\n"
+		   "  -R keys of ejected memcached servers go to the next server with -k/-d, instead of backup servers\n"
+		   "  -T connect,write,read[,total], timeouts in milliseconds of memcached servers and of whole command, one number\n"
+		   "     sets the first three, late servers fail like broken ones, late commands get SERVER_ERROR, default is 0(off)\n"
+		   "  -a port, serve counters and latencies over http in Prometheus text format, GET /metrics, default is 0(off)\n"
 		   "  -v verbose\n"
 		   "\n";
 	fprintf(stderr, b, strlen(b));
@@ -287,27 +781,81 @@ hashme(char *str)
 	return hash;
 }
 
+/* size class of buffer length, BUFFER_CLASSES if too big to cache */
+static int
+buffer_class(size_t size)
+{
+	int i;
+	size_t len = BUFFER_CLASS_MIN;
+
+	for (i = 0; i < BUFFER_CLASSES; i ++, len <<= 1) {
+		if (size <= len) break;
+	}
+
+	return i;
+}
+
+/* buffer and its data are one block, taken from free list of size class
+ * if possible, data is not zeroed
+ */
 static buffer *
 buffer_init_size(int size)
 {
 	buffer *b;
+	struct buffer_cache *bc = NULL;
+	size_t len;
+	int i;
 
 	if (size <= 0) return NULL;
-	b = (struct buffer *) calloc(sizeof(struct buffer), 1);
-	if (b == NULL) return NULL;
 
-	size +=  BUFFER_PIECE_SIZE - (size %  BUFFER_PIECE_SIZE);
+	i = buffer_class(size);
+	if (i < BUFFER_CLASSES) {
+		bc = buffer_caches + i;
+		len = BUFFER_CLASS_MIN << i;
+	} else {
+		len = size + BUFFER_PIECE_SIZE - (size %  BUFFER_PIECE_SIZE);
+	}
 
-	b->ptr = (char *) calloc(1, size);
-	if (b->ptr == NULL) {
-		free(b);
-		return NULL;
+	if (bc && bc->first) {
+		b = bc->first;
+		bc->first = b->next;
+		bc->bytes -= len;
+	} else {
+		b = (struct buffer *) malloc(sizeof(struct buffer) + len);
+		if (b == NULL) return NULL;
+		b->ptr = (char *) (b + 1);
+		b->len = len;
 	}
+	if (curworker) curworker->buffered += len;
 
-	b->len = size;
+	b->used = b->size = 0;
+	b->next = NULL;
 	return b;
 }
 
+/* add/delete read and write events of one fd, only the ones changed,
+ * events stay assigned for the whole life of fd
+ */
+static void
+update_events(struct event *rev, struct event *wev, int *cur, int flags)
+{
+	if ((*cur ^ flags) & EV_READ) {
+		if (flags & EV_READ)
+			event_add(rev, 0);
+		else
+			event_del(rev);
+	}
+
+	if ((*cur ^ flags) & EV_WRITE) {
+		if (flags & EV_WRITE)
+			event_add(wev, 0);
+		else
+			event_del(wev);
+	}
+
+	*cur = flags;
+}
+
 static void
 set_nonblock(int fd)
 {
@@ -322,12 +870,27 @@ set_nonblock(int fd)
 	}
 }
 
+/* put buffer back to free list of its size class */
 static void
 buffer_free(buffer *b)
 {
+	struct buffer_cache *bc;
+	int i;
+
 	if (!b) return;
 
-	free(b->ptr);
+	if (curworker) curworker->buffered -= b->len;
+	i = buffer_class(b->len);
+	if (i < BUFFER_CLASSES) {
+		bc = buffer_caches + i;
+		if (bc->bytes + b->len <= BUFFER_CACHE_SIZE) {
+			b->next = bc->first;
+			bc->first = b;
+			bc->bytes += b->len;
+			return;
+		}
+	}
+
 	free(b);
 }
 
@@ -509,176 +1072,542 @@ tokenize_command(char *command, token_t *tokens, const size_t max_tokens)
 	return ntokens;
 }
 
-static void
-server_free(struct server *s)
+/* current tick of timing wheel */
+static unsigned long long
+wheel_now(void)
 {
-	if (s == NULL) return;
+	struct timespec ts;
 
-	if (s->sfd > 0) {
-		event_del(&(s->ev));
-		close(s->sfd);
-	}
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ((unsigned long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000) / WHEEL_TICK;
+}
 
-	list_free(s->request, 0);
-	list_free(s->response, 0);
-	free(s);
+/* tick of deadline ms from now, 0 if ms is 0 (no deadline) */
+static unsigned long long
+wheel_deadline(int ms)
+{
+	if (ms <= 0) return 0;
+	/* one more tick, slot may be half done */
+	return wheel_now() + (ms + WHEEL_TICK - 1) / WHEEL_TICK + 1;
 }
 
 static void
-pool_server_handler(const int fd, const short which, void *arg)
+wheel_del(struct wtimer *t)
 {
-	struct server *s;
-	struct matrix *m;
-	char buf[128];
-	int toread = 0, toexit = 0, i;
+	if (t->prev == NULL) return;
 
-	if (arg == NULL) return;
-	s = (struct server *)arg;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = t->next = NULL;
+	curworker->wcount --;
+}
 
-	if (!(which & EV_READ)) return;
-   
-	/* get the byte counts of read */
-	if (ioctl(s->sfd, FIONREAD, &toread) || toread == 0) {
-		toexit = 1;
-	} else {
-		if (toread > 128) toread = 128;
+/* link t into slot of its expire tick */
+static void
+wheel_link(struct wtimer *t)
+{
+	struct wtimer *h = curworker->wheel + (t->expire & (WHEEL_SLOTS - 1));
+	struct timeval tv;
 
-		if (0 == read(s->sfd, buf, toread)) toexit = 1;
+	t->next = h;
+	t->prev = h->prev;
+	h->prev->next = t;
+	h->prev = t;
+
+	if (curworker->wcount ++ == 0) {
+		/* wheel was idle, catch up and start ticking */
+		curworker->wtick = wheel_now();
+		tv.tv_sec = 0;
+		tv.tv_usec = WHEEL_TICK * 1000;
+		evtimer_add(&(curworker->wheel_ev), &tv);
 	}
+}
 
-	if (toexit) {
-		if (verbose_mode)
-			fprintf(stderr, "%s: (%s.%d) CLOSE POOL SERVER FD %d\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
-		event_del(&(s->ev));
-		close(s->sfd);
+/* (re)arm t to call fire(arg) at tick expire */
+static void
+wheel_set(struct wtimer *t, unsigned long long expire, void (*fire)(void *), void *arg)
+{
+	if (t->prev && t->expire == expire) return;
 
-		list_free(s->request, 0);
-		list_free(s->response, 0);
-		m = s->owner;
-		if (m) {
-			if (s->pool_idx <= 0) {
-				fprintf(stderr, "%s: (%s.%d) POOL SERVER FD %d, IDX %d <= 0\n",
-						cur_ts_str, __FILE__, __LINE__, s->sfd, s->pool_idx);
-			} else {
-				/* remove from list */
-				for (i = s->pool_idx; i < m->used; i ++) {
-					m->pool[i-1] = m->pool[i];
-					m->pool[i-1]->pool_idx = i;
-				}
-				-- m->used;
-			}
-		}
-		free(s);
-	}
+	wheel_del(t);
+	t->expire = expire;
+	t->fire = fire;
+	t->arg = arg;
+	wheel_link(t);
 }
 
-/* put server connection into keep alive pool */
-static void
-put_server_into_pool(struct server *s)
+/* monotonic clock in microseconds, see stats latency */
+static unsigned long long
+latency_now(void)
 {
-	struct matrix *m;
-	struct server **p;
+	struct timespec ts;
 
-	if (s == NULL) return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	if (s->owner == NULL || s->state != SERVER_CONNECTED || s->sfd <= 0) {
-		server_free(s);
-		return;
-	}
+/* exact below 2 * LATENCY_SUB microseconds, then LATENCY_SUB buckets for each power of 2 */
+static int
+latency_bucket(unsigned long long us)
+{
+	int shift;
 
-	list_free(s->request, 1);
-	list_free(s->response, 1);
-	s->pos = s->has_response_header = s->remove_trail = 0;
+	if (us < 2 * LATENCY_SUB) return (int) us;
+	if (us >= (1ULL << 31)) us = (1ULL << 31) - 1;
 
-	m = s->owner;
-	if (m->size == 0) {
-		m->pool = (struct server **) calloc(sizeof(struct server *), STEP);
-		if (m->pool == NULL) {
-			fprintf(stderr, "%s: (%s.%d) out of memory for pool allocation\n", cur_ts_str, __FILE__, __LINE__);
-			m = NULL;
-		} else {
-			m->size = STEP;
-			m->used = 0;
-		}
-	} else if (m->used == m->size) {
-		if (m->size < maxidle) {
-			p = (struct server **)realloc(m->pool, sizeof(struct server *)*(m->size + STEP));
-			if (p == NULL) {
-				fprintf(stderr, "%s: (%s.%d) out of memory for pool reallocation\n", cur_ts_str, __FILE__, __LINE__);
-				m = NULL;
-			} else {
-				m->pool = p;
-				m->size += STEP;
-			}
-		} else {
-			m = NULL;
-		}
-	}
+	shift = 63 - __builtin_clzll(us) - LATENCY_SUB_BITS;
+	return shift * LATENCY_SUB + (int) (us >> shift);
+}
 
-	if (m != NULL) {
-		if (verbose_mode)
-			fprintf(stderr, "%s: (%s.%d) PUT SERVER FD %d -> POOL\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
-		m->pool[m->used ++] = s;
-		s->pool_idx = m->used;
-		event_del(&(s->ev));
+/* middle of bucket i in microseconds */
+static unsigned long long
+latency_value(int i)
+{
+	int shift;
 
-		event_set(&(s->ev), s->sfd, EV_READ|EV_PERSIST, pool_server_handler, (void *) s);
-		event_add(&(s->ev), 0);
-	} else {
-		server_free(s);
-	}
+	if (i < 2 * LATENCY_SUB) return i;
 
+	shift = i / LATENCY_SUB - 1;
+	return ((unsigned long long) (i - shift * LATENCY_SUB) << shift) + (1ULL << shift) / 2;
 }
 
 static void
-server_error(conn *c, const char *s)
+latency_add(struct histogram *h, unsigned long long us)
 {
+	h->counts[latency_bucket(us)] ++;
+	h->n ++;
+	h->sum += us;
+	if (us > h->max) h->max = us;
+}
+
+/* histograms of worker are cleared by the worker itself after stats latency reset,
+ * stats never reads them half cleared
+ */
+static void
+latency_check(struct worker *w)
+{
+	if (w->latepoch == latency_epoch) return;
+
+	pthread_mutex_lock(&(w->hotlock));
+	if (w->latency)
+		memset(w->latency, 0, sizeof(struct latency) * w->cl->matrixcnt);
+	memset(w->cmdlat, 0, sizeof(w->cmdlat));
+	w->latepoch = latency_epoch;
+	pthread_mutex_unlock(&(w->hotlock));
+}
+
+/* index of m in servers of worker, -1 for backup servers and removed ones */
+static int
+server_index(struct matrix *m)
+{
+	if (m == NULL || m->idx < 0 || m->idx >= curworker->cl->matrixcnt || curworker->matrixs[m->idx] != m)
+		return -1;
+
+	return m->idx;
+}
+
+/* counters of memcached server m, NULL for backup servers */
+static struct srvstat *
+server_stat(struct matrix *m)
+{
+	int idx = server_index(m);
+
+	return (idx < 0 || curworker->srvstats == NULL) ? NULL : curworker->srvstats + idx;
+}
+
+/* latencies of memcached server of s, NULL for backup servers */
+static struct latency *
+server_latency(struct server *s)
+{
+	int idx = server_index(s->owner);
+
+	if (idx < 0 || curworker->latency == NULL) return NULL;
+
+	latency_check(curworker);
+	return curworker->latency + idx;
+}
+
+/* reply of q from memcached server s started or finished,
+ * replies parsed together share one clock read in *now
+ */
+static void
+query_latency(struct server *s, query *q, int finished, unsigned long long *now)
+{
+	struct latency *l;
+
+	q->replied = 1;
+	if (q->stamp == 0 || (l = server_latency(s)) == NULL) return;
+
+	if (*now == 0) *now = latency_now();
+	latency_add(finished ? &(l->total) : &(l->first), *now - q->stamp);
+}
+
+/* new server struct, reused from free list if possible */
+static struct server *
+server_new(void)
+{
+	struct server *s;
+
+	if (free_servers) {
+		s = free_servers;
+		free_servers = s->next;
+		nfree_servers --;
+
+		s->ev_flags = s->pool_idx = 0;
+		s->qhead = s->qtail = NULL;
+		s->whead = s->wtail = NULL;
+		s->is_mux = s->mux_idx = 0;
+		s->next = NULL;
+		return s;
+	}
+
+	s = (struct server *) calloc(sizeof(struct server), 1);
+	if (s == NULL) return NULL;
+
+	s->request = list_init();
+	if (s->request == NULL) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+/* free server removed by reload after its last connection */
+static void
+matrix_put(struct matrix *m)
+{
+	if (m == NULL || m->idx >= 0 || m->conns > 0) return;
+
+	free(m->pool);
+	free(m->mux);
+	free(m->ip);
+	free(m);
+}
+
+static void
+server_free(struct server *s)
+{
+	struct server **p;
+
+	if (s == NULL) return;
+
+	if (s->sfd > 0) {
+		update_events(&(s->ev), &(s->wev), &(s->ev_flags), 0);
+		close(s->sfd);
+	}
+
+	if (s->flushing) {
+		/* not flushed yet */
+		for (p = &(curworker->flushq); *p != s; p = &((*p)->flushnext)) ;
+		*p = s->flushnext;
+		s->flushnext = NULL;
+		s->flushing = 0;
+	}
+
+	buffer_free(s->value);
+	s->value = NULL;
+
+	wheel_del(&(s->timer));
+	s->wexpire = s->rexpire = 0;
+
+	if (s->owner) {
+		s->owner->conns --;
+		matrix_put(s->owner);
+		s->owner = NULL;
+	}
+
+	if (nfree_servers < MAX_FREE_OBJECTS) {
+		list_free(s->request, 1);
+		s->next = free_servers;
+		free_servers = s;
+		nfree_servers ++;
+		return;
+	}
+
+	list_free(s->request, 0);
+	free(s);
+}
+
+static void
+pool_server_handler(const int fd, const short which, void *arg)
+{
+	struct server *s;
+	struct matrix *m;
+	char buf[128];
+	int r, i;
+
+	if (arg == NULL) return;
+	s = (struct server *)arg;
+
+	if (!(which & EV_READ)) return;
+
+	/* idle connection should not get data, EOF or error closes it */
+	curworker->syscalls ++;
+	r = read(s->sfd, buf, sizeof(buf));
+	if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+		if (verbose_mode)
+			fprintf(stderr, "%s: (%s.%d) CLOSE POOL SERVER FD %d\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
+		m = s->owner;
+		if (m) {
+			if (s->pool_idx <= 0) {
+				fprintf(stderr, "%s: (%s.%d) POOL SERVER FD %d, IDX %d <= 0\n",
+						cur_ts_str, __FILE__, __LINE__, s->sfd, s->pool_idx);
+			} else {
+				/* remove from list */
+				for (i = s->pool_idx; i < m->used; i ++) {
+					m->pool[i-1] = m->pool[i];
+					m->pool[i-1]->pool_idx = i;
+				}
+				-- m->used;
+			}
+		}
+		server_free(s);
+	}
+}
+
+/* put server connection into keep alive pool */
+static void
+put_server_into_pool(struct server *s)
+{
+	struct matrix *m;
+	struct server **p;
+
+	if (s == NULL) return;
+
+	if (s->owner == NULL || s->state != SERVER_CONNECTED || s->sfd <= 0 || s->qhead) {
+		server_free(s);
+		return;
+	}
+
+	if (s->owner->idx < 0) {
+		/* server removed by reload */
+		server_close(s);
+		return;
+	}
+
+	list_free(s->request, 1);
+	s->pos = s->has_response_header = 0;
+	wheel_del(&(s->timer));
+	s->wexpire = s->rexpire = 0;
+
+	m = s->owner;
+	if (m->size == 0) {
+		m->pool = (struct server **) calloc(sizeof(struct server *), STEP);
+		if (m->pool == NULL) {
+			fprintf(stderr, "%s: (%s.%d) out of memory for pool allocation\n", cur_ts_str, __FILE__, __LINE__);
+			m = NULL;
+		} else {
+			m->size = STEP;
+			m->used = 0;
+		}
+	} else if (m->used == m->size) {
+		if (m->size < maxidle) {
+			p = (struct server **)realloc(m->pool, sizeof(struct server *)*(m->size + STEP));
+			if (p == NULL) {
+				fprintf(stderr, "%s: (%s.%d) out of memory for pool reallocation\n", cur_ts_str, __FILE__, __LINE__);
+				m = NULL;
+			} else {
+				m->pool = p;
+				m->size += STEP;
+			}
+		} else {
+			m = NULL;
+		}
+	}
+
+	if (m != NULL) {
+		if (verbose_mode)
+			fprintf(stderr, "%s: (%s.%d) PUT SERVER FD %d -> POOL\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
+		m->pool[m->used ++] = s;
+		s->pool_idx = m->used;
+
+		/* drive_server() watches closing of idle connection */
+		server_set_event(s, EV_READ);
+	} else {
+		server_free(s);
+	}
+
+}
+
+static query *
+query_new(command *cmd)
+{
+	query *q;
+
+	if (free_queries) {
+		q = free_queries;
+		free_queries = q->next;
+		nfree_queries --;
+		memset(q, 0, sizeof(query));
+	} else {
+		q = (query *) calloc(sizeof(query), 1);
+		if (q == NULL) return NULL;
+	}
+
+	q->curkey = -1;
+	q->cmd = cmd;
+	if (cmd) {
+		q->cnext = cmd->queries;
+		if (cmd->queries) cmd->queries->cprev = q;
+		cmd->queries = q;
+	}
+
+	return q;
+}
+
+/* nobody waits for the reply of query any more */
+static void
+query_unlink(query *q)
+{
+	command *cmd = q->cmd;
 	int i;
 
-	if (c == NULL) return;
+	if (cmd == NULL) return;
+
+	/* keys of leader point into command */
+	for (i = 0; q->pend && i < q->keycnt; i ++)
+		coalesce_unlink(q->pend + i);
+
+	if (q->cprev)
+		q->cprev->cnext = q->cnext;
+	else
+		cmd->queries = q->cnext;
+	if (q->cnext) q->cnext->cprev = q->cprev;
+
+	q->cprev = q->cnext = NULL;
+	q->cmd = NULL;
+}
+
+static void
+query_free(query *q)
+{
+	if (q == NULL) return;
+
+	query_unlink(q);
+	free(q->keyidx);
+	free(q->pend);
+
+	if (nfree_queries < MAX_FREE_OBJECTS) {
+		q->next = free_queries;
+		free_queries = q;
+		nfree_queries ++;
+		return;
+	}
+
+	free(q);
+}
+
+/* append a new command to client, NULL if out of memory */
+static command *
+command_new(conn *c)
+{
+	command *cmd;
+
+	if (free_commands) {
+		cmd = free_commands;
+		free_commands = cmd->next;
+		nfree_commands --;
+		memset(cmd, 0, sizeof(command));
+	} else {
+		cmd = (command *) calloc(sizeof(command), 1);
+		if (cmd == NULL) return NULL;
+	}
+
+	cmd->client = c;
+	if (c->cmdtail)
+		c->cmdtail->next = cmd;
+	else
+		c->cmds = cmd;
+	c->cmdtail = cmd;
+	c->ncmds ++;
+
+	return cmd;
+}
+
+/* release everything but the output buffer of command */
+static void
+command_clear(command *cmd)
+{
+	int i;
+
+	wheel_del(&(cmd->timer));
+
+	/* detach queries in flight, replies will be dropped */
+	while (cmd->queries)
+		query_unlink(cmd->queries);
+
+	if (cmd->values) {
+		for (i = 0; i < cmd->keycount; i ++)
+			list_free(cmd->values + i, 1);
+		free(cmd->values);
+		cmd->values = NULL;
+	}
 
-	if (c->srv) {
-		server_free(c->srv);
-		c->srv = NULL;
+	if (cmd->keys) {
+		for (i = 0; i < cmd->keycount; i ++)
+			free(cmd->keys[i]);
+		free(cmd->keys);
+		cmd->keys = NULL;
 	}
+	cmd->keycount = 0;
+
+	list_free(&cmd->request, 1);
+}
+
+static void
+command_free(command *cmd)
+{
+	if (cmd == NULL) return;
 
-	if (c->keys) {
-		for (i = 0; i < c->keycount; i ++)
-			free(c->keys[i]);
-		free(c->keys);
-		c->keys = NULL;
+	command_clear(cmd);
+	list_free(&cmd->response, 1);
+	free(cmd->bin);
+
+	if (nfree_commands < MAX_FREE_OBJECTS) {
+		cmd->next = free_commands;
+		free_commands = cmd;
+		nfree_commands ++;
+		return;
 	}
 
-	c->pos = c->keycount = c->keyidx = 0;
-	list_free(c->request, 1);
-	list_free(c->response, 1);
-	out_string(c, s);
+	free(cmd);
 }
 
+
 /* return 0 if ok, return 1 if failed */
 static int
 socket_connect(struct server *s)
 {
+	struct latency *l;
 	socklen_t servlen;
 
 	if (s == NULL || s->sfd <= 0 || s->state != SERVER_INIT) return 1;
 
 	servlen = sizeof(s->owner->dstaddr);
+	curworker->syscalls ++;
+	s->stamp = latency_now();
 	if (-1 == connect(s->sfd, (struct sockaddr *) &(s->owner->dstaddr), servlen)) {
 		if (errno != EINPROGRESS && errno != EALREADY)
 			return 1;
 		s->state = SERVER_CONNECTING;
 	} else {
 		s->state = SERVER_CONNECTED;
+		if ((l = server_latency(s)) != NULL)
+			latency_add(&(l->connect), latency_now() - s->stamp);
 	}
 
 	return 0;
 }
-
 static void
 conn_close(conn *c)
 {
-	int i;
+	command *cmd;
+	conn **p;
 
 	if (c == NULL) return;
 	
@@ -686,26 +1615,48 @@ conn_close(conn *c)
 	if (c->cfd > 0) {
 		if (verbose_mode)
 			fprintf(stderr, "%s: (%s.%d) CLOSE CLIENT CONNECTION FD %d\n", cur_ts_str, __FILE__, __LINE__, c->cfd);
-		event_del(&(c->ev));
+		update_events(&(c->ev), &(c->wev), &(c->ev_flags), 0);
 		close(c->cfd);
-		curconns --;
+		__sync_sub_and_fetch(&curconns, 1);
 		c->cfd = 0;
 	}
 
-	server_free(c->srv);
+	if (c->flushing) {
+		/* not flushed yet */
+		for (p = &(curworker->cflushq); *p != c; p = &((*p)->flushnext)) ;
+		*p = c->flushnext;
+		c->flushnext = NULL;
+		c->flushing = 0;
+	}
+
+	while (c->cmds) {
+		cmd = c->cmds;
+		c->cmds = cmd->next;
+		command_free(cmd);
+	}
+	c->cmdtail = NULL;
+	c->ncmds = 0;
+
+	if (c->processing) {
+		/* process_commands() will free it */
+		c->closed = 1;
+		return;
+	}
 
-	if (c->keys) {
-		for (i = 0; i < c->keycount; i ++)
-			free(c->keys[i]);
-		free(c->keys);
-		c->keys = NULL;
+	if (nfree_conns < MAX_FREE_OBJECTS) {
+		list_free(c->response, 1);
+		c->next = free_conns;
+		free_conns = c;
+		nfree_conns ++;
+		return;
 	}
 
-	list_free(c->request, 0);
 	list_free(c->response, 0);
 	free(c);
 }
 
+
+
 /* ------------- from lighttpd's network_writev.c ------------ */
 
 #ifndef UIO_MAXIOV
@@ -729,17 +1680,14 @@ conn_close(conn *c)
 # endif
 #endif
 
-/* return 0 if success */
-static int
-writev_list(int fd, list *l)
+/* fill chunks with unwritten data of buffers, return number of chunks */
+static size_t
+writev_prepare(list *l, struct iovec *chunks, size_t max_chunks)
 {
-	size_t num_chunks, i, num_bytes = 0, toSend, r, r2;
-	struct iovec chunks[UIO_MAXIOV];
+	size_t num_chunks, i, num_bytes = 0, toSend;
 	buffer *b;
 
-	if (l == NULL || l->first == NULL || fd <= 0) return 0;
-
-	for (num_chunks = 0, b = l->first; b && num_chunks < UIO_MAXIOV; num_chunks ++, b = b->next) ;
+	for (num_chunks = 0, b = l->first; b && num_chunks < max_chunks; num_chunks ++, b = b->next) ;
 
 	for (i = 0, b = l->first; i < num_chunks; b = b->next, i ++) {
 		if (b->size == 0) {
@@ -764,26 +1712,23 @@ writev_list(int fd, list *l)
 		}
 	}
 
-	if ((r = writev(fd, chunks, num_chunks)) < 0) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			return 0; /* try again */
-			break;
-		case EPIPE:
-		case ECONNRESET:
-			return -2; /* connection closed */
-			break;
-		default:
-			return -1; /* error */
-			break;
-		}
-	}
+	return num_chunks;
+}
 
-	r2 = r;
+/* r bytes of chunks are written, free finished buffers */
+static void
+writev_finish(list *l, struct iovec *chunks, size_t num_chunks, size_t r)
+{
+	size_t i;
+	buffer *b;
 
 	for (i = 0, b = l->first; i < num_chunks; b = b->next, i ++) {
-		if (r >= (ssize_t)chunks[i].iov_len) {
+		if (b->size == 0) {
+			/* skipped by writev_prepare() */
+			i --;
+			continue;
+		}
+		if (r >= chunks[i].iov_len) {
 			r -= chunks[i].iov_len;
 			b->used += chunks[i].iov_len;
 		} else {
@@ -794,1154 +1739,4534 @@ writev_list(int fd, list *l)
 	}
 
 	remove_finished_buffers(l);
-	return r2;
 }
 
-/* --------- end here ----------- */
-
-static void
-out_string(conn *c, const char *str)
+/* return 0 if success */
+static int
+writev_list(int fd, list *l)
 {
-	/* append str to c->wbuf */
-	int len = 0;
-	buffer *b;
-
-	if (c == NULL || str == NULL || str[0] == '\0') return;
-	
-	len = strlen(str);
+	size_t num_chunks;
+	ssize_t r;
+	struct iovec chunks[UIO_MAXIOV];
 
-	b = buffer_init_size(len + 3);
-	if (b == NULL) return;
+	if (l == NULL || l->first == NULL || fd <= 0) return 0;
 
-	memcpy(b->ptr, str, len);
-	memcpy(b->ptr + len, "\r\n", 2);
-	b->size = len + 2;
-	b->ptr[b->size] = '\0';
-	
-	append_buffer_to_list(c->response, b);
+	num_chunks = writev_prepare(l, chunks, UIO_MAXIOV);
 
-	if (writev_list(c->cfd, c->response) >= 0) {
-		if (c->response->first && (c->ev_flags != EV_WRITE)) {
-			/* update event handler */
-			event_del(&(c->ev));
-			event_set(&(c->ev), c->cfd, EV_WRITE|EV_PERSIST, drive_client, (void *) c);
-			event_add(&(c->ev), 0);
-			c->ev_flags = EV_WRITE;
+	curworker->syscalls ++;
+	if ((r = writev(fd, chunks, num_chunks)) < 0) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return 0; /* try again */
+			break;
+		case EPIPE:
+		case ECONNRESET:
+			return -2; /* connection closed */
+			break;
+		default:
+			return -1; /* error */
+			break;
 		}
-	} else {
-		/* client reset/close connection*/
-		conn_close(c);
 	}
+
+	writev_finish(l, chunks, num_chunks, r);
+	return r;
 }
 
-/* finish proxy transcation */
-static void
-finish_transcation(conn *c)
+/* --------- end here ----------- */
+
+#ifdef HAVE_IO_URING
+/* io_uring of one worker, only used to write many lists with one syscall */
+struct uring
 {
-	int i;
+	int fd;
 
-	if (c == NULL) return;
+	unsigned *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
 
-	if (c->keys) {
-		for (i = 0; i < c->keycount; i ++)
-			free(c->keys[i]);
-		free(c->keys);
-		c->keys = NULL;
-		c->keycount = c->keyidx = 0;
-	}
+	int failed; /* stop using io_uring */
 
-	c->state = CLIENT_COMMAND;
-	list_free(c->request, 1);
-}
+	/* one slot for each write of a batch */
+	int nslots;
+	list *lists[URING_ENTRIES];
+	struct iovec iovs[URING_ENTRIES][URING_IOVS];
+	size_t niovs[URING_ENTRIES];
+	int res[URING_ENTRIES];
+};
 
-static void
-start_update_backupserver(conn *c)
+/* return NULL if io_uring is not available */
+static struct uring *
+uring_init(void)
 {
-	int size = 0, idx;
-	buffer *b, *r;
-	matrix *m;
-	server *s;
+	struct io_uring_params p;
+	struct uring *r;
+	char *sq, *cq;
+	size_t sqlen, cqlen;
+
+	r = (struct uring *) calloc(sizeof(struct uring), 1);
+	if (r == NULL) return NULL;
+
+	memset(&p, 0, sizeof(p));
+	r->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		free(r);
+		return NULL;
+	}
 
-	if (c == NULL) return;
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqlen > sqlen) sqlen = cqlen;
+		cqlen = sqlen;
+	}
 
-	if (c->flag.is_update_cmd == 0 || backupcnt == 0 || c->keycount != 1) return;
+	sq = mmap(NULL, sqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) goto failed;
 
-	/* start backup set server now */
-	b = c->request->first;
-	while(b) {
-		size += b->size;
-		b = b->next;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq = sq;
+	} else {
+		cq = mmap(NULL, cqlen, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) goto failed;
 	}
 
-	if (size == 0) return;
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) goto failed;
 
-	r = buffer_init_size(size+1);
-	if (r == NULL) return;
+	r->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+	r->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) (sq + p.sq_off.array);
+	r->cq_head = (unsigned *) (cq + p.cq_off.head);
+	r->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+	r->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
 
-	b = c->request->first;
-	while(b) {
-		if (b->size > 0 ) {
-			memcpy(r->ptr + r->size, b->ptr, b->size);
-			r->size += b->size;
-		}
-		b = b->next;
-	}
+	return r;
 
-	if (use_ketama && backupkt) {
-		idx = get_server(backupkt, c->keys[0]);
-		if (idx < 0) {
-			/* fall back to round selection */
-			idx = hashme(c->keys[0])%backupcnt;
-		}
-	} else {
-		/* just round selection */
-		idx = hashme(c->keys[0])%backupcnt;
-	}
+failed:
+	/* mappings go away with process */
+	close(r->fd);
+	free(r);
+	return NULL;
+}
+
+/* add writev of list to batch, return slot or -1 if batch is full */
+static int
+uring_prep_writev(struct uring *r, int fd, list *l)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+	int i;
 
-	m = backups + idx;
+	if (r->nslots == URING_ENTRIES) return -1;
+
+	i = r->nslots ++;
+	r->lists[i] = l;
+	r->niovs[i] = (fd > 0 && l->first) ? writev_prepare(l, r->iovs[i], URING_IOVS) : 0;
+	r->res[i] = r->niovs[i] ? -EINPROGRESS : 0; /* until its completion is reaped */
+	if (r->niovs[i] == 0) return i; /* nothing to write */
+
+	tail = *r->sq_tail;
+	sqe = r->sqes + (tail & *r->sq_mask);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) r->iovs[i];
+	sqe->len = r->niovs[i];
+	sqe->rw_flags = RWF_NOWAIT; /* EAGAIN instead of waiting for socket */
+	sqe->user_data = i;
+	r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return i;
+}
 
-	if (m->pool && (m->used > 0)) {
-		s = m->pool[--m->used];
-		s->pool_idx = 0;
-		if (verbose_mode)
-			fprintf(stderr, "%s: (%s.%d) GET SERVER FD %d <- POOL\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
-	} else {
-		s = (struct server *) calloc(sizeof(struct server), 1);
-		if (s == NULL) {
-			buffer_free(r);
-			return;
-		}
-		s->request = list_init();
-		s->response = list_init();
-		s->state = SERVER_INIT;
+/* submit batch with one syscall and wait for it, writes never block
+ * with RWF_NOWAIT, r->res[] gets bytes written or -errno of each slot
+ */
+static void
+uring_submit(struct uring *r)
+{
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	int i, n = 0, done = 0, ret, failed;
+
+	for (i = 0; i < r->nslots; i ++) {
+		if (r->niovs[i] > 0) n ++;
 	}
-	s->owner = m;
 
-	if (verbose_mode)
-		fprintf(stderr, "%s: (%s.%d) BACKUP KEY \"%s\" -> %s:%d\n", cur_ts_str, __FILE__, __LINE__, c->keys[0], m->ip, m->port);
+	while (done < n) {
+		curworker->syscalls ++;
+		ret = syscall(__NR_io_uring_enter, r->fd, done ? 0 : n, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+		failed = (ret < 0 && errno != EINTR);
+
+		/* completions already posted are reaped even if io_uring_enter() failed */
+		head = *r->cq_head;
+		while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = r->cqes + (head & *r->cq_mask);
+			if (cqe->user_data < (unsigned) r->nslots)
+				r->res[cqe->user_data] = cqe->res;
+			head ++;
+			done ++;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
 
-	if (s->sfd <= 0) {
-		s->sfd = socket(AF_INET, SOCK_STREAM, 0); 
-		if (s->sfd < 0) {
-			fprintf(stderr, "%s: (%s.%d) CAN'T CREATE TCP SOCKET TO MEMCACHED\n", cur_ts_str, __FILE__, __LINE__);
-			free(s);
-			buffer_free(r);
-			return;
+		if (failed) {
+			fprintf(stderr, "%s: (%s.%d) IO_URING_ENTER FAILED: %s\n", cur_ts_str, __FILE__, __LINE__, strerror(errno));
+			r->failed = 1;
+			break;
 		}
-		set_nonblock(s->sfd);
 	}
 
-	append_buffer_to_list(s->request, r);
+	for (i = 0; i < r->nslots; i ++) {
+		if (r->niovs[i] == 0) continue;
 
-	if (s->state == SERVER_INIT && socket_connect(s)) {
-		/* server error */
-		server_free(s);
-		return;
+		if (r->res[i] == -EINPROGRESS) {
+			/* may still be written by kernel, writing it again could duplicate
+			 * or interleave bytes, connection is given up
+			 */
+			r->res[i] = -EIO;
+		} else if (r->res[i] > 0) {
+			/* move written buffers */
+			writev_finish(r->lists[i], r->iovs[i], r->niovs[i], r->res[i]);
+		} else if (r->res[i] == -EOPNOTSUPP || r->res[i] == -EINVAL) {
+			/* no RWF_NOWAIT, try again with writev() */
+			r->failed = 1;
+			r->res[i] = 0;
+		} else if (r->res[i] == -EAGAIN || r->res[i] == -EINTR) {
+			r->res[i] = 0;
+		}
 	}
-
-	/* server event handler */
-	memset(&(s->ev), 0, sizeof(struct event));
-	event_set(&(s->ev), s->sfd, EV_PERSIST|EV_WRITE, drive_backup_server, (void *)s);
-	event_add(&(s->ev), 0);
 }
+#endif
 
-/* start whole memcache agent transcation */
+/* update client event handler, write first, read if line buffer has room */
 static void
-start_magent_transcation(conn *c)
+client_set_event(conn *c)
 {
-	if (c == NULL) return;
+	int flags;
 
-	if (c->flag.is_update_cmd  && backupcnt > 0 && c->keycount == 1)
-		start_update_backupserver(c);
+	if (c->response->first)
+		flags = EV_WRITE;
+	else if (c->pos < BUFFERLEN)
+		flags = EV_READ;
+	else
+		flags = 0; /* too many commands in flight, wait for them */
 
-	/* start first transaction to normal server */
-	do_transcation(c);
+	update_events(&(c->ev), &(c->wev), &(c->ev_flags), flags);
 }
 
-/* start/repeat memcached proxy transcations */
-static void
-do_transcation(conn *c)
+/* write pending responses to client
+ * return 0 if ok, return -1 if client closed
+ */
+static int
+client_write(conn *c)
 {
-	int idx;
-	struct matrix *m;
-	struct server *s;
-	char *key = NULL;
-	buffer *b;
-
-	if (c == NULL) return;
-
-	c->flag.is_backup = 0;
-	
-	if (c->flag.is_get_cmd) {
-		if (c->keyidx >= c->keycount) {
-			/* end of get transcation */
-			finish_transcation(c);
-			return;
+	int r;
+
+#ifdef HAVE_IO_URING
+	if (curworker->ring && c->response->first && !(c->ev_flags & EV_WRITE)) {
+		/* written with other clients and servers by flush_servers() */
+		if (c->flushing == 0) {
+			c->flushing = 1;
+			c->flushnext = curworker->cflushq;
+			if (curworker->cflushq == NULL && curworker->flushq == NULL)
+				event_active(&(curworker->flush_ev), EV_WRITE, 0);
+			curworker->cflushq = c;
 		}
-		key = c->keys[c->keyidx++];
-		if (c->keyidx == c->keycount) c->flag.is_last_key = 1;
-	} else {
-		key = c->keys[0];
+		return 0;
 	}
+#endif
 
-	if (use_ketama && ketama) {
-		idx = get_server(ketama, key);
-		if (idx < 0) {
-			/* fall back to round selection */
-			idx = hashme(key)%matrixcnt;
-		}
-	} else {
-		/* just round selection */
-		idx = hashme(key)%matrixcnt;
+	if ((r = writev_list(c->cfd, c->response)) < 0) {
+		/* client reset/close connection*/
+		conn_close(c);
+		return -1;
 	}
+	curworker->client_written += r;
 
-	m = matrixs + idx;
+	client_set_event(c);
+	return 0;
+}
 
-	if (m->pool && (m->used > 0)) {
-		s = m->pool[--m->used];
-		s->pool_idx = 0;
-		if (verbose_mode)
-			fprintf(stderr, "%s: (%s.%d) GET SERVER FD %d <- POOL\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
-	} else {
-		s = (struct server *) calloc(sizeof(struct server), 1);
-		if (s == NULL) {
-			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+/* move output of finished commands to client in command order
+ * return 0 if ok, return -1 if client closed
+ */
+static int
+client_flush(conn *c)
+{
+	command *cmd;
+
+	while ((cmd = c->cmds) != NULL && cmd->flag.done) {
+		move_list(&cmd->response, c->response);
+		if (cmd->flag.is_quit) {
+			/* replies before quit may still wait for flush_servers() */
+			if (c->response->first)
+				writev_list(c->cfd, c->response);
 			conn_close(c);
-			return;
+			return -1;
 		}
-		s->request = list_init();
-		s->response = list_init();
-		s->state = SERVER_INIT;
+
+		c->cmds = cmd->next;
+		if (c->cmds == NULL) c->cmdtail = NULL;
+		c->ncmds --;
+		command_free(cmd);
 	}
-	s->owner = m;
-	c->srv = s;
 
-	if (verbose_mode) 
-		fprintf(stderr, "%s: (%s.%d) %s KEY \"%s\" -> %s:%d\n", cur_ts_str, __FILE__, __LINE__, c->flag.is_get_cmd?"GET":"SET", key, m->ip, m->port);
+	return client_write(c);
+}
 
-	if (s->sfd <= 0) {
-		s->sfd = socket(AF_INET, SOCK_STREAM, 0); 
-		if (s->sfd < 0) {
-			fprintf(stderr, "%s: (%s.%d) CAN'T CREATE TCP SOCKET TO MEMCACHED\n", cur_ts_str, __FILE__, __LINE__);
-			server_error(c, "SERVER_ERROR CAN NOT CONNECT TO BACKEND");
-			return;
-		}
-		set_nonblock(s->sfd);
-		memset(&(s->ev), 0, sizeof(struct event));
-	} else {
-		event_del(&(c->srv->ev)); /* delete previous pool handler */
-		s->state = SERVER_CONNECTED;
-	}
+static void
+out_string(command *cmd, const char *str)
+{
+	/* append str to cmd->response */
+	int len = 0;
+	buffer *b;
 
-	/* reset flags */
-	s->has_response_header = 0;
-	s->remove_trail = 0;
-	s->valuebytes = 0;
+	if (cmd == NULL || str == NULL || str[0] == '\0') return;
+	
+	len = strlen(str);
 
-	if (c->flag.is_get_cmd) {
-		b = buffer_init_size(strlen(key) + 20);
-		if (b == NULL) {
-			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-			server_error(c, "SERVER_ERROR OUT OF MEMORY");
-			return;
-		}
-		b->size = snprintf(b->ptr, b->len - 1, "%s %s\r\n", c->flag.is_gets_cmd?"gets":"get", key);
-		append_buffer_to_list(s->request, b);
-	} else {
-		copy_list(c->request, s->request);
-	}
+	b = buffer_init_size(len + 3);
+	if (b == NULL) return;
 
-	c->state = CLIENT_TRANSCATION;
-	/* server event handler */
+	memcpy(b->ptr, str, len);
+	memcpy(b->ptr + len, "\r\n", 2);
+	b->size = len + 2;
+	b->ptr[b->size] = '\0';
+	
+	append_buffer_to_list(&cmd->response, b);
+}
 
-	if (s->state == SERVER_INIT && socket_connect(s)) {
-		if (backupcnt > 0)
-			try_backup_server(c);
-		else
-			server_error(c, "SERVER_ERROR CAN NOT CONNECT TO BACKEND SERVER");
-		return;
+/* finish proxy transcation of command, reply to client if it's the first one */
+static void
+finish_transcation(command *cmd)
+{
+	conn *c;
+
+	if (cmd == NULL) return;
+
+	if (cmd->started) {
+		latency_check(curworker);
+		latency_add(curworker->cmdlat + cmd->latclass, latency_now() - cmd->started);
+		cmd->started = 0;
 	}
 
-	event_set(&(s->ev), s->sfd, EV_PERSIST|EV_WRITE, drive_memcached_server, (void *)c);
-	event_add(&(s->ev), 0);
-	s->ev_flags = EV_WRITE;
+	if (cmd->bin)
+		binary_reply(cmd);
+
+	command_clear(cmd);
+	cmd->flag.done = 1;
+
+	c = cmd->client;
+	if (c->processing) return; /* flushed by process_commands() */
+
+	if (client_flush(c) == 0 && c->pos > 0)
+		process_commands(c, NULL); /* go on with commands waiting in line buffer */
 }
 
 static void
-try_backup_server(conn *c)
+server_error(command *cmd, const char *s)
 {
-	int idx;
-	struct matrix *m;
-	char *key;
-	buffer *b;
-	struct server *s;
+	if (cmd == NULL) return;
+
+	command_clear(cmd);
+	list_free(&cmd->response, 1);
+	/* client of noreply command reads no reply, errors neither */
+	if (cmd->flag.no_reply == 0)
+		out_string(cmd, s);
+	finish_transcation(cmd);
+}
 
-	if (c == NULL) return;
 
-	/* free previous error server */
-	server_free(c->srv);
-	c->srv = NULL;
+/* pick memcached server indexes of n keys, ketama ring hashes all of them at once */
+static void
+select_servers(struct ketama *kt, int cnt, char **keys, int n, int *idx)
+{
+	int i;
 
-	if (c->flag.is_backup || c->flag.is_incr_decr_cmd || backups == NULL) {
-		/* don't duplicate incr/decr cmds */
-		/* already tried backup server or no backup server*/
-		do_transcation(c);
-		return;
+	if (use_ketama && kt) {
+		get_servers(kt, (const char **) keys, n, idx);
+	} else {
+		for (i = 0; i < n; i ++)
+			idx[i] = -1;
 	}
 
-	c->flag.is_backup = 1;
-
-	if (c->flag.is_get_cmd)
-		key = c->keys[c->keyidx - 1];
-	else
-		key = c->keys[0];
+	for (i = 0; i < n; i ++) {
+		if (idx[i] >= 0) continue;
 
-	if (use_ketama && backupkt) {
-		idx = get_server(backupkt, key);
-		if (idx < 0) {
-			/* fall back to round selection */
-			idx = hashme(key)%backupcnt;
-		}
-	} else {
-		/* just round selection */
-		idx = hashme(key)%backupcnt;
+		/* fall back to round selection */
+		if (hashfunc == KETAMA_HASH_MURMUR)
+			idx[i] = murmur_hash64(keys[i], strlen(keys[i]), 0) % cnt;
+		else
+			idx[i] = hashme(keys[i])%cnt;
 	}
+}
+
+/* pick memcached server index of key */
+static int
+select_server(struct ketama *kt, int cnt, char *key)
+{
+	int idx;
 
-	m = backups + idx;
+	select_servers(kt, cnt, &key, 1, &idx);
+	return idx;
+}
 
-	if (verbose_mode)
-		fprintf(stderr, "%s: (%s.%d) TRYING BACKUP SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, m->ip, m->port);
+/* get one connection to memcached server, from keep alive pool or new socket */
+static struct server *
+checkout_server(matrix *m)
+{
+	struct srvstat *st;
+	struct server *s;
 
+	st = server_stat(m);
 	if (m->pool && (m->used > 0)) {
 		s = m->pool[--m->used];
 		s->pool_idx = 0;
+		s->state = SERVER_CONNECTED;
+		if (st) st->reuses ++;
 		if (verbose_mode)
 			fprintf(stderr, "%s: (%s.%d) GET SERVER FD %d <- POOL\n", cur_ts_str, __FILE__, __LINE__, s->sfd);
 	} else {
-		s = (struct server *) calloc(sizeof(struct server), 1);
+		s = server_new();
 		if (s == NULL) {
 			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-			conn_close(c);
-			return;
+			return NULL;
 		}
-		s->request = list_init();
-		s->response = list_init();
-		memset(&(s->ev), 0, sizeof(struct event));
 		s->state = SERVER_INIT;
-	}
-	s->owner = m;
-	c->srv = s;
-
-	if (verbose_mode) 
-		fprintf(stderr, "%s: (%s.%d) %s KEY \"%s\" -> %s:%d\n", cur_ts_str, __FILE__, __LINE__, c->flag.is_get_cmd?"GET":"SET", key, m->ip, m->port);
 
-	if (s->sfd <= 0) {
+		curworker->syscalls ++;
 		s->sfd = socket(AF_INET, SOCK_STREAM, 0); 
 		if (s->sfd < 0) {
 			fprintf(stderr, "%s: (%s.%d) CAN'T CREATE TCP SOCKET TO MEMCACHED\n", cur_ts_str, __FILE__, __LINE__);
-			server_error(c, "SERVER_ERROR CAN NOT CONNECT TO BACKEND");
-			return;
+			server_free(s);
+			return NULL;
 		}
 		set_nonblock(s->sfd);
-	} else {
-		event_del(&(s->ev)); /* delete previous pool handle handler */
-		s->state = SERVER_CONNECTED;
+
+		event_assign(&(s->ev), curworker->base, s->sfd, EV_READ|EV_PERSIST, drive_server, (void *) s);
+		event_assign(&(s->wev), curworker->base, s->sfd, EV_WRITE|EV_PERSIST, drive_server, (void *) s);
+		m->conns ++;
+		if (st) st->connects ++;
 	}
+	s->owner = m;
 
 	/* reset flags */
-	s->has_response_header = 0;
-	s->remove_trail = 0;
-	s->valuebytes = 0;
+	s->pos = s->has_response_header = s->valuebytes = 0;
 
-	if (c->flag.is_get_cmd) {
-		b = buffer_init_size(strlen(key) + 20);
-		if (b == NULL) {
+	return s;
+}
+
+/* persistent connection of memcached server, the same one for all commands
+ * of client cfd so they are never reordered, round robin if cfd < 0
+ */
+static struct server *
+checkout_mux_server(matrix *m, int cfd)
+{
+	struct server *s;
+	int i;
+
+	if (m->mux == NULL) {
+		m->mux = (struct server **) calloc(sizeof(struct server *), muxconns);
+		if (m->mux == NULL) {
 			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-			server_error(c, "SERVER_ERROR OUT OF MEMORY");
-			return;
+			return NULL;
 		}
-		b->size = snprintf(b->ptr, b->len - 1, "%s %s\r\n", c->flag.is_gets_cmd?"gets":"get", key);
-		append_buffer_to_list(s->request, b);
-	} else {
-		copy_list(c->request, s->request);
 	}
 
-	c->state = CLIENT_TRANSCATION;
-	/* server event handler */
+	if (cfd >= 0) {
+		i = cfd % muxconns;
+	} else {
+		i = m->muxnext;
+		m->muxnext = (i + 1) % muxconns;
+	}
 
-	if (s->state == SERVER_INIT && socket_connect(s)) {
-		server_free(s);
-		server_error(c, "SERVER_ERROR CAN NOT CONNECT TO BACKEND SERVER");
-		return;
+	if (m->mux[i] == NULL) {
+		s = checkout_server(m);
+		if (s == NULL) return NULL;
+		s->is_mux = 1;
+		s->mux_idx = i;
+		m->mux[i] = s;
 	}
 
-	event_set(&(s->ev), s->sfd, EV_PERSIST|EV_WRITE, drive_memcached_server, (void *)c);
-	event_add(&(s->ev), 0);
-	s->ev_flags = EV_WRITE;
+	return m->mux[i];
 }
 
 static void
-drive_memcached_server(const int fd, const short which, void *arg)
+server_set_event(struct server *s, int flags)
 {
-	struct server *s;
-	conn *c;
-	int socket_error, r, toread;
-	socklen_t servlen, socket_error_len;
+	update_events(&(s->ev), &(s->wev), &(s->ev_flags), flags);
+}
 
-	if (arg == NULL) return;
-	c = (conn *)arg;
+/* arm timer of server with its nearest deadline, see -T */
+static void
+server_timer(struct server *s)
+{
+	unsigned long long t = 0;
 
-	s = c->srv;
-	if (s == NULL) return;
+	if (s->wexpire && (s->request->first || s->state == SERVER_CONNECTING))
+		t = s->wexpire;
+	if (s->rexpire && s->qhead && (t == 0 || s->rexpire < t))
+		t = s->rexpire;
 
-	if (which & EV_WRITE) {
-		switch (s->state) {
-		case SERVER_INIT:
-			servlen = sizeof(s->owner->dstaddr);
-			if (-1 == connect(s->sfd, (struct sockaddr *) &(s->owner->dstaddr), servlen)) {
-				if (errno != EINPROGRESS && errno != EALREADY) {
-					if (verbose_mode)
-						fprintf(stderr, "%s: (%s.%d) CAN'T CONNECT TO MAIN SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port);
-
-					if (backupcnt > 0)
-						try_backup_server(c);
-					else
-						server_error(c, "SERVER_ERROR CAN NOT CONNECT TO BACKEND SERVER");
-					return;
-				}
-			}
-			s->state = SERVER_CONNECTING;
-			break;
+	if (t == 0)
+		wheel_del(&(s->timer));
+	else
+		wheel_set(&(s->timer), t, server_timeout, s);
+}
 
-		case SERVER_CONNECTING:
-			socket_error_len = sizeof(socket_error);
-			/* try to finish the connect() */
-			if ((0 != getsockopt(s->sfd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) ||
-					(socket_error != 0)) {
-				if (verbose_mode)
-					fprintf(stderr, "%s: (%s.%d) CAN'T CONNECT TO MAIN SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port);
+/* noreply commands of queries are done, their request is written */
+static void
+finish_written(query *q)
+{
+	command *cmd;
+	query *n;
+
+	while (q) {
+		n = q->next;
+		cmd = q->cmd;
+		query_free(q);
+		/* next command of client may reuse the connection */
+		if (cmd) finish_transcation(cmd);
+		q = n;
+	}
+}
 
-				if (backupcnt > 0)
-					try_backup_server(c);
-				else
-					server_error(c, "SERVER_ERROR CAN NOT CONNECT TO BACKEND SERVER");
-				return;
-			}
-			
-			if (verbose_mode)
-				fprintf(stderr, "%s: (%s.%d) CONNECTED FD %d <-> %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->sfd, s->owner->ip, s->owner->port);
+/* request data written to memcached server, wait for replies or rest of writing
+ * return 0 if ok, return -1 if server put back into pool
+ */
+static int
+server_written(struct server *s)
+{
+	query *q = NULL;
 
-			s->state = SERVER_CONNECTED;
-			break;
+	if (s->request->first == NULL) {
+		q = s->whead;
+		s->whead = s->wtail = NULL;
 
-		case SERVER_CONNECTED:
-			/* write request to memcached server */
-			r = writev_list(s->sfd, s->request);
-			if (r < 0) {
-				/* write failed */
-				server_error(c, "SERVER_ERROR CAN NOT WRITE REQUEST TO BACKEND SERVER");
-				return;
+		if (s->qhead == NULL && (!s->is_mux || s->owner->idx < 0)) {
+			/* only noreply commands, connection is free again */
+			put_server_into_pool(s);
+			finish_written(q);
+			return -1;
+		}
+		server_set_event(s, EV_READ);
+	} else {
+		server_set_event(s, EV_READ|EV_WRITE);
+	}
+
+	/* write went on, replies are waited for from now */
+	s->wexpire = s->request->first ? wheel_deadline(write_timeout) : 0;
+	if (s->rexpire == 0)
+		s->rexpire = wheel_deadline(read_timeout);
+	server_timer(s);
+
+	finish_written(q);
+	return 0;
+}
+
+/* write request data to memcached server, wait for replies
+ * return 0 if ok, return -1 if server closed or put back into pool
+ */
+static int
+server_write(struct server *s)
+{
+	struct srvstat *st;
+	int r;
+
+	if ((r = writev_list(s->sfd, s->request)) < 0) {
+		server_fail(s);
+		return -1;
+	}
+	if (r > 0 && (st = server_stat(s->owner)) != NULL)
+		st->bytes_written += r;
+
+	return server_written(s);
+}
+
+#ifdef HAVE_IO_URING
+/* write all queued clients and servers with io_uring, URING_ENTRIES at once */
+static void
+uring_flush(struct worker *w)
+{
+	struct uring *r = w->ring;
+	struct server *s, *servers[URING_ENTRIES];
+	struct srvstat *st;
+	conn *c, *clients[URING_ENTRIES];
+	int i, nc, ns;
+
+	while (w->cflushq || w->flushq) {
+		r->nslots = nc = ns = 0;
+
+		while ((c = w->cflushq) != NULL && uring_prep_writev(r, c->cfd, c->response) >= 0) {
+			w->cflushq = c->flushnext;
+			c->flushnext = NULL;
+			c->flushing = 0;
+			clients[nc ++] = c;
+		}
+
+		while ((s = w->flushq) != NULL && uring_prep_writev(r, s->sfd, s->request) >= 0) {
+			w->flushq = s->flushnext;
+			s->flushnext = NULL;
+			s->flushing = 0;
+			servers[ns ++] = s;
+		}
+
+		uring_submit(r);
+
+		/* clients first, closing a client never frees other connections */
+		for (i = 0; i < nc; i ++) {
+			if (r->res[i] < 0) {
+				conn_close(clients[i]);
 			} else {
-				if (s->request->first == NULL ) {
-					/* finish writing request to memcached server */
-					if (c->flag.no_reply) {
-						finish_transcation(c);
-					} else if (s->ev_flags != EV_READ) {
-						event_del(&(s->ev));
-						event_set(&(s->ev), s->sfd, EV_PERSIST|EV_READ, drive_memcached_server, arg);
-						event_add(&(s->ev), 0);
-						s->ev_flags = EV_READ;
-					}
-				}
+				w->client_written += r->res[i];
+				client_set_event(clients[i]);
 			}
-			break;
+		}
 
-		case SERVER_ERROR:
-			server_error(c, "SERVER_ERROR BACKEND SERVER ERROR");
-			break;
+		for (i = 0; i < ns; i ++) {
+			if (r->res[nc + i] < 0) {
+				server_fail(servers[i]);
+			} else {
+				if ((st = server_stat(servers[i]->owner)) != NULL)
+					st->bytes_written += r->res[nc + i];
+				server_written(servers[i]);
+			}
 		}
-		return;
-	} 
-	
-	if (!(which & EV_READ)) return;
-   
-	/* get the byte counts of read */
-	if (ioctl(s->sfd, FIONREAD, &toread) || toread == 0) {
-		if (backupcnt > 0)
-			try_backup_server(c);
-		else
-			server_error(c, "SERVER_ERROR BACKEND SERVER RESET OR CLOSE CONNECTION");
-		return;
-	}
 
-	if (c->flag.is_get_cmd) {
-		if (s->has_response_header == 0) {
-			/* NO RESPONSE HEADER */
-			if (toread > (BUFFERLEN - s->pos))
-				toread = BUFFERLEN - s->pos;
-		} else {
-			/* HAS RESPONSE HEADER */
-			if (toread > (BUFFERLEN - s->pos))
-				toread = BUFFERLEN - s->pos;
-			if (toread > s->valuebytes)
-				toread = s->valuebytes;
+		if (r->failed) {
+			fprintf(stderr, "%s: (%s.%d) IO_URING DISABLED, USE WRITEV\n", cur_ts_str, __FILE__, __LINE__);
+			/* ring is never freed, writes given up may still read its iovecs */
+			w->ring = NULL;
+			flush_servers(-1, 0, (void *) w);
+			return;
 		}
-	} else {
-		if (toread > (BUFFERLEN - s->pos))
-			toread = BUFFERLEN - s->pos;
 	}
+}
+#endif
+/* write request data queued by send_query() before waiting for events,
+ * requests of pipelined commands go out with one writev() per server
+ */
+static void
+flush_servers(const int fd, const short which, void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	struct server *s;
 
-	r = read(s->sfd, s->line + s->pos , toread);
-	if (r <= 0) {
-		if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
-			if (backupcnt > 0)
-				try_backup_server(c);
-			else
-				server_error(c, "SERVER_ERROR BACKEND SERVER CLOSE CONNECTION");
-		}
+	UNUSED(fd);
+	UNUSED(which);
+
+#ifdef HAVE_IO_URING
+	if (w->ring) {
+		uring_flush(w);
 		return;
 	}
+#endif
+
+	while ((s = w->flushq) != NULL) {
+		w->flushq = s->flushnext;
+		s->flushnext = NULL;
+		s->flushing = 0;
+		server_write(s);
+	}
+}
 
-	s->pos += r;
-	s->line[s->pos] = '\0';
+static void
+server_flush_later(struct server *s)
+{
+	if (s->flushing) return;
 
-	if (c->flag.is_get_cmd)
-		process_get_response(c, r);
-	else
-		process_update_response(c);
+	s->flushing = 1;
+	s->flushnext = curworker->flushq;
+	if (curworker->flushq == NULL && curworker->cflushq == NULL)
+		event_active(&(curworker->flush_ev), EV_WRITE, 0);
+	curworker->flushq = s;
 }
 
+/* close connection to memcached server, queries on it are failed */
 static void
-process_get_response(conn *c, int r)
+server_close(struct server *s)
+{
+	if (s->is_mux && s->owner->mux[s->mux_idx] == s)
+		s->owner->mux[s->mux_idx] = NULL;
+	server_free(s);
+}
+
+/* queue request data with its query on a connection to memcached server m,
+ * query is NULL if nobody waits for it
+ * return 0 if ok, return 1 if failed
+ */
+static int
+send_query(query *q, matrix *m, list *data)
 {
 	struct server *s;
-	buffer *b;
-	int pos;
 
-	if (c == NULL || c->srv == NULL || c->srv->pos == 0) return;
-	s = c->srv;
-	if (s->has_response_header == 0) {
-		pos = memstr(s->line, "\n", s->pos, 1);
+	if (m->conf->down) {
+		/* ejected, don't wait for connect() */
+		if (verbose_mode)
+			fprintf(stderr, "%s: (%s.%d) SERVER %s:%d IS EJECTED\n", cur_ts_str, __FILE__, __LINE__, m->ip, m->port);
+		list_free(data, 1);
+		return 1;
+	}
 
-		if (pos == -1) return; /* not found */
+	if (muxconns > 0)
+		s = checkout_mux_server(m, (q && q->cmd) ? q->cmd->client->cfd : -1);
+	else
+		s = checkout_server(m);
 
-		/* found \n */
-		s->has_response_header = 1;
-		s->remove_trail = 0;
-		pos ++;
+	if (s == NULL) {
+		list_free(data, 1);
+		return 1;
+	}
 
-		s->valuebytes = -1;
+	if (s->state == SERVER_INIT && socket_connect(s)) {
+		if (verbose_mode)
+			fprintf(stderr, "%s: (%s.%d) CAN'T CONNECT TO SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, m->ip, m->port);
+		list_free(data, 1);
+		server_result(s, 0);
+		server_close(s);
+		return 1;
+	}
 
-		/* VALUE <key> <flags> <bytes> [<cas unique>]\r\n
-		 * END\r\n*/
-		if (strncasecmp(s->line, "VALUE ", 6) == 0) {
-			char *p = NULL;
-			p = strchr(s->line + 6, ' ');
-			if (p) {
-				p = strchr(p + 1, ' ');
-				if (p) {
-					s->valuebytes = atol(p+1);
-					if (s->valuebytes < 0) {
-						try_backup_server(c); /* conn_close(c); */
-					}
-				}
-			}
-		}
+	move_list(data, s->request);
 
-		if (s->valuebytes < 0) {
-			/* END\r\n or SERVER_ERROR\r\n
-			 * just skip this transcation
-			 */
-			put_server_into_pool(s);
-			c->srv = NULL;
-			if (c->flag.is_last_key) out_string(c, "END");
-			do_transcation(c); /* TO Next KEY */
-			return;
-		}
-		s->valuebytes += 7; /* trailing \r\nEND\r\n */
+	if (q && q->no_reply) {
+		q->srv = s;
+		if (s->wtail)
+			s->wtail->next = q;
+		else
+			s->whead = q;
+		s->wtail = q;
+	} else if (q) {
+		q->srv = s;
+		q->stamp = latency_now();
+		if (s->qtail)
+			s->qtail->next = q;
+		else
+			s->qhead = q;
+		s->qtail = q;
+	}
 
-		b = buffer_init_size(pos + 1);
-		if (b == NULL) {
-			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-			try_backup_server(c); /* conn_close(c); */
-			return;
-		}
-		memcpy(b->ptr, s->line, pos);
-		b->size = pos;
-		append_buffer_to_list(s->response, b);
+	if (s->wexpire == 0) {
+		s->wexpire = wheel_deadline(s->state == SERVER_CONNECTING ? connect_timeout : write_timeout);
+		server_timer(s);
+	}
 
-		if (s->pos > pos) {
-			memmove(s->line, s->line + pos, s->pos - pos);
-			s->pos -= pos;
-		} else {
-			s->pos = 0;
-		}
+	if (s->state == SERVER_CONNECTING)
+		server_set_event(s, EV_WRITE);
+	else if (!(s->ev_flags & EV_WRITE))
+		server_flush_later(s); /* try writing before waiting for EV_WRITE */
 
-		if (s->pos > 0) 
-			s->valuebytes -= s->pos;
-	} else {
-		/* HAS RESPONSE HEADER */
-		s->valuebytes -= r;
+	return 0;
+}
+
+static unsigned int
+key_hash(const char *key)
+{
+	unsigned int hash = 2166136261U; /* FNV-1a */
+
+	while (*key) {
+		hash ^= (unsigned char) *key ++;
+		hash *= 16777619U;
 	}
 
-	if (s->remove_trail) {
-		s->pos = 0;
-	} else if (s->pos > 0) {
-		b = buffer_init_size(s->pos+1);
-		if (b == NULL) {
-			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-			try_backup_server(c); /* conn_close(c); */
-			return;
-		}
-		memcpy(b->ptr, s->line, s->pos);
-		b->size = s->pos;
+	return hash;
+}
 
-		if (s->valuebytes <= 5) {
-			b->size -= (5 - s->valuebytes); /* remove trailing END\r\n */
-			s->remove_trail = 1;
-		}
-		s->pos = 0;
+/* ------------- near cache of hot keys, see -c ------------- */
 
-		append_buffer_to_list(s->response, b);
-	}
+/* return 0 if ok, return 1 if failed */
+static int
+ncache_init(void)
+{
+	struct ncsegment *seg;
+	int i;
 
-	if (s->valuebytes == 0) {
-		/* GET commands finished, go on next memcached server */
-		move_list(s->response, c->response);
-		put_server_into_pool(s);
-		c->srv = NULL;
-		if (c->flag.is_last_key) {
-			b = buffer_init_size(6);
-			if (b) {
-				memcpy(b->ptr, "END\r\n", 5);
-				b->size = 5;
-				b->ptr[b->size] = '\0'; 
-				append_buffer_to_list(c->response, b);
-			} else {
-				fprintf(stderr, "%s: (%s.%d) OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-			}
-		}
+	ncache = (struct ncsegment *) calloc(sizeof(struct ncsegment), NCACHE_SEGMENTS);
+	if (ncache == NULL) return 1;
 
-		if (writev_list(c->cfd, c->response) >= 0) {
-			if (c->response->first && (c->ev_flags != EV_WRITE)) {
-				event_del(&(c->ev));
-				event_set(&(c->ev), c->cfd, EV_WRITE|EV_PERSIST, drive_client, (void *) c);
-				event_add(&(c->ev), 0);
-				c->ev_flags = EV_WRITE;
-			}
-			do_transcation(c); /* NEXT MEMCACHED SERVER */
-		} else {
-			/* client reset/close connection*/
-			conn_close(c);
-		}
+	for (i = 0; i < NCACHE_SEGMENTS; i ++) {
+		seg = ncache + i;
+		pthread_mutex_init(&(seg->lock), NULL);
+		seg->tsize = 256;
+		seg->table = (struct ncitem **) calloc(sizeof(struct ncitem *), seg->tsize);
+		if (seg->table == NULL) return 1;
 	}
 
+	return 0;
+}
+
+/* estimated requests of key, smaller one of its two counters */
+static int
+ncache_freq(struct ncsegment *seg, unsigned int hash)
+{
+	int a = seg->sketch[(hash >> 4) % NCACHE_SKETCH];
+	int b = seg->sketch[(hash >> 16) % NCACHE_SKETCH];
+
+	return a < b ? a : b;
 }
 
 static void
-process_update_response(conn *c)
+ncache_count(struct ncsegment *seg, unsigned int hash)
 {
-	struct server *s;
-	buffer *b;
-	int pos;
+	unsigned char *a = seg->sketch + (hash >> 4) % NCACHE_SKETCH;
+	unsigned char *b = seg->sketch + (hash >> 16) % NCACHE_SKETCH;
+	int i;
 
-	if (c == NULL || c->srv == NULL || c->srv->pos == 0) return;
-	s = c->srv;
-#if 0
-	pos = memstr(s->line, "\n", s->pos, 1);
-	if (pos == -1) return; /* not found */
-#else
-	if (s->line[s->pos-1] != '\n') return;
-	pos = s->pos - 1;
-#endif
-	/* found \n */
-	pos ++;
+	if (*a < 255) (*a) ++;
+	if (*b < 255 && b != a) (*b) ++;
 
-	b = buffer_init_size(pos + 1);
-	if (b == NULL) {
-		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-		server_error(c, "SERVER_ERROR OUT OF MEMORY");
-		return;
+	/* halve all counters, old hot keys cool down */
+	if (++ seg->counts >= NCACHE_SKETCH * 8) {
+		for (i = 0; i < NCACHE_SKETCH; i ++)
+			seg->sketch[i] >>= 1;
+		seg->counts = 0;
 	}
-	memcpy(b->ptr, s->line, pos);
-	b->size = pos;
-
-	append_buffer_to_list(s->response, b);
-	move_list(s->response, c->response);
-	put_server_into_pool(s);
-	c->srv = NULL;
-	if (writev_list(c->cfd, c->response) >= 0) {
-		if (c->response->first && (c->ev_flags !=  EV_WRITE)) {
-			event_del(&(c->ev));
-			event_set(&(c->ev), c->cfd, EV_WRITE|EV_PERSIST, drive_client, (void *) c);
-			event_add(&(c->ev), 0);
-			c->ev_flags = EV_WRITE;
-		}
-		finish_transcation(c);
-	} else {
-		/* client reset/close connection*/
-		conn_close(c);
+}
+
+static struct ncitem *
+ncache_find(struct ncsegment *seg, unsigned int hash, const char *key)
+{
+	struct ncitem *it;
+
+	for (it = seg->table[(hash >> 4) & (seg->tsize - 1)]; it; it = it->hnext) {
+		if (it->hash == hash && strcmp(it->key, key) == 0)
+			return it;
 	}
+
+	return NULL;
 }
 
 static void
-drive_backup_server(const int fd, const short which, void *arg)
+ncache_remove(struct ncsegment *seg, struct ncitem *it)
 {
-	struct server *s;
-	int socket_error, r, toread, pos;
-	socklen_t servlen, socket_error_len;
-
-	if (arg == NULL) return;
-	s = (struct server *)arg;
+	struct ncitem **p;
 
-	if (which & EV_WRITE) {
-		switch (s->state) {
-		case SERVER_INIT:
-			servlen = sizeof(s->owner->dstaddr);
-			if (-1 == connect(s->sfd, (struct sockaddr *) &(s->owner->dstaddr), servlen)) {
-				if (errno != EINPROGRESS && errno != EALREADY) {
-					if (verbose_mode)
-						fprintf(stderr, "%s: (%s.%d) CAN'T CONNECT TO BACKUP SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port);
-
-					server_free(s);
-					return;
-				}
-			}
-			s->state = SERVER_CONNECTING;
-			break;
+	for (p = seg->table + ((it->hash >> 4) & (seg->tsize - 1)); *p != it; p = &((*p)->hnext)) ;
+	*p = it->hnext;
 
-		case SERVER_CONNECTING:
-			socket_error_len = sizeof(socket_error);
-			/* try to finish the connect() */
-			if ((0 != getsockopt(s->sfd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) ||
-					(socket_error != 0)) {
-				if (verbose_mode)
-					fprintf(stderr, "%s: (%s.%d) CAN'T CONNECT TO BACKUP SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port);
+	if (it->prev) it->prev->next = it->next;
+	else seg->head = it->next;
+	if (it->next) it->next->prev = it->prev;
+	else seg->tail = it->prev;
 
-				server_free(s);
-				return;
-			}
-			
-			if (verbose_mode)
-				fprintf(stderr, "%s: (%s.%d) CONNECTED BACKUP FD %d <-> %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->sfd, s->owner->ip, s->owner->port);
+	seg->bytes -= it->size;
+	seg->items --;
+	free(it);
+}
 
-			s->state = SERVER_CONNECTED;
-			break;
+/* double hash table of segment, keep chains short */
+static void
+ncache_grow(struct ncsegment *seg)
+{
+	struct ncitem **table, *it, *n;
+	unsigned int i, tsize = seg->tsize * 2;
 
-		case SERVER_CONNECTED:
-			/* write request to memcached server */
-			r = writev_list(s->sfd, s->request);
-			if (r < 0) {
-				/* write failed */
-				server_free(s);
-				return;
-			} else {
-				if (s->request->first == NULL) {
-					event_del(&(s->ev));
-					event_set(&(s->ev), s->sfd, EV_PERSIST|EV_READ, drive_backup_server, arg);
-					event_add(&(s->ev), 0);
-				}
-			}
-			break;
+	table = (struct ncitem **) calloc(sizeof(struct ncitem *), tsize);
+	if (table == NULL) return;
 
-		case SERVER_ERROR:
-			server_free(s);
-			break;
+	for (i = 0; i < seg->tsize; i ++) {
+		for (it = seg->table[i]; it; it = n) {
+			n = it->hnext;
+			it->hnext = table[(it->hash >> 4) & (tsize - 1)];
+			table[(it->hash >> 4) & (tsize - 1)] = it;
 		}
-		return;
-	} 
-	
-	if (!(which & EV_READ)) return;
-   
-	/* get the byte counts of read */
-	if (ioctl(s->sfd, FIONREAD, &toread) || toread == 0) {
-		/* ioctl error or memcached server close/reset connection */
-		server_free(s);
-		return;
 	}
 
-	if (toread > (BUFFERLEN - s->pos))
-		toread = BUFFERLEN - s->pos;
+	free(seg->table);
+	seg->table = table;
+	seg->tsize = tsize;
+}
+
+/* return copy of cached VALUE block of key, NULL if not cached
+ * with_cas for gets, only blocks cached from gets replies have cas unique
+ */
+static buffer *
+ncache_get(const char *key, int with_cas)
+{
+	unsigned int hash = key_hash(key);
+	struct ncsegment *seg = ncache + hash % NCACHE_SEGMENTS;
+	struct ncitem *it;
+	buffer *b = NULL;
 
-	r = read(s->sfd, s->line + s->pos , toread);
-	if (r <= 0) {
-		if (r == 0 || (errno != EAGAIN && errno != EINTR))
-			server_free(s);
-		return;
-	}
+	pthread_mutex_lock(&(seg->lock));
 
-	s->pos += r;
-	s->line[s->pos] = '\0';
+	ncache_count(seg, hash);
 
-	pos = memstr(s->line, "\n", s->pos, 1);
+	it = ncache_find(seg, hash, key);
+	if (it && it->expire <= cur_ts) {
+		ncache_remove(seg, it);
+		it = NULL;
+	}
+
+	if (it && with_cas && it->caslen == 0)
+		it = NULL; /* gets reply will replace it */
+
+	if (it) {
+		b = buffer_init_size(it->len);
+		if (b && (with_cas || it->caslen == 0)) {
+			memcpy(b->ptr, it->data, it->len);
+			b->size = it->len;
+		} else if (b) {
+			/* get, VALUE line without cas unique */
+			memcpy(b->ptr, it->data, it->casoff);
+			memcpy(b->ptr + it->casoff, it->data + it->casoff + it->caslen, it->len - it->casoff - it->caslen);
+			b->size = it->len - it->caslen;
+		}
 
-	if (pos == -1) return; /* not found */
+		/* move to head of lru list */
+		if (it->prev) {
+			it->prev->next = it->next;
+			if (it->next) it->next->prev = it->prev;
+			else seg->tail = it->prev;
+			it->prev = NULL;
+			it->next = seg->head;
+			seg->head->prev = it;
+			seg->head = it;
+		}
+	}
 
-	/* put backup connection into pool */
-	put_server_into_pool(s);
+	pthread_mutex_unlock(&(seg->lock));
+	return b;
 }
 
-/* return 1 if command found
- * return 0 if not found
+/* cache VALUE block of key read from memcached server, with_cas if it is gets reply
+ * stamp is update_clock when GET started, value is stale if key changed since
  */
 static void
-process_command(conn *c)
+ncache_put(const char *key, list *value, unsigned long long stamp, int with_cas)
 {
-	char *p;
-	int len, skip = 0, i, j;
+	unsigned int hash = key_hash(key);
+	struct ncsegment *seg = ncache + hash % NCACHE_SEGMENTS;
+	struct ncitem *it;
+	size_t len = 0, size, limit = ncache_size / NCACHE_SEGMENTS;
 	buffer *b;
-	token_t tokens[MAX_TOKENS];
-	size_t ntokens;
+	char *p;
+	int freq;
 
-	if (c->state != CLIENT_COMMAND) return;
+	for (b = value->first; b; b = b->next)
+		len += b->size;
+	size = sizeof(struct ncitem) + len + strlen(key) + 1;
 
-	p = strchr(c->line, '\n');
-	if (p == NULL) return;
+	/* big values are not worth it */
+	if (len == 0 || size > limit / 8) return;
 
-	len = p - c->line;
-	*p = '\0'; /* remove \n */
-	if (*(p-1) == '\r') {
-		*(p-1) = '\0'; /* remove \r */
-		len --;
+	pthread_mutex_lock(&(seg->lock));
+
+	/* key written after GET started or seen once only */
+	freq = ncache_freq(seg, hash);
+	if (seg->stamp > stamp || freq < NCACHE_ADMIT)
+		goto out;
+
+	it = ncache_find(seg, hash, key);
+	if (it) ncache_remove(seg, it);
+
+	/* evict lru items, but never a hotter one for this key */
+	while (seg->bytes + size > limit && seg->tail) {
+		if (seg->tail->expire > cur_ts && ncache_freq(seg, seg->tail->hash) > freq)
+			goto out;
+		ncache_remove(seg, seg->tail);
 	}
 
-	/* backup command line buffer first */
-	b = buffer_init_size(len + 3);
-	memcpy(b->ptr, c->line, len);
-	b->ptr[len] = '\r';
-	b->ptr[len+1] = '\n';
-	b->ptr[len+2] = '\0';
-	b->size = len + 2;
+	it = (struct ncitem *) malloc(size);
+	if (it == NULL) goto out;
 
-#if 0
-	if (verbose_mode)
-		fprintf(stderr, "%s: (%s.%d) PROCESSING COMMAND: %s", cur_ts_str, __FILE__, __LINE__, b->ptr);
-#endif
+	it->hash = hash;
+	it->expire = cur_ts + ncache_ttl;
+	it->size = size;
+	it->len = len;
+	for (len = 0, b = value->first; b; b = b->next) {
+		memcpy(it->data + len, b->ptr, b->size);
+		len += b->size;
+	}
+	it->key = it->data + len;
+	strcpy(it->key, key);
+
+	/* cas unique is the last token of VALUE line */
+	it->casoff = it->caslen = 0;
+	p = with_cas ? (char *) memchr(it->data, '\r', len) : NULL;
+	if (p) {
+		for (it->casoff = p - it->data; it->casoff > 0 && it->data[it->casoff - 1] != ' '; it->casoff --) ;
+		if (it->casoff > 0) {
+			it->casoff --;
+			it->caslen = p - it->data - it->casoff;
+		}
+	}
 
-	memset(&(c->flag), 0, sizeof(c->flag));
-	c->flag.is_update_cmd = 1;
-	c->storebytes = c->keyidx = 0;
+	it->hnext = seg->table[(hash >> 4) & (seg->tsize - 1)];
+	seg->table[(hash >> 4) & (seg->tsize - 1)] = it;
 
-	ntokens = tokenize_command(c->line, tokens, MAX_TOKENS);
-	if (ntokens >= 3 && (
-			(strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
-			(strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0)
-			)) {
-		/*
-		 * get/gets <key>*\r\n
+	it->prev = NULL;
+	it->next = seg->head;
+	if (seg->head) seg->head->prev = it;
+	else seg->tail = it;
+	seg->head = it;
+
+	seg->bytes += size;
+	if (++ seg->items > seg->tsize)
+		ncache_grow(seg);
+out:
+	pthread_mutex_unlock(&(seg->lock));
+}
+
+/* key changed by update command, drop it and values of GET in flight */
+static void
+ncache_delete(const char *key, unsigned int hash, unsigned long long stamp)
+{
+	struct ncsegment *seg = ncache + hash % NCACHE_SEGMENTS;
+	struct ncitem *it;
+
+	pthread_mutex_lock(&(seg->lock));
+
+	if (seg->stamp < stamp) seg->stamp = stamp;
+	it = ncache_find(seg, hash, key);
+	if (it) ncache_remove(seg, it);
+
+	pthread_mutex_unlock(&(seg->lock));
+}
+
+/* key changed by update command, forget what was read before */
+static void
+key_updated(const char *key)
+{
+	unsigned int hash = key_hash(key);
+	unsigned long long old, stamp = __sync_add_and_fetch(&update_clock, 1);
+	unsigned long long *p = key_stamps + hash % KEY_STAMPS;
+
+	do {
+		old = *p;
+	} while (old < stamp && !__sync_bool_compare_and_swap(p, old, stamp));
+
+	if (ncache)
+		ncache_delete(key, hash, stamp);
+}
+
+/* ------------- heavy hitters of memcached servers, see stats hotkeys ------------- */
+
+/* Space-Saving: a new key replaces the coldest one and inherits its count */
+static void
+hotkey_add(struct hotkey *t, const char *key, unsigned long long w)
+{
+	struct hotkey *min = t;
+	int i;
+
+	for (i = 0; i < HOTKEY_SLOTS; i ++) {
+		if (t[i].count > 0 && strcmp(t[i].key, key) == 0) {
+			t[i].count += w;
+			return;
+		}
+		if (t[i].count < min->count) min = t + i;
+	}
+
+	snprintf(min->key, sizeof(min->key), "%s", key);
+	min->count += w;
+}
+
+/* one of HOTKEY_SAMPLE requests/replies of key to memcached server idx is counted,
+ * picked at random so periodic traffic can't hide a key
+ */
+static void
+hotkey_count(int idx, const char *key, int requests, size_t bytes)
+{
+	struct hotkeys *h;
+	unsigned int x;
+	int i;
+
+	if (curworker->hotkeys == NULL || idx < 0) return;
+
+	/* xorshift */
+	x = curworker->hotrand;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	curworker->hotrand = x;
+	if (x % HOTKEY_SAMPLE) return;
+
+	h = curworker->hotkeys + idx;
+	pthread_mutex_lock(&(curworker->hotlock));
+
+	/* halve old counts, so rates follow what happens now */
+	if (h->since == 0) {
+		h->since = cur_ts;
+	} else if (cur_ts - h->since >= HOTKEY_WINDOW) {
+		for (i = 0; i < HOTKEY_SLOTS; i ++) {
+			h->reqs[i].count >>= 1;
+			h->bytes[i].count >>= 1;
+		}
+		h->since = cur_ts - HOTKEY_WINDOW / 2;
+	}
+
+	if (requests)
+		hotkey_add(h->reqs, key, (unsigned long long) requests * HOTKEY_SAMPLE);
+	if (bytes)
+		hotkey_add(h->bytes, key, (unsigned long long) bytes * HOTKEY_SAMPLE);
+
+	pthread_mutex_unlock(&(curworker->hotlock));
+}
+
+static int
+hotrate_cmp(const void *a, const void *b)
+{
+	double x = ((const struct hotrate *) a)->rate, y = ((const struct hotrate *) b)->rate;
+
+	return (x < y) - (x > y);
+}
+
+/* hottest keys of memcached server idx from all workers, by requests or bytes per second */
+static void
+out_hotkeys(command *cmd, int idx, int by_bytes)
+{
+	struct hotrate *r;
+	struct hotkeys *h;
+	struct hotkey *t;
+	char tmp[KEY_MAX_LENGTH + 128];
+	int i, j, k, n = 0;
+	time_t elapsed;
+
+	snprintf(tmp, sizeof(tmp), "hotkeys %s:%d by %s", curworker->cl->matrixs[idx].ip, curworker->cl->matrixs[idx].port,
+			by_bytes ? "bytes/s" : "requests/s");
+	out_string(cmd, tmp);
+
+	r = (struct hotrate *) calloc(sizeof(struct hotrate), nthreads * HOTKEY_SLOTS);
+	if (r == NULL) return;
+
+	/* same key counted by many workers */
+	for (i = 0; i < nthreads; i ++) {
+		if (workers[i].hotkeys == NULL) continue;
+
+		pthread_mutex_lock(&(workers[i].hotlock));
+		if (workers[i].cl != curworker->cl) {
+			/* still switching to reloaded servers */
+			pthread_mutex_unlock(&(workers[i].hotlock));
+			continue;
+		}
+		h = workers[i].hotkeys + idx;
+		t = by_bytes ? h->bytes : h->reqs;
+		elapsed = (h->since && cur_ts > h->since) ? cur_ts - h->since : 1;
+
+		for (j = 0; j < HOTKEY_SLOTS; j ++) {
+			if (t[j].count == 0) continue;
+
+			for (k = 0; k < n && strcmp(r[k].key, t[j].key); k ++) ;
+			if (k == n) {
+				strcpy(r[k].key, t[j].key);
+				n ++;
+			}
+			r[k].rate += (double) t[j].count / elapsed;
+		}
+
+		pthread_mutex_unlock(&(workers[i].hotlock));
+	}
+
+	qsort(r, n, sizeof(struct hotrate), hotrate_cmp);
+	for (i = 0; i < n && i < HOTKEY_SHOW; i ++) {
+		snprintf(tmp, sizeof(tmp), "%s %.0f", r[i].key, r[i].rate);
+		out_string(cmd, tmp);
+	}
+
+	free(r);
+}
+
+/* ------------- latency histograms, see stats latency ------------- */
+
+static void
+histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	int i;
+
+	if (src->n == 0) return;
+
+	for (i = 0; i < LATENCY_BUCKETS; i ++)
+		dst->counts[i] += src->counts[i];
+	dst->n += src->n;
+	dst->sum += src->sum;
+	if (src->max > dst->max) dst->max = src->max;
+}
+
+/* count, average, percentiles and max of h in microseconds */
+static void
+out_histogram(command *cmd, const char *name, const struct histogram *h)
+{
+	static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long long v[4] = { 0, 0, 0, 0 }, seen = 0;
+	char tmp[256];
+	int i, j = 0;
+
+	for (i = 0; i < LATENCY_BUCKETS && j < 4 && h->n > 0; i ++) {
+		seen += h->counts[i];
+		while (j < 4 && seen > 0 && (double) seen >= pcts[j] * h->n) {
+			v[j] = latency_value(i);
+			if (v[j] > h->max) v[j] = h->max;
+			j ++;
+		}
+	}
+
+	snprintf(tmp, sizeof(tmp), "latency %s: count %llu, avg %llu, p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu us",
+			name, h->n, h->n ? h->sum / h->n : 0, v[0], v[1], v[2], v[3], h->max);
+	out_string(cmd, tmp);
+}
+
+static const char *latency_classes[LATENCY_CLASSES] = { "get", "multiget", "storage", "incr/decr", "delete" };
+
+/* latencies of command classes and servers of cl from all workers since last reset */
+static void
+sum_latency(struct cluster *cl, struct histogram *cmdlat, struct latency *lat)
+{
+	struct latency *l;
+	struct worker *w;
+	int i, j;
+
+	/* workers not cleared since reset have nothing new */
+	for (i = 0; i < nthreads; i ++) {
+		w = workers + i;
+		pthread_mutex_lock(&(w->hotlock));
+		if (w->latepoch == latency_epoch) {
+			for (j = 0; j < LATENCY_CLASSES; j ++)
+				histogram_merge(cmdlat + j, w->cmdlat + j);
+
+			/* still switching to reloaded servers if cl differs */
+			for (j = 0; w->cl == cl && w->latency && j < cl->matrixcnt; j ++) {
+				l = w->latency + j;
+				histogram_merge(&(lat[j].connect), &(l->connect));
+				histogram_merge(&(lat[j].first), &(l->first));
+				histogram_merge(&(lat[j].total), &(l->total));
+			}
+		}
+		pthread_mutex_unlock(&(w->hotlock));
+	}
+}
+
+/* latencies of command classes and memcached servers from all workers since last reset */
+static void
+out_latency(command *cmd)
+{
+	struct cluster *cl = curworker->cl;
+	struct histogram *cmdlat;
+	struct latency *lat;
+	char tmp[128];
+	int j;
+
+	snprintf(tmp, sizeof(tmp), "latency window %ld s", (long) (cur_ts - latency_since));
+	out_string(cmd, tmp);
+
+	cmdlat = (struct histogram *) calloc(sizeof(struct histogram), LATENCY_CLASSES);
+	lat = (struct latency *) calloc(sizeof(struct latency), cl->matrixcnt);
+	if (cmdlat == NULL || lat == NULL) {
+		free(cmdlat);
+		free(lat);
+		return;
+	}
+	sum_latency(cl, cmdlat, lat);
+
+	for (j = 0; j < LATENCY_CLASSES; j ++)
+		out_histogram(cmd, latency_classes[j], cmdlat + j);
+
+	for (j = 0; j < cl->matrixcnt; j ++) {
+		snprintf(tmp, sizeof(tmp), "%s:%d connect", cl->matrixs[j].ip, cl->matrixs[j].port);
+		out_histogram(cmd, tmp, &(lat[j].connect));
+		snprintf(tmp, sizeof(tmp), "%s:%d first byte", cl->matrixs[j].ip, cl->matrixs[j].port);
+		out_histogram(cmd, tmp, &(lat[j].first));
+		snprintf(tmp, sizeof(tmp), "%s:%d total", cl->matrixs[j].ip, cl->matrixs[j].port);
+		out_histogram(cmd, tmp, &(lat[j].total));
+	}
+
+	free(cmdlat);
+	free(lat);
+}
+
+/* ------------- counters, see stats ------------- */
+
+/* counters of all workers, and of servers of cl if st is not NULL, idle and open
+ * connections of servers too if pools is not NULL (two for each server),
+ * counters of other workers may be a little behind
+ */
+static void
+sum_counters(struct cluster *cl, struct counters *c, struct srvstat *st, int *pools)
+{
+	struct srvstat *t;
+	struct worker *w;
+	int i, j;
+
+	memset(c, 0, sizeof(struct counters));
+	for (i = 0; i < nthreads; i ++) {
+		w = workers + i;
+		c->requests += w->requests;
+		c->syscalls += w->syscalls;
+		c->cmd_get += w->cmd_get;
+		c->cmd_gets += w->cmd_gets;
+		c->cmd_set += w->cmd_set;
+		c->cmd_cas += w->cmd_cas;
+		c->cmd_incr_decr += w->cmd_incr_decr;
+		c->cmd_delete += w->cmd_delete;
+		c->cmd_other += w->cmd_other;
+		c->get_hits += w->get_hits;
+		c->get_misses += w->get_misses;
+		c->client_read += w->client_read;
+		c->client_written += w->client_written;
+		c->failovers += w->failovers;
+		c->buffered += w->buffered;
+		c->ncache_hits += w->ncache_hits;
+		c->ncache_misses += w->ncache_misses;
+		c->coalesced += w->coalesced;
+		c->timeouts += w->timeouts;
+
+		/* still switching to reloaded servers if cl differs */
+		pthread_mutex_lock(&(w->hotlock));
+		for (j = 0; w->cl == cl && w->srvstats && j < cl->matrixcnt; j ++) {
+			if (st) {
+				t = w->srvstats + j;
+				st[j].hits += t->hits;
+				st[j].misses += t->misses;
+				st[j].bytes_read += t->bytes_read;
+				st[j].bytes_written += t->bytes_written;
+				st[j].reuses += t->reuses;
+				st[j].connects += t->connects;
+			}
+			if (pools && w->matrixs[j]) {
+				pools[j * 2] += w->matrixs[j]->used;
+				pools[j * 2 + 1] += w->matrixs[j]->conns;
+			}
+		}
+		pthread_mutex_unlock(&(w->hotlock));
+	}
+	if (c->buffered < 0) c->buffered = 0;
+}
+
+/* connections, commands, GET keys, bytes and connection pools from all workers */
+static void
+out_counters(command *cmd)
+{
+	struct cluster *cl = curworker->cl;
+	struct counters c;
+	struct srvstat *st;
+	char tmp[256];
+	int j;
+
+	st = (struct srvstat *) calloc(sizeof(struct srvstat), cl->matrixcnt);
+	sum_counters(cl, &c, st, NULL);
+
+	snprintf(tmp, sizeof(tmp), "connections current %d, max %d, total %llu, rejected %llu",
+			curconns, maxconns, totalconns, rejectconns);
+	out_string(cmd, tmp);
+	snprintf(tmp, sizeof(tmp), "commands get %llu, gets %llu, set %llu, cas %llu, incr/decr %llu, delete %llu, other %llu",
+			c.cmd_get, c.cmd_gets, c.cmd_set, c.cmd_cas, c.cmd_incr_decr, c.cmd_delete, c.cmd_other);
+	out_string(cmd, tmp);
+	snprintf(tmp, sizeof(tmp), "get keys hits %llu, misses %llu", c.get_hits, c.get_misses);
+	out_string(cmd, tmp);
+	snprintf(tmp, sizeof(tmp), "client bytes read %llu, written %llu", c.client_read, c.client_written);
+	out_string(cmd, tmp);
+	snprintf(tmp, sizeof(tmp), "buffered bytes %lld", c.buffered);
+	out_string(cmd, tmp);
+	snprintf(tmp, sizeof(tmp), "backup failovers %llu", c.failovers);
+	out_string(cmd, tmp);
+
+	for (j = 0; st && j < cl->matrixcnt; j ++) {
+		snprintf(tmp, sizeof(tmp), "server %s:%d, get keys hits %llu, misses %llu, bytes read %llu, written %llu, "
+				"pool reuses %llu, connects %llu", cl->matrixs[j].ip, cl->matrixs[j].port,
+				st[j].hits, st[j].misses, st[j].bytes_read, st[j].bytes_written, st[j].reuses, st[j].connects);
+		out_string(cmd, tmp);
+	}
+
+	free(st);
+}
+
+/* ------------- coalescing of GETs in flight, see -G ------------- */
+
+/* make key of leader query q visible to other GETs */
+static void
+coalesce_link(query *q, int pos, unsigned long long stamp)
+{
+	struct pending *p = q->pend + pos;
+	struct pending **bucket;
+
+	p->q = q;
+	p->pos = pos;
+	p->stamp = stamp;
+	p->hash = key_hash(q->cmd->keys[q->keyidx[pos]]);
+
+	bucket = curworker->pendings + p->hash % PENDING_BUCKETS;
+	p->hnext = *bucket;
+	*bucket = p;
+	p->linked = 1;
+}
+
+/* key replied or leader orphaned, nobody may join it any more */
+static void
+coalesce_unlink(struct pending *p)
+{
+	struct pending **pp;
+
+	if (p->linked == 0) return;
+
+	for (pp = curworker->pendings + p->hash % PENDING_BUCKETS; *pp != p; pp = &((*pp)->hnext)) ;
+	*pp = p->hnext;
+	p->hnext = NULL;
+	p->linked = 0;
+}
+
+/* wait for key idx of command with an identical GET in flight
+ * return 0 if joined, return 1 if command must send its own
+ */
+static int
+coalesce_join(command *cmd, int idx)
+{
+	char *key = cmd->keys[idx];
+	unsigned int hash = key_hash(key);
+	struct pending *p;
+	query *q = NULL, *sub;
+
+	for (p = curworker->pendings[hash % PENDING_BUCKETS]; p; p = p->hnext) {
+		q = p->q;
+		if (p->hash == hash && q->cmd->flag.is_gets_cmd == cmd->flag.is_gets_cmd
+				&& strcmp(q->cmd->keys[q->keyidx[p->pos]], key) == 0)
+			break;
+	}
+
+	/* key updated after that GET started, its value may be old */
+	if (p == NULL || p->stamp < key_stamps[hash % KEY_STAMPS])
+		return 1;
+
+	sub = query_new(cmd);
+	if (sub == NULL || (sub->keyidx = (int *) malloc(sizeof(int))) == NULL) {
+		query_free(sub);
+		return 1;
+	}
+
+	sub->keyidx[0] = idx;
+	sub->keycnt = 1;
+	sub->is_get = 1;
+	sub->leadpos = p->pos;
+	sub->subnext = q->subs;
+	q->subs = sub;
+
+	curworker->coalesced ++;
+	return 0;
+}
+
+/* keys from..to-1 of leader q replied, value is VALUE block of the last one
+ * or NULL if all missed, hand copies to commands waiting for them
+ */
+static void
+coalesce_release(query *q, int from, int to, list *value)
+{
+	query *sub, **p;
+	int i;
+
+	for (i = from; i < to; i ++)
+		coalesce_unlink(q->pend + i);
+
+	p = &(q->subs);
+	while ((sub = *p) != NULL) {
+		if (sub->leadpos < from || sub->leadpos >= to) {
+			p = &(sub->subnext);
+			continue;
+		}
+
+		*p = sub->subnext;
+		if (sub->cmd && value && sub->leadpos == to - 1)
+			copy_list(value, sub->cmd->values + sub->keyidx[0]);
+		finish_query(sub);
+	}
+}
+
+/* leader q failed or lost its command, commands waiting on it ask for themselves */
+static void
+coalesce_retry(query *q, int failed)
+{
+	command *cmd;
+	query *sub;
+
+	while ((sub = q->subs) != NULL) {
+		q->subs = sub->subnext;
+
+		cmd = sub->cmd;
+		if (cmd == NULL) {
+			query_free(sub);
+			continue;
+		}
+
+		query_unlink(sub);
+		if (failed == 0)
+			dispatch_get_keys(cmd, sub->keyidx, 1, 0);
+		else if (curworker->cl->backupcnt > 0)
+			dispatch_get_keys(cmd, sub->keyidx, 1, 1);
+		query_free(sub);
+
+		if (cmd->queries == NULL)
+			finish_get_transcation(cmd);
+	}
+}
+
+static void
+start_update_backupserver(command *cmd)
+{
+	list data = { NULL, NULL };
+	matrix *m;
+	query *q = NULL;
+
+	if (cmd == NULL) return;
+
+	if (cmd->flag.is_update_cmd == 0 || curworker->cl->backupcnt == 0 || cmd->keycount != 1) return;
+
+	/* start backup set server now, nobody waits for its reply */
+	copy_list(&cmd->request, &data);
+	if (data.first == NULL) return;
+
+	if (cmd->flag.no_reply == 0) {
+		q = query_new(NULL);
+		if (q == NULL) {
+			list_free(&data, 1);
+			return;
+		}
+	}
+
+	m = curworker->backups[select_server(curworker->cl->backupkt, curworker->cl->backupcnt, cmd->keys[0])];
+
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) BACKUP KEY \"%s\" -> %s:%d\n", cur_ts_str, __FILE__, __LINE__, cmd->keys[0], m->ip, m->port);
+
+	if (send_query(q, m, &data))
+		query_free(q);
+}
+
+/* send "get/gets <key>*" for keys owned by one memcached server
+ * return 0 if request is in flight
+ * return 1 if failed
+ */
+static int
+start_get_server(command *cmd, matrix *m, int *keyidx, int keycnt, int is_backup)
+{
+	list data = { NULL, NULL };
+	query *q;
+	buffer *b;
+	int i, len;
+
+	len = 8; /* "gets" + "\r\n" */
+	for (i = 0; i < keycnt; i ++)
+		len += strlen(cmd->keys[keyidx[i]]) + 1;
+
+	b = buffer_init_size(len);
+	q = query_new(cmd);
+	if (b == NULL || q == NULL || (q->keyidx = (int *) malloc(sizeof(int) * keycnt)) == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		buffer_free(b);
+		query_free(q);
+		return 1;
+	}
+
+	memcpy(q->keyidx, keyidx, sizeof(int) * keycnt);
+	q->keycnt = keycnt;
+	q->is_get = 1;
+	q->is_backup = is_backup;
+
+	b->size = snprintf(b->ptr, b->len, "%s", cmd->flag.is_gets_cmd?"gets":"get");
+	for (i = 0; i < keycnt; i ++)
+		b->size += snprintf(b->ptr + b->size, b->len - b->size, " %s", cmd->keys[keyidx[i]]);
+	memcpy(b->ptr + b->size, "\r\n", 2);
+	b->size += 2;
+	append_buffer_to_list(&data, b);
+
+	if (verbose_mode) 
+		fprintf(stderr, "%s: (%s.%d) %s %d KEYS -> %s:%d\n", cur_ts_str, __FILE__, __LINE__, is_backup?"BACKUP GET":"GET", keycnt, m->ip, m->port);
+
+	if (send_query(q, m, &data)) {
+		query_free(q);
+		return 1;
+	}
+
+	if (coalesce && !is_backup) {
+		q->pend = (struct pending *) calloc(sizeof(struct pending), keycnt);
+		for (i = 0; q->pend && i < keycnt; i ++)
+			coalesce_link(q, i, cmd->stamp);
+	}
+
+	return 0;
+}
+
+/* group keys by memcached server, one request per server, keeping client order */
+static void
+dispatch_get_keys(command *cmd, int *keyidx, int keycnt, int is_backup)
+{
+	struct matrix **ms;
+	struct ketama *kt;
+	char **keys;
+	int i, j, n, idx, cnt, *sidx, *group;
+
+	if (is_backup) {
+		ms = curworker->backups;
+		cnt = curworker->cl->backupcnt;
+		kt = curworker->cl->backupkt;
+	} else {
+		ms = curworker->matrixs;
+		cnt = curworker->cl->matrixcnt;
+		kt = curworker->cl->ketama;
+	}
+
+	sidx = (int *) malloc(sizeof(int) * keycnt * 2);
+	keys = (char **) malloc(sizeof(char *) * keycnt);
+	if (sidx == NULL || keys == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		free(sidx);
+		free(keys);
+		return;
+	}
+	group = sidx + keycnt;
+
+	for (i = 0; i < keycnt; i ++)
+		keys[i] = cmd->keys[keyidx[i]];
+	select_servers(kt, cnt, keys, keycnt, sidx);
+
+	for (i = 0; !is_backup && i < keycnt; i ++)
+		hotkey_count(sidx[i], keys[i], 1, 0);
+	free(keys);
+
+	for (i = 0; i < keycnt; i ++) {
+		if (sidx[i] < 0) continue;
+
+		idx = sidx[i];
+		for (n = 0, j = i; j < keycnt; j ++) {
+			if (sidx[j] == idx) {
+				group[n ++] = keyidx[j];
+				sidx[j] = -1;
+			}
+		}
+
+		if (start_get_server(cmd, ms[idx], group, n, is_backup) && !is_backup && curworker->cl->backupcnt > 0) {
+			curworker->failovers ++;
+			dispatch_get_keys(cmd, group, n, 1);
+		}
+	}
+
+	free(sidx);
+}
+
+/* all GET/GETS replies arrived, write VALUE blocks in client key order */
+static void
+finish_get_transcation(command *cmd)
+{
+	int i;
+
+	for (i = 0; i < cmd->keycount; i ++) {
+		if (cmd->values[i].first)
+			curworker->get_hits ++;
+		else
+			curworker->get_misses ++;
+		if (cmd->bin == NULL)
+			move_list(cmd->values + i, &cmd->response);
+	}
+
+	/* binary replies are made of values by finish_transcation() */
+	if (cmd->bin == NULL)
+		out_string(cmd, "END");
+	finish_transcation(cmd);
+}
+
+/* fan out GET/GETS keys to all memcached servers at once */
+static void
+start_get_transcation(command *cmd)
+{
+	buffer *b;
+	int i, n, *keyidx;
+
+	cmd->values = (list *) calloc(sizeof(list), cmd->keycount);
+	keyidx = (int *) malloc(sizeof(int) * cmd->keycount);
+	if (cmd->values == NULL || keyidx == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		free(keyidx);
+		server_error(cmd, "SERVER_ERROR OUT OF MEMORY");
+		return;
+	}
+
+	cmd->stamp = update_clock;
+	for (i = 0, n = 0; i < cmd->keycount; i ++) {
+		if (ncache) {
+			b = ncache_get(cmd->keys[i], cmd->flag.is_gets_cmd);
+			if (b) {
+				append_buffer_to_list(cmd->values + i, b);
+				curworker->ncache_hits ++;
+				continue;
+			}
+			curworker->ncache_misses ++;
+		}
+
+		if (coalesce && coalesce_join(cmd, i) == 0)
+			continue;
+		keyidx[n ++] = i;
+	}
+
+	if (n > 0)
+		dispatch_get_keys(cmd, keyidx, n, 0);
+	free(keyidx);
+
+	if (cmd->queries == NULL)
+		finish_get_transcation(cmd);
+}
+
+/* reply of query arrived */
+static void
+finish_query(query *q)
+{
+	command *cmd = q->cmd;
+	int is_get = q->is_get;
+
+	if (q->pend) {
+		/* keys not replied are misses */
+		if (cmd) coalesce_release(q, q->keypos, q->keycnt, NULL);
+		coalesce_retry(q, 0);
+		cmd = q->cmd;
+	}
+
+	query_free(q);
+	if (cmd == NULL) return;
+
+	if (is_get) {
+		if (cmd->queries == NULL)
+			finish_get_transcation(cmd);
+	} else {
+		/* GET started before memcached server replied may read old value */
+		if (ncache || coalesce)
+			key_updated(cmd->keys[0]);
+		finish_transcation(cmd);
+	}
+}
+
+/* query failed with its memcached server */
+static void
+fail_query(query *q)
+{
+	command *cmd;
+	int i;
+
+	if (q->pend)
+		coalesce_retry(q, 1);
+
+	cmd = q->cmd;
+	if (cmd == NULL) {
+		query_free(q);
+		return;
+	}
+
+	query_unlink(q);
+
+	if (q->is_get) {
+		/* drop partial VALUE block, retry unfinished keys on backup servers */
+		for (i = q->keypos; i < q->keycnt; i ++)
+			list_free(cmd->values + q->keyidx[i], 1);
+
+		if (!q->is_backup && curworker->cl->backupcnt > 0 && q->keypos < q->keycnt) {
+			curworker->failovers ++;
+			dispatch_get_keys(cmd, q->keyidx + q->keypos, q->keycnt - q->keypos, 1);
+		}
+
+		query_free(q);
+		if (cmd->queries == NULL)
+			finish_get_transcation(cmd);
+	} else {
+		query_free(q);
+		try_backup_server(cmd);
+	}
+}
+
+/* memcached server connection failed, fail all queries on it */
+static void
+server_fail(struct server *s)
+{
+	query *q, *w, *n;
+
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) SERVER %s:%d FD %d FAILED\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port, s->sfd);
+
+	q = s->qhead;
+	s->qhead = s->qtail = NULL;
+	w = s->whead;
+	s->whead = s->wtail = NULL;
+	server_result(s, 0);
+	server_close(s);
+
+	while (q) {
+		n = q->next;
+		fail_query(q);
+		q = n;
+	}
+
+	/* noreply commands not written yet */
+	while (w) {
+		n = w->next;
+		fail_query(w);
+		w = n;
+	}
+}
+
+/* memcached server missed connect, write or read deadline, see -T */
+static void
+server_timeout(void *arg)
+{
+	struct server *s = (struct server *) arg;
+
+	curworker->timeouts ++;
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) SERVER %s:%d FD %d TIMED OUT\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port, s->sfd);
+
+	server_fail(s);
+}
+
+/* command missed its deadline, GET replies keys arrived so far */
+static void
+command_timeout(void *arg)
+{
+	command *cmd = (command *) arg;
+	query *q;
+	int i;
+
+	curworker->timeouts ++;
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) COMMAND \"%s\" TIMED OUT\n", cur_ts_str, __FILE__, __LINE__, cmd->keycount > 0 ? cmd->keys[0] : "");
+
+	if (cmd->flag.is_get_cmd == 0) {
+		server_error(cmd, "SERVER_ERROR TIMEOUT");
+		return;
+	}
+
+	/* keys still in flight are missed, late replies are dropped */
+	while ((q = cmd->queries) != NULL) {
+		for (i = q->keypos; i < q->keycnt; i ++)
+			list_free(cmd->values + q->keyidx[i], 1);
+		query_unlink(q);
+	}
+
+	finish_get_transcation(cmd);
+}
+
+/* command of a class timed by stats latency starts now */
+static void
+command_timed(command *cmd)
+{
+	if (cmd->flag.is_get_cmd)
+		cmd->latclass = (cmd->keycount > 1) ? LATENCY_MULTIGET : LATENCY_GET;
+	else if (cmd->flag.is_set_cmd)
+		cmd->latclass = LATENCY_STORAGE;
+	else if (cmd->flag.is_incr_decr_cmd)
+		cmd->latclass = LATENCY_INCRDECR;
+	else if (cmd->flag.is_delete_cmd)
+		cmd->latclass = LATENCY_DELETE;
+	else
+		return;
+
+	cmd->started = latency_now();
+}
+
+/* start whole memcache agent transcation */
+static void
+start_magent_transcation(command *cmd)
+{
+	if (cmd == NULL) return;
+
+	command_timed(cmd);
+
+	if (cmd->flag.is_get_cmd) {
+		start_get_transcation(cmd);
+		if (total_timeout && cmd->queries)
+			wheel_set(&(cmd->timer), wheel_deadline(total_timeout), command_timeout, cmd);
+		return;
+	}
+
+	if (ncache || coalesce)
+		key_updated(cmd->keys[0]);
+
+	if (cmd->flag.is_update_cmd  && curworker->cl->backupcnt > 0 && cmd->keycount == 1)
+		start_update_backupserver(cmd);
+
+	/* start transaction to normal server */
+	do_transcation(cmd);
+
+	if (total_timeout && cmd->queries)
+		wheel_set(&(cmd->timer), wheel_deadline(total_timeout), command_timeout, cmd);
+}
+
+/* send update command to the memcached server of key */
+static void
+send_update(command *cmd, matrix *m)
+{
+	list data = { NULL, NULL };
+	query *q = NULL;
+
+	if (verbose_mode) 
+		fprintf(stderr, "%s: (%s.%d) %sSET KEY \"%s\" -> %s:%d\n", cur_ts_str, __FILE__, __LINE__, cmd->flag.is_backup?"BACKUP ":"", cmd->keys[0], m->ip, m->port);
+
+	copy_list(&cmd->request, &data);
+	q = query_new(cmd);
+	if (q == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		list_free(&data, 1);
+		server_error(cmd, "SERVER_ERROR OUT OF MEMORY");
+		return;
+	}
+
+	/* noreply command holds back next ones until it is written,
+	 * they reuse its connection from pool and stay in order
+	 */
+	q->no_reply = cmd->flag.no_reply;
+
+	if (send_query(q, m, &data)) {
+		query_free(q);
+		try_backup_server(cmd);
+	}
+}
+
+/* start/repeat memcached proxy transcations */
+static void
+do_transcation(command *cmd)
+{
+	buffer *b;
+	size_t bytes = 0;
+	int idx;
+
+	if (cmd == NULL) return;
+
+	idx = select_server(curworker->cl->ketama, curworker->cl->matrixcnt, cmd->keys[0]);
+	for (b = cmd->request.first; b; b = b->next)
+		bytes += b->size;
+	hotkey_count(idx, cmd->keys[0], 1, bytes);
+
+	cmd->flag.is_backup = 0;
+	send_update(cmd, curworker->matrixs[idx]);
+}
+
+static void
+try_backup_server(command *cmd)
+{
+	if (cmd == NULL) return;
+
+	if (cmd->flag.is_backup || cmd->flag.is_incr_decr_cmd || curworker->cl->backupcnt == 0) {
+		/* don't duplicate incr/decr cmds */
+		/* already tried backup server or no backup server*/
+		server_error(cmd, "SERVER_ERROR CAN NOT CONNECT TO BACKEND SERVER");
+		return;
+	}
+
+	cmd->flag.is_backup = 1;
+	curworker->failovers ++;
+	send_update(cmd, curworker->backups[select_server(curworker->cl->backupkt, curworker->cl->backupcnt, cmd->keys[0])]);
+}
+
+/* parse replies of queries in FIFO order
+ * return 0 if ok, return -1 if error
+ */
+static int
+process_response(struct server *s)
+{
+	unsigned long long now = 0;
+	query *q;
+	int r;
+
+	while (s->pos > 0 && (q = s->qhead) != NULL) {
+		if (q->replied == 0)
+			query_latency(s, q, 0, &now);
+
+		if (q->is_get)
+			r = process_get_response(s, q);
+		else
+			r = process_update_response(s, q);
+
+		if (r <= 0) return r; /* need more data or error */
+
+		s->qhead = q->next;
+		if (s->qhead == NULL) s->qtail = NULL;
+		query_latency(s, q, 1, &now);
+		finish_query(q);
+	}
+
+	/* reply without query */
+	if (s->pos > 0) return -1;
+
+	return 0;
+}
+
+/* drive machine of memcached server connection */
+static void
+drive_server(const int fd, const short which, void *arg)
+{
+	struct server *s;
+	struct latency *l;
+	struct srvstat *st;
+	int socket_error, r, toread, got = 0;
+	socklen_t socket_error_len;
+
+	if (arg == NULL) return;
+	s = (struct server *)arg;
+
+	if (s->pool_idx > 0) {
+		/* idle in keep alive pool */
+		pool_server_handler(fd, which, arg);
+		return;
+	}
+
+	if (which & EV_WRITE) {
+		switch (s->state) {
+		case SERVER_CONNECTING:
+			socket_error_len = sizeof(socket_error);
+			curworker->syscalls ++;
+			/* try to finish the connect() */
+			if ((0 != getsockopt(s->sfd, SOL_SOCKET, SO_ERROR, &socket_error, &socket_error_len)) ||
+					(socket_error != 0)) {
+				if (verbose_mode)
+					fprintf(stderr, "%s: (%s.%d) CAN'T CONNECT TO SERVER %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->owner->ip, s->owner->port);
+				server_fail(s);
+				return;
+			}
+
+			if (verbose_mode)
+				fprintf(stderr, "%s: (%s.%d) CONNECTED FD %d <-> %s:%d\n", cur_ts_str, __FILE__, __LINE__, s->sfd, s->owner->ip, s->owner->port);
+
+			s->state = SERVER_CONNECTED;
+			server_result(s, 1);
+			if (s->stamp && (l = server_latency(s)) != NULL)
+				latency_add(&(l->connect), latency_now() - s->stamp);
+			/* go on writing request */
+
+		case SERVER_CONNECTED:
+			/* write request to memcached server */
+			if (server_write(s)) return;
+			break;
+
+		default:
+			server_fail(s);
+			return;
+		}
+	}
+
+	if (!(which & EV_READ)) return;
+
+	st = server_stat(s->owner);
+
+	/* read until socket is drained, a short read means nothing left */
+	do {
+		curworker->syscalls ++;
+		if (s->value && s->pos == 0) {
+			/* read data block straight into buffer sent to client */
+			toread = s->valuebytes;
+			r = read(s->sfd, s->value->ptr + s->value->size, toread);
+		} else {
+			toread = BUFFERLEN - s->pos;
+			r = read(s->sfd, s->line + s->pos, toread);
+		}
+
+		if (r <= 0) {
+			if (r == 0 || (errno != EAGAIN && errno != EINTR)) {
+				server_fail(s);
+				return;
+			}
+			break;
+		}
+		got = 1;
+		if (st) st->bytes_read += r;
+
+		if (s->value && s->pos == 0) {
+			s->value->size += r;
+			s->valuebytes -= r;
+			/* go on reading END or next VALUE */
+			if (s->valuebytes == 0)
+				finish_value(s, s->qhead);
+			continue;
+		}
+
+		s->pos += r;
+		if (process_response(s) < 0) {
+			server_fail(s);
+			return;
+		}
+	} while (r == toread);
+
+	/* all replies arrived, connection is free again */
+	if (s->qhead == NULL && s->request->first == NULL && (!s->is_mux || s->owner->idx < 0)) {
+		put_server_into_pool(s);
+		return;
+	}
+
+	if (got) {
+		/* replies went on, wait for the next one from now */
+		s->rexpire = s->qhead ? wheel_deadline(read_timeout) : 0;
+		server_timer(s);
+	}
+}
+
+/* data block of VALUE finished, hand it over to the command */
+static void
+finish_value(struct server *s, query *q)
+{
+	command *cmd;
+	int i;
+
+	if (s->value) {
+		if (q->cmd && q->curkey >= 0) {
+			cmd = q->cmd;
+			i = q->keyidx[q->curkey];
+			if (!q->is_backup)
+				hotkey_count(s->owner->idx, cmd->keys[i], 0, s->value->size);
+			append_buffer_to_list(cmd->values + i, s->value);
+			if (ncache)
+				ncache_put(cmd->keys[i], cmd->values + i, cmd->stamp, cmd->flag.is_gets_cmd);
+			if (q->pend)
+				coalesce_release(q, q->curkey, q->curkey + 1, cmd->values + i);
+		} else
+			buffer_free(s->value); /* client gone */
+		s->value = NULL;
+	}
+
+	if (q->curkey >= 0) q->keypos = q->curkey + 1;
+	q->curkey = -1;
+	s->has_response_header = 0;
+}
+
+/* parse GET/GETS response of one memcached server
+ *
+ * VALUE <key> <flags> <bytes> [<cas unique>]\r\n
+ * <data block>\r\n
+ * ...
+ * END\r\n
+ *
+ * return 0 if more data needed
+ * return 1 if END reached
+ * return -1 if error
+ */
+static int
+process_get_response(struct server *s, query *q)
+{
+	struct srvstat *st;
+	command *cmd;
+	buffer *b;
+	char *p, *key;
+	int pos, len, i;
+
+	while (s->pos > 0) {
+		/* client may be gone while reading */
+		cmd = q->cmd;
+
+		if (s->has_response_header == 0) {
+			pos = memstr(s->line, "\n", s->pos, 1);
+			if (pos == -1) {
+				/* header line must fit in line buffer */
+				return (s->pos < BUFFERLEN) ? 0 : -1;
+			}
+			pos ++;
+
+			if (pos == 5 && strncmp(s->line, "END\r\n", 5) == 0) {
+				/* keys not replied are misses */
+				if (q->cmd && (st = server_stat(s->owner)) != NULL)
+					st->misses += q->keycnt - q->keypos;
+				if (s->pos > pos)
+					memmove(s->line, s->line + pos, s->pos - pos);
+				s->pos -= pos;
+				return 1;
+			}
+
+			/* SERVER_ERROR or anything unexpected */
+			if (strncasecmp(s->line, "VALUE ", 6) != 0)
+				return -1;
+
+			b = buffer_init_size(pos + 1);
+			if (b == NULL) {
+				fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+				return -1;
+			}
+			memcpy(b->ptr, s->line, pos);
+			b->size = pos;
+			b->ptr[pos] = '\0';
+
+			s->valuebytes = -1;
+			key = b->ptr + 6;
+			p = strchr(key, ' ');
+			if (p) {
+				p = strchr(p + 1, ' ');
+				if (p) s->valuebytes = atol(p + 1);
+			}
+
+			if (s->valuebytes < 0) {
+				buffer_free(b);
+				return -1;
+			}
+			s->valuebytes += 2; /* trailing \r\n */
+
+			/* memcached replies in request order, keys skipped are misses */
+			len = strcspn(key, " ");
+			i = q->keycnt;
+			if (cmd) {
+				for (i = q->keypos; i < q->keycnt; i ++) {
+					p = cmd->keys[q->keyidx[i]];
+					if (strlen(p) == len && memcmp(p, key, len) == 0) break;
+				}
+			}
+
+			if (i < q->keycnt) {
+				/* keys skipped are misses for commands waiting too */
+				if (q->pend && i > q->keypos)
+					coalesce_release(q, q->keypos, i, NULL);
+				cmd = q->cmd;
+				if (cmd == NULL) i = q->keycnt; /* client gone */
+			}
+
+			if (i < q->keycnt) {
+				if ((st = server_stat(s->owner)) != NULL) {
+					st->misses += i - q->keypos;
+					st->hits ++;
+				}
+				q->keypos = q->curkey = i;
+				append_buffer_to_list(cmd->values + q->keyidx[i], b);
+
+				/* whole data block in one buffer, drive_server() reads into it directly */
+				s->value = buffer_init_size(s->valuebytes + 1);
+				if (s->value == NULL) {
+					fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+					return -1;
+				}
+			} else {
+				q->curkey = -1;
+				buffer_free(b);
+			}
+			s->has_response_header = 1;
+		} else {
+			/* data block */
+			pos = (s->pos < s->valuebytes) ? s->pos : s->valuebytes;
+
+			if (s->value) {
+				memcpy(s->value->ptr + s->value->size, s->line, pos);
+				s->value->size += pos;
+			}
+
+			s->valuebytes -= pos;
+			if (s->valuebytes == 0)
+				finish_value(s, q);
+		}
+
+		if (s->pos > pos)
+			memmove(s->line, s->line + pos, s->pos - pos);
+		s->pos -= pos;
+	}
+
+	return 0;
+}
+
+/* one line response of update commands
+ * NOT_FOUND\r\n
+ * STORED\r\n
+ *
+ * return 0 if more data needed
+ * return 1 if line finished
+ * return -1 if error
+ */
+static int
+process_update_response(struct server *s, query *q)
+{
+	buffer *b;
+	int pos;
+
+	pos = memstr(s->line, "\n", s->pos, 1);
+	if (pos == -1)
+		return (s->pos < BUFFERLEN) ? 0 : -1;
+	pos ++;
+
+	if (q->cmd) {
+		b = buffer_init_size(pos + 1);
+		if (b == NULL) {
+			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+			return -1;
+		}
+		memcpy(b->ptr, s->line, pos);
+		b->size = pos;
+		append_buffer_to_list(&q->cmd->response, b);
+	}
+
+	if (s->pos > pos)
+		memmove(s->line, s->line + pos, s->pos - pos);
+	s->pos -= pos;
+
+	return 1;
+}
+
+
+/* parse one command from line buffer of client
+ * return 1 if command found
+ * return 0 if more data needed or client closed
+ */
+static int
+process_command(conn *c)
+{
+	char *p;
+	int len, skip = 0, i, j;
+	buffer *b;
+	command *cmd;
+	token_t tokens[MAX_TOKENS];
+	size_t ntokens;
+
+	p = (char *) memchr(c->line, '\n', c->pos);
+	if (p == NULL) {
+		if (c->pos >= BUFFERLEN) {
+			/* command line too long */
+			if (verbose_mode)
+				fprintf(stderr, "%s: (%s.%d) CLIENT FD %d COMMAND LINE TOO LONG\n", cur_ts_str, __FILE__, __LINE__, c->cfd);
+			conn_close(c);
+		}
+		return 0;
+	}
+
+	curworker->requests ++;
+	cmd = command_new(c);
+	if (cmd == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		conn_close(c);
+		return 0;
+	}
+
+	len = p - c->line;
+	*p = '\0'; /* remove \n */
+	if (len > 0 && *(p-1) == '\r') {
+		*(p-1) = '\0'; /* remove \r */
+		len --;
+	}
+
+	/* backup command line buffer first */
+	b = buffer_init_size(len + 3);
+	if (b == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		conn_close(c);
+		return 0;
+	}
+	memcpy(b->ptr, c->line, len);
+	b->ptr[len] = '\r';
+	b->ptr[len+1] = '\n';
+	b->ptr[len+2] = '\0';
+	b->size = len + 2;
+
+#if 0
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) PROCESSING COMMAND: %s", cur_ts_str, __FILE__, __LINE__, b->ptr);
+#endif
+
+	cmd->flag.is_update_cmd = 1;
+
+	ntokens = tokenize_command(c->line, tokens, MAX_TOKENS);
+	if (ntokens >= 3 && (
+			(strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
+			(strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0)
+			)) {
+		/*
+		 * get/gets <key>*\r\n
+		 *
+		 * VALUE <key> <flags> <bytes> [<cas unique>]\r\n
+		 * <data block>\r\n
+		 * "END\r\n"
+		 */
+		cmd->keycount = ntokens - KEY_TOKEN - 1;
+		cmd->keys = (char **) calloc(sizeof(char *), cmd->keycount);
+		if (cmd->keys == NULL) {
+			cmd->keycount = 0;
+			out_string(cmd, "SERVER_ERROR OUT OF MEMORY");
+			skip = 1;
+		} else {
+			if (ntokens < MAX_TOKENS) {
+				for (i = KEY_TOKEN, j = 0; (i < ntokens) && (j < cmd->keycount); i ++, j ++)
+					cmd->keys[j] = strdup(tokens[i].value);
+			} else {
+				char *pp, **nn;
+
+				for (i = KEY_TOKEN, j = 0; (i < (MAX_TOKENS-1)) && (j < cmd->keycount); i ++, j ++)
+					cmd->keys[j] = strdup(tokens[i].value);
+
+				if (tokens[MAX_TOKENS-1].value != NULL) {
+					/* check for last TOKEN */
+					pp = strtok(tokens[MAX_TOKENS-1].value, " ");
+
+					while(pp != NULL) {
+						nn = (char **)realloc(cmd->keys, (cmd->keycount + 1)* sizeof(char *));
+						if (nn == NULL) {
+							/* out of memory */
+							break;
+						}
+						cmd->keys = nn;
+						cmd->keys[cmd->keycount] = strdup(pp);
+						cmd->keycount ++;
+						pp = strtok(NULL, " ");
+					}
+				} else {
+					/* last key is NULL, set keycount to actual number*/
+					cmd->keycount = j;
+				}
+			}
+
+			cmd->flag.is_get_cmd = 1;
+			cmd->flag.is_update_cmd = 0;
+
+			if (strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0) {
+				cmd->flag.is_gets_cmd = 1; /* GETS */
+				curworker->cmd_gets ++;
+			} else {
+				curworker->cmd_get ++;
+			}
+		}
+	} else if ((ntokens == 4 || ntokens == 5) && (
+				(strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0) ||
+				(strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)
+				)) {
+		/*
+		 * incr <key> <value> [noreply]\r\n
+		 * decr <key> <value> [noreply]\r\n
 		 *
-		 * VALUE <key> <flags> <bytes> [<cas unique>]\r\n
+		 * "NOT_FOUND\r\n" to indicate the item with this value was not found 
+		 * <value>\r\n , where <value> is the new value of the item's data,
+		 */
+		cmd->flag.is_incr_decr_cmd = 1;
+		curworker->cmd_incr_decr ++;
+	} else if (ntokens >= 3 && ntokens <= 5 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
+		/*
+		 * delete <key> [<time>] [noreply]\r\n
+		 *
+		 * "DELETED\r\n" to indicate success 
+		 * "NOT_FOUND\r\n" to indicate that the item with this key was not
+		 */
+		cmd->flag.is_delete_cmd = 1;
+		curworker->cmd_delete ++;
+	} else if ((ntokens == 7 || ntokens == 8) && 
+			(strcmp(tokens[COMMAND_TOKEN].value, "cas") == 0)) {
+		/*
+		 * cas <key> <flags> <exptime> <bytes> <cas unqiue> [noreply]\r\n
 		 * <data block>\r\n
-		 * "END\r\n"
+		 *
+		 * "STORED\r\n", to indicate success.  
+		 * "NOT_STORED\r\n" to indicate the data was not stored, but not
+		 * "EXISTS\r\n" to indicate that the item you are trying to store with
+		 * "NOT_FOUND\r\n" to indicate that the item you are trying to store
+		 */
+		cmd->flag.is_set_cmd = 1;
+		cmd->storebytes = atol(tokens[BYTES_TOKEN].value);
+		cmd->storebytes += 2; /* \r\n */
+		curworker->cmd_cas ++;
+	} else if ((ntokens == 6 || ntokens == 7) && (
+			(strcmp(tokens[COMMAND_TOKEN].value, "add") == 0) ||
+			(strcmp(tokens[COMMAND_TOKEN].value, "set") == 0) ||
+			(strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0) ||
+			(strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0) ||
+			(strcmp(tokens[COMMAND_TOKEN].value, "append") == 0)
+			)) {
+		/*
+		 * <cmd> <key> <flags> <exptime> <bytes> [noreply]\r\n
+		 * <data block>\r\n
+		 *
+		 * "STORED\r\n", to indicate success.  
+		 * "NOT_STORED\r\n" to indicate the data was not stored, but not
+		 * "EXISTS\r\n" to indicate that the item you are trying to store with
+		 * "NOT_FOUND\r\n" to indicate that the item you are trying to store
+		 */
+		cmd->flag.is_set_cmd = 1;
+		cmd->storebytes = atol(tokens[BYTES_TOKEN].value);
+		cmd->storebytes += 2; /* \r\n */
+		curworker->cmd_set ++;
+	} else if (ntokens == 3 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0) &&
+			(strcmp(tokens[KEY_TOKEN].value, "hotkeys") == 0)) {
+		/* hottest keys of each memcached server
+		 * hotkeys <ip>:<port> by requests/s
+		 * <key> <rate>
+		 * ...
+		 * END\r\n
+		 */
+		for (i = 0; i < curworker->cl->matrixcnt; i ++) {
+			out_hotkeys(cmd, i, 0);
+			out_hotkeys(cmd, i, 1);
+		}
+		out_string(cmd, "END");
+		skip = 1;
+	} else if ((ntokens == 3 || ntokens == 4) && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0) &&
+			(strcmp(tokens[KEY_TOKEN].value, "latency") == 0)) {
+		/* latency histograms since start or last reset
+		 * latency window <seconds> s
+		 * latency <get|multiget|...|ip:port connect|first byte|total>: count <n>, avg <us>, p50 <us>, ...
+		 * ...
+		 * END\r\n
+		 *
+		 * stats latency reset starts a new window
+		 * RESET\r\n
+		 */
+		if (ntokens == 3) {
+			out_latency(cmd);
+			out_string(cmd, "END");
+		} else if (strcmp(tokens[KEY_TOKEN + 1].value, "reset") == 0) {
+			latency_since = cur_ts;
+			__sync_add_and_fetch(&latency_epoch, 1);
+			out_string(cmd, "RESET");
+		} else {
+			out_string(cmd, "ERROR");
+		}
+		skip = 1;
+	} else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
+		/* END\r\n
+		 */
+		char tmp[128];
+		unsigned long long requests = 0, syscalls = 0;
+		struct cluster *cl = curworker->cl;
+		double *shares;
+
+		out_string(cmd, "memcached agent v" VERSION);
+		shares = (double *) malloc(sizeof(double) * cl->matrixcnt);
+		if (shares) {
+			if (cl->ketama) {
+				ketama_shares(cl->ketama, shares);
+			} else {
+				for (i = 0; i < cl->matrixcnt; i ++)
+					shares[i] = 1.0 / cl->matrixcnt;
+			}
+		}
+		for (i = 0; i < cl->matrixcnt; i ++) {
+			snprintf(tmp, 127, "matrix %d -> %s:%d, pool size %d, weight %d, key share %.2f%%%s", 
+					i+1, cl->matrixs[i].ip, cl->matrixs[i].port, curworker->matrixs[i]->used,
+					cl->ketama ? cl->matrixs[i].weight : 100, shares ? shares[i] * 100.0 : 0.0,
+					cl->matrixs[i].down ? ", ejected" : "");
+			out_string(cmd, tmp);
+		}
+		free(shares);
+
+		/* counters of other workers may be a little behind */
+		for (i = 0; i < nthreads; i ++) {
+			requests += workers[i].requests;
+			syscalls += workers[i].syscalls;
+		}
+		snprintf(tmp, 127, "requests %llu, syscalls %llu, %.2f syscalls per request",
+				requests, syscalls, requests ? (double) syscalls / requests : 0.0);
+		out_string(cmd, tmp);
+		out_counters(cmd);
+
+		if (ncache) {
+			unsigned long long hits = 0, misses = 0;
+			unsigned long items = 0, bytes = 0;
+
+			for (i = 0; i < nthreads; i ++) {
+				hits += workers[i].ncache_hits;
+				misses += workers[i].ncache_misses;
+			}
+			for (i = 0; i < NCACHE_SEGMENTS; i ++) {
+				items += ncache[i].items;
+				bytes += ncache[i].bytes;
+			}
+			snprintf(tmp, 127, "near cache hits %llu, misses %llu, items %lu, bytes %lu",
+					hits, misses, items, bytes);
+			out_string(cmd, tmp);
+		}
+
+		if (coalesce) {
+			unsigned long long coalesced = 0;
+
+			for (i = 0; i < nthreads; i ++)
+				coalesced += workers[i].coalesced;
+			snprintf(tmp, 127, "coalesced gets %llu", coalesced);
+			out_string(cmd, tmp);
+		}
+
+		if (connect_timeout || write_timeout || read_timeout || total_timeout) {
+			unsigned long long timeouts = 0;
+
+			for (i = 0; i < nthreads; i ++)
+				timeouts += workers[i].timeouts;
+			snprintf(tmp, 127, "timeouts %llu", timeouts);
+			out_string(cmd, tmp);
+		}
+		out_string(cmd, "END");
+		skip = 1;
+	} else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
+		/* close after replies of previous commands */
+		cmd->flag.is_quit = 1;
+		skip = 1;
+	} else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
+		out_string(cmd, "VERSION memcached agent v" VERSION);
+		skip = 1;
+	} else {
+		out_string(cmd, "UNSUPPORTED COMMAND");
+		skip = 1;
+	}
+
+	/* answered by magent itself */
+	if (skip) curworker->cmd_other ++;
+
+	/* finish process commands */
+	if (skip == 0) {
+		/* append buffer to list */
+		append_buffer_to_list(&cmd->request, b);
+
+		if (cmd->flag.is_get_cmd == 0) {
+			if (tokens[ntokens-2].value && strcmp(tokens[ntokens-2].value, "noreply") == 0)
+				cmd->flag.no_reply = 1;
+			cmd->keycount = 1;
+			cmd->keys = (char **) calloc(sizeof(char *), 1);
+			if (cmd->keys == NULL) {
+				fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+				conn_close(c);
+				return 0;
+			}
+			cmd->keys[0] = strdup(tokens[KEY_TOKEN].value);
+		}
+	} else {
+		buffer_free(b);
+	}
+
+	i = p - c->line + 1;
+	if (i < c->pos) {
+		memmove(c->line, p+1, c->pos - i);
+		c->pos -= i;
+	} else {
+		c->pos = 0;
+	}
+
+	if (skip) {
+		finish_transcation(cmd);
+		return 1;
+	}
+
+	return read_data_block(c, cmd);
+}
+
+/* data block of storage command may follow in line buffer, start command
+ * when all of it is read
+ * return 1 if command started
+ * return 0 if more data needed or client closed
+ */
+static int
+read_data_block(conn *c, command *cmd)
+{
+	buffer *b;
+	int len;
+
+	if (cmd->storebytes > 0 && c->pos > 0) {
+		/* data block may be followed by next commands */
+		len = (c->pos < cmd->storebytes) ? c->pos : cmd->storebytes;
+		b = buffer_init_size(len + 1);
+		if (b == NULL) {
+			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+			conn_close(c);
+			return 0;
+		}
+		memcpy(b->ptr, c->line, len);
+		b->size = len;
+		cmd->storebytes -= len;
+		append_buffer_to_list(&cmd->request, b);
+
+		if (len < c->pos)
+			memmove(c->line, c->line + len, c->pos - len);
+		c->pos -= len;
+	}
+
+	if (cmd->storebytes > 0) {
+		/* go on reading data block */
+		c->state = CLIENT_NREAD;
+		return 0;
+	}
+
+	if (c->binary && cmd->flag.is_set_cmd && binary_data_end(cmd))
+		return 1;
+
+	start_magent_transcation(cmd);
+	return 1;
+}
+
+/* ------------- memcached binary protocol of clients ------------- */
+
+static unsigned int
+binary_get16(const unsigned char *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static unsigned int
+binary_get32(const unsigned char *p)
+{
+	return ((unsigned int) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned long long
+binary_get64(const unsigned char *p)
+{
+	return ((unsigned long long) binary_get32(p) << 32) | binary_get32(p + 4);
+}
+
+static void
+binary_put64(unsigned char *p, unsigned long long v)
+{
+	int i;
+
+	for (i = 7; i >= 0; i --, v >>= 8)
+		p[i] = v & 0xff;
+}
+
+/* GET/GETQ/GETK/GETKQ, batched into one command */
+static int
+binary_getop(unsigned char op)
+{
+	return (op == BIN_CMD_GET || op == BIN_CMD_GETQ || op == BIN_CMD_GETK || op == BIN_CMD_GETKQ);
+}
+
+/* quiet commands reply nothing but errors, GETQ/GETKQ nothing on misses */
+static int
+binary_quiet(unsigned char op)
+{
+	switch (op) {
+		case BIN_CMD_GETQ:
+		case BIN_CMD_GETKQ:
+		case BIN_CMD_SETQ:
+		case BIN_CMD_ADDQ:
+		case BIN_CMD_REPLACEQ:
+		case BIN_CMD_DELETEQ:
+		case BIN_CMD_INCREMENTQ:
+		case BIN_CMD_DECREMENTQ:
+		case BIN_CMD_QUITQ:
+		case BIN_CMD_APPENDQ:
+		case BIN_CMD_PREPENDQ:
+			return 1;
+	}
+
+	return 0;
+}
+
+/* keys are proxied in ascii commands, no spaces or control characters */
+static int
+binary_key_ok(const unsigned char *key, int len)
+{
+	int i;
+
+	if (len <= 0 || len > KEY_MAX_LENGTH) return 0;
+	for (i = 0; i < len; i ++)
+		if (key[i] <= ' ' || key[i] == 0x7f) return 0;
+
+	return 1;
+}
+
+/* append response packet of r to command output
+ * return 0 if ok, return -1 if out of memory
+ */
+static int
+binary_out(command *cmd, const struct binreq *r, int status, const char *extras, int extlen,
+		const char *key, int keylen, int vallen, unsigned long long cas, buffer **value)
+{
+	unsigned char *p;
+	buffer *b;
+	int bodylen = extlen + keylen + vallen;
+
+	b = buffer_init_size(BIN_HEADER_LEN + bodylen + 1);
+	if (b == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		return -1;
+	}
+
+	p = (unsigned char *) b->ptr;
+	memset(p, 0, BIN_HEADER_LEN);
+	p[0] = BIN_RES_MAGIC;
+	p[1] = r->opcode;
+	p[2] = keylen >> 8;
+	p[3] = keylen & 0xff;
+	p[4] = extlen;
+	p[6] = status >> 8;
+	p[7] = status & 0xff;
+	p[8] = bodylen >> 24;
+	p[9] = (bodylen >> 16) & 0xff;
+	p[10] = (bodylen >> 8) & 0xff;
+	p[11] = bodylen & 0xff;
+	memcpy(p + 12, &(r->opaque), 4);
+	binary_put64(p + 16, cas);
+
+	if (extlen > 0) memcpy(p + BIN_HEADER_LEN, extras, extlen);
+	if (keylen > 0) memcpy(p + BIN_HEADER_LEN + extlen, key, keylen);
+	b->size = BIN_HEADER_LEN + extlen + keylen;
+
+	/* value is copied in by caller */
+	if (value) *value = b;
+	else b->size += vallen;
+
+	append_buffer_to_list(&cmd->response, b);
+	return 0;
+}
+
+/* reply with str as value, error message or version */
+static int
+binary_string(command *cmd, const struct binreq *r, int status, const char *msg)
+{
+	buffer *b;
+	int len = strlen(msg);
+
+	if (binary_out(cmd, r, status, NULL, 0, NULL, 0, len, 0, &b)) return -1;
+	memcpy(b->ptr + b->size, msg, len);
+	b->size += len;
+	return 0;
+}
+
+/* one binary reply for each key of GET command
+ *
+ * VALUE <key> <flags> <bytes> <cas unique>\r\n
+ * <data block>\r\n
+ *
+ * is replied as flags in extras, key for GETK/GETKQ, and data block as value
+ */
+static void
+binary_values(command *cmd)
+{
+	struct binreq *r;
+	buffer *b, *v;
+	char *p, *e, extras[4];
+	unsigned int flags;
+	unsigned long long cas;
+	int i, n, len, keylen, withkey, pos;
+
+	for (i = 0; i < cmd->keycount && i < cmd->nbin; i ++) {
+		r = cmd->bin + i;
+		withkey = (r->opcode == BIN_CMD_GETK || r->opcode == BIN_CMD_GETKQ);
+		keylen = withkey ? strlen(cmd->keys[i]) : 0;
+
+		/* VALUE line is always the head of first buffer */
+		b = cmd->values[i].first;
+		p = b ? memchr(b->ptr, '\n', b->size) : NULL;
+		if (p == NULL) {
+			if (binary_quiet(r->opcode)) continue;
+			if (binary_out(cmd, r, BIN_STATUS_KEY_ENOENT, NULL, 0, cmd->keys[i], keylen, 9, 0, &v)) return;
+			memcpy(v->ptr + v->size, "Not found", 9);
+			v->size += 9;
+			continue;
+		}
+
+		pos = p - b->ptr + 1;
+		p = strchr(b->ptr + 6, ' '); /* after key */
+		flags = p ? strtoul(p + 1, &e, 10) : 0;
+		len = p ? strtol(e, &e, 10) : 0;
+		cas = p ? strtoull(e, NULL, 10) : 0;
+
+		extras[0] = flags >> 24;
+		extras[1] = (flags >> 16) & 0xff;
+		extras[2] = (flags >> 8) & 0xff;
+		extras[3] = flags & 0xff;
+		if (binary_out(cmd, r, BIN_STATUS_OK, extras, 4, cmd->keys[i], keylen, len, cas, &v)) return;
+
+		/* data block without trailing \r\n, may span buffers */
+		for (; b && len > 0; b = b->next, pos = 0) {
+			n = b->size - pos;
+			if (n > len) n = len;
+			memcpy(v->ptr + v->size, b->ptr + pos, n);
+			v->size += n;
+			len -= n;
+		}
+		v->size += len; /* short value, never expected */
+	}
+}
+
+/* turn ascii reply of memcached or magent into binary replies of command */
+static void
+binary_reply(command *cmd)
+{
+	struct binreq *r;
+	unsigned char value[8];
+	char line[256];
+	buffer *b;
+	int i, n, len = 0, status;
+
+	if (cmd->flag.is_get_cmd && cmd->values) {
+		binary_values(cmd);
+		return;
+	}
+
+	/* first line of reply */
+	for (b = cmd->response.first; b && len < (int) sizeof(line) - 1; b = b->next) {
+		n = b->size - b->used;
+		if (n > (int) sizeof(line) - 1 - len) n = sizeof(line) - 1 - len;
+		memcpy(line + len, b->ptr + b->used, n);
+		len += n;
+	}
+	line[len] = '\0';
+	line[strcspn(line, "\r\n")] = '\0';
+	list_free(&cmd->response, 1);
+
+	if (strcmp(line, "STORED") == 0 || strcmp(line, "DELETED") == 0 ||
+			(line[0] >= '0' && line[0] <= '9'))
+		status = BIN_STATUS_OK;
+	else if (strcmp(line, "NOT_FOUND") == 0)
+		status = BIN_STATUS_KEY_ENOENT;
+	else if (strcmp(line, "EXISTS") == 0)
+		status = BIN_STATUS_KEY_EEXISTS;
+	else if (strcmp(line, "NOT_STORED") == 0)
+		status = BIN_STATUS_NOT_STORED;
+	else if (strstr(line, "non-numeric"))
+		status = BIN_STATUS_DELTA_BADVAL;
+	else if (strstr(line, "too large"))
+		status = BIN_STATUS_E2BIG;
+	else if (strstr(line, "out of memory") || strstr(line, "OUT OF MEMORY"))
+		status = BIN_STATUS_ENOMEM;
+	else if (strncmp(line, "SERVER_ERROR", 12) == 0)
+		status = BIN_STATUS_ETMPFAIL; /* backend down or timed out */
+	else
+		status = BIN_STATUS_EINVAL;
+
+	for (i = 0; i < cmd->nbin; i ++) {
+		r = cmd->bin + i;
+		if (status != BIN_STATUS_OK) {
+			if (binary_string(cmd, r, status, line)) return;
+		} else if (cmd->flag.is_incr_decr_cmd) {
+			if (binary_quiet(r->opcode)) continue;
+			binary_put64(value, strtoull(line, NULL, 10));
+			if (binary_out(cmd, r, status, NULL, 0, NULL, 0, 8, 0, &b)) return;
+			memcpy(b->ptr + b->size, value, 8);
+			b->size += 8;
+		} else if (binary_quiet(r->opcode) == 0) {
+			if (binary_out(cmd, r, status, NULL, 0, NULL, 0, 0, 0, NULL)) return;
+		}
+	}
+}
+
+/* data block of binary storage command read, memcached wants \r\n after it
+ * return 0 if ok, return 1 if command failed
+ */
+static int
+binary_data_end(command *cmd)
+{
+	buffer *b;
+
+	b = buffer_init_size(3);
+	if (b == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		server_error(cmd, "SERVER_ERROR OUT OF MEMORY");
+		return 1;
+	}
+	memcpy(b->ptr, "\r\n", 2);
+	b->size = 2;
+	append_buffer_to_list(&cmd->request, b);
+	return 0;
+}
+
+/* GET/GETK and quiet GETQ/GETKQ before them in line buffer, as one multi key command,
+ * keys go to each memcached server in one "gets" as ascii clients do
+ * return length of requests taken from line buffer, 0 if out of memory
+ */
+static int
+binary_get_command(conn *c, command *cmd)
+{
+	unsigned char *h;
+	int i, n = 0, pos = 0, keylen;
+
+	/* count requests of batch, first one is checked by caller */
+	while (pos + BIN_HEADER_LEN <= c->pos) {
+		h = (unsigned char *) c->line + pos;
+		keylen = binary_get16(h + 2);
+		if (h[0] != BIN_REQ_MAGIC || !binary_getop(h[1]) || h[4] != 0 || (int) binary_get32(h + 8) != keylen ||
+				pos + BIN_HEADER_LEN + keylen > c->pos || !binary_key_ok(h + BIN_HEADER_LEN, keylen))
+			break;
+
+		pos += BIN_HEADER_LEN + keylen;
+		n ++;
+
+		/* GET/GETK ends a batch */
+		if (!binary_quiet(h[1])) break;
+	}
+
+	cmd->keys = (char **) calloc(sizeof(char *), n);
+	cmd->bin = (struct binreq *) calloc(sizeof(struct binreq), n);
+	if (cmd->keys == NULL || cmd->bin == NULL)
+		return 0;
+
+	cmd->keycount = cmd->nbin = n;
+	for (i = 0, pos = 0; i < n; i ++) {
+		h = (unsigned char *) c->line + pos;
+		keylen = binary_get16(h + 2);
+		cmd->bin[i].opcode = h[1];
+		memcpy(&(cmd->bin[i].opaque), h + 12, 4);
+		cmd->keys[i] = strndup((char *) h + BIN_HEADER_LEN, keylen);
+		if (cmd->keys[i] == NULL)
+			return 0;
+		pos += BIN_HEADER_LEN + keylen;
+	}
+
+	/* gets, binary replies carry cas unique, near cache keeps it too */
+	cmd->flag.is_get_cmd = 1;
+	cmd->flag.is_gets_cmd = 1;
+	curworker->cmd_get ++;
+
+	return pos;
+}
+
+/* parse one binary request from line buffer of client, as the ascii command of it
+ *
+ * <magic> <opcode> <key length:2> <extras length> <data type> <vbucket:2>
+ * <body length:4> <opaque:4> <cas:8> <extras> <key> <value>
+ *
+ * return 1 if command found
+ * return 0 if more data needed or client closed
+ */
+static int
+process_binary_command(conn *c)
+{
+	unsigned char *h = (unsigned char *) c->line, *ext, *key;
+	unsigned int keylen, extlen, bodylen, vallen, need;
+	unsigned long long cas;
+	struct binreq r;
+	const char *name = NULL;
+	command *cmd;
+	buffer *b;
+	int skip = 0, bad = 0, len;
+
+	if (c->pos < BIN_HEADER_LEN) return 0;
+
+	keylen = binary_get16(h + 2);
+	extlen = h[4];
+	bodylen = binary_get32(h + 8);
+	cas = binary_get64(h + 16);
+	ext = h + BIN_HEADER_LEN;
+	key = ext + extlen;
+
+	if (h[0] != BIN_REQ_MAGIC || bodylen > BIN_BODY_MAX || keylen + extlen > bodylen) {
+		if (verbose_mode)
+			fprintf(stderr, "%s: (%s.%d) CLIENT FD %d BAD BINARY REQUEST\n", cur_ts_str, __FILE__, __LINE__, c->cfd);
+		conn_close(c);
+		return 0;
+	}
+
+	vallen = bodylen - extlen - keylen;
+
+	switch (h[1]) {
+		case BIN_CMD_SET: case BIN_CMD_SETQ: name = cas ? "cas" : "set"; break;
+		case BIN_CMD_ADD: case BIN_CMD_ADDQ: name = "add"; break;
+		case BIN_CMD_REPLACE: case BIN_CMD_REPLACEQ: name = cas ? "cas" : "replace"; break;
+		case BIN_CMD_APPEND: case BIN_CMD_APPENDQ: name = "append"; break;
+		case BIN_CMD_PREPEND: case BIN_CMD_PREPENDQ: name = "prepend"; break;
+	}
+
+	/* value of storage commands may be bigger than line buffer, it's read as data block */
+	need = BIN_HEADER_LEN + bodylen;
+	if (name) {
+		if (extlen == ((h[1] == BIN_CMD_APPEND || h[1] == BIN_CMD_APPENDQ || h[1] == BIN_CMD_PREPEND ||
+				h[1] == BIN_CMD_PREPENDQ) ? 0 : 8) &&
+				BIN_HEADER_LEN + extlen + keylen <= BUFFERLEN) {
+			need = BIN_HEADER_LEN + extlen + keylen;
+			if (c->pos >= (int) need && !binary_key_ok(key, keylen)) {
+				name = NULL;
+				bad = 1;
+				need = BIN_HEADER_LEN + bodylen;
+			}
+		} else {
+			name = NULL;
+			bad = 1;
+		}
+	}
+
+	if (need > BUFFERLEN) {
+		/* requests with big values are proxied for storage commands only */
+		if (verbose_mode)
+			fprintf(stderr, "%s: (%s.%d) CLIENT FD %d BINARY REQUEST TOO LONG\n", cur_ts_str, __FILE__, __LINE__, c->cfd);
+		conn_close(c);
+		return 0;
+	}
+	if (c->pos < (int) need) return 0;
+
+	curworker->requests ++;
+	cmd = command_new(c);
+	b = buffer_init_size(KEY_MAX_LENGTH + 128);
+	if (cmd == NULL || b == NULL) {
+		fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+		buffer_free(b);
+		conn_close(c);
+		return 0;
+	}
+
+	r.opcode = h[1];
+	memcpy(&(r.opaque), h + 12, 4);
+	cmd->flag.is_update_cmd = 1;
+
+	if (binary_getop(h[1]) && extlen == 0 && vallen == 0 && binary_key_ok(key, keylen)) {
+		/* request line is made by start_get_server() */
+		buffer_free(b);
+		cmd->flag.is_update_cmd = 0;
+		if ((len = binary_get_command(c, cmd)) == 0) {
+			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+			conn_close(c);
+			return 0;
+		}
+
+		if (len < c->pos)
+			memmove(c->line, c->line + len, c->pos - len);
+		c->pos -= len;
+
+		start_magent_transcation(cmd);
+		return 1;
+	}
+
+	if (name) {
+		/*
+		 * <cmd> <key> <flags> <exptime> <bytes>\r\n
+		 * cas <key> <flags> <exptime> <bytes> <cas unique>\r\n
 		 */
-		c->keycount = ntokens - KEY_TOKEN - 1;
-		c->keys = (char **) calloc(sizeof(char *), c->keycount);
-		if (c->keys == NULL) {
-			c->keycount = 0;
-			out_string(c, "SERVER_ERROR OUT OF MEMORY");
-			skip = 1;
+		b->size = snprintf(b->ptr, b->len, "%s %.*s %u %u %u", name, (int) keylen, (char *) key,
+				extlen ? binary_get32(ext) : 0, extlen ? binary_get32(ext + 4) : 0, vallen);
+		if (strcmp(name, "cas") == 0) {
+			b->size += snprintf(b->ptr + b->size, b->len - b->size, " %llu", cas);
+			curworker->cmd_cas ++;
 		} else {
-			if (ntokens < MAX_TOKENS) {
-				for (i = KEY_TOKEN, j = 0; (i < ntokens) && (j < c->keycount); i ++, j ++)
-					c->keys[j] = strdup(tokens[i].value);
+			curworker->cmd_set ++;
+		}
+		cmd->flag.is_set_cmd = 1;
+		cmd->storebytes = vallen;
+	} else if ((h[1] == BIN_CMD_DELETE || h[1] == BIN_CMD_DELETEQ) && extlen == 0 && vallen == 0 &&
+			binary_key_ok(key, keylen)) {
+		/* delete <key>\r\n */
+		b->size = snprintf(b->ptr, b->len, "delete %.*s", (int) keylen, (char *) key);
+		cmd->flag.is_delete_cmd = 1;
+		curworker->cmd_delete ++;
+	} else if ((h[1] == BIN_CMD_INCREMENT || h[1] == BIN_CMD_INCREMENTQ || h[1] == BIN_CMD_DECREMENT ||
+			h[1] == BIN_CMD_DECREMENTQ) && extlen == 20 && vallen == 0 && binary_key_ok(key, keylen)) {
+		/* incr/decr <key> <delta>\r\n, initial value and expiration in extras are not proxied */
+		b->size = snprintf(b->ptr, b->len, "%s %.*s %llu", (h[1] == BIN_CMD_INCREMENT ||
+				h[1] == BIN_CMD_INCREMENTQ) ? "incr" : "decr", (int) keylen, (char *) key, binary_get64(ext));
+		cmd->flag.is_incr_decr_cmd = 1;
+		curworker->cmd_incr_decr ++;
+	} else if (h[1] == BIN_CMD_NOOP) {
+		/* end of quiet commands, replied after them */
+		binary_out(cmd, &r, BIN_STATUS_OK, NULL, 0, NULL, 0, 0, 0, NULL);
+		skip = 1;
+	} else if (h[1] == BIN_CMD_VERSION) {
+		binary_string(cmd, &r, BIN_STATUS_OK, VERSION);
+		skip = 1;
+	} else if (h[1] == BIN_CMD_QUIT || h[1] == BIN_CMD_QUITQ) {
+		/* close after replies of previous commands */
+		if (h[1] == BIN_CMD_QUIT)
+			binary_out(cmd, &r, BIN_STATUS_OK, NULL, 0, NULL, 0, 0, 0, NULL);
+		cmd->flag.is_quit = 1;
+		skip = 1;
+	} else if (bad || binary_getop(h[1]) || (h[1] >= BIN_CMD_DELETE && h[1] <= BIN_CMD_DECREMENT) ||
+			(h[1] >= BIN_CMD_DELETEQ && h[1] <= BIN_CMD_DECREMENTQ)) {
+		binary_string(cmd, &r, BIN_STATUS_EINVAL, "Invalid arguments");
+		skip = 1;
+	} else {
+		/* stats, flush, touch, sasl ... */
+		binary_string(cmd, &r, BIN_STATUS_UNKNOWN_COMMAND, "Unknown command");
+		skip = 1;
+	}
+
+	if (skip) {
+		buffer_free(b);
+		curworker->cmd_other ++;
+	} else {
+		memcpy(b->ptr + b->size, "\r\n", 2);
+		b->size += 2;
+		append_buffer_to_list(&cmd->request, b);
+
+		cmd->keycount = cmd->nbin = 1;
+		cmd->keys = (char **) calloc(sizeof(char *), 1);
+		cmd->bin = (struct binreq *) malloc(sizeof(struct binreq));
+		if (cmd->keys == NULL || cmd->bin == NULL || (cmd->keys[0] = strndup((char *) key, keylen)) == NULL) {
+			fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+			conn_close(c);
+			return 0;
+		}
+		cmd->bin[0] = r;
+	}
+
+	/* value of storage command is left for read_data_block() */
+	if ((int) need < c->pos)
+		memmove(c->line, c->line + need, c->pos - need);
+	c->pos -= need;
+
+	if (skip) {
+		finish_transcation(cmd);
+		return 1;
+	}
+
+	return read_data_block(c, cmd);
+}
+
+/* drive machine of client connection */
+/* only GET/GETS commands of client run in parallel, others wait for
+ * previous commands and hold back next ones, a noreply command until its
+ * request is written, so next command of the key follows it on the same
+ * pooled connection
+ * return 1 if next command in line buffer can be started
+ */
+static int
+pipeline_ready(conn *c)
+{
+	command *cmd;
+
+	for (cmd = c->cmds; cmd; cmd = cmd->next) {
+		if (cmd->flag.done) continue;
+		if (cmd->flag.is_get_cmd == 0) return 0;
+
+		/* GET/GETS in flight, NOOP after quiet GETs has no key */
+		if (c->binary)
+			return (c->pos > 1 && (binary_getop((unsigned char) c->line[1]) || c->line[1] == BIN_CMD_NOOP));
+		return (strncmp(c->line, "get ", 4) == 0 || strncmp(c->line, "gets ", 5) == 0);
+	}
+
+	return 1;
+}
+
+/* start commands pipelined in line buffer of client, replies are flushed
+ * in command order after all of them are started
+ * return 0 if ok, return -1 if client closed
+ */
+static int
+process_commands(conn *c, command *ready)
+{
+	c->processing = 1;
+
+	/* data block of command finished */
+	if (ready && (c->binary == 0 || binary_data_end(ready) == 0))
+		start_magent_transcation(ready);
+
+	if (c->detected == 0 && c->pos > 0) {
+		c->detected = 1;
+		c->binary = ((unsigned char) c->line[0] == BIN_REQ_MAGIC);
+	}
+
+	while (c->closed == 0 && c->state == CLIENT_COMMAND && c->ncmds < MAX_PIPELINE && c->pos > 0) {
+		if (pipeline_ready(c) == 0) break;
+		if ((c->binary ? process_binary_command(c) : process_command(c)) == 0) break;
+	}
+
+	c->processing = 0;
+
+	if (c->closed) {
+		/* closed while processing */
+		conn_close(c);
+		return -1;
+	}
+
+	return client_flush(c);
+}
+
+/* drive machine of client connection */
+static void
+drive_client(const int fd, const short which, void *arg)
+{
+	conn *c;
+	command *cmd = NULL;
+	int r, toread;
+	buffer *b = NULL;
+
+	c = (conn *)arg;
+	if (c == NULL) return;
+
+	if (which & EV_READ) {
+		/* read until socket is drained, a short read means nothing left */
+		do {
+			if (c->state == CLIENT_NREAD) {
+				/* we are going to read data block of last command */
+				cmd = c->cmdtail;
+				if (cmd == NULL || cmd->flag.is_set_cmd == 0) {
+					fprintf(stderr, "%s: (%s.%d) WRONG STATE, SHOULD BE SET COMMAND\n", cur_ts_str, __FILE__, __LINE__);
+					conn_close(c);
+					return;
+				}
+
+				/* fill last request buffer, or one buffer for the rest of data block */
+				b = cmd->request.last;
+				if (b == NULL || b->size >= b->len) {
+					b = buffer_init_size(cmd->storebytes + 1);
+					if (b == NULL) {
+						fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
+						conn_close(c);
+						return;
+					}
+					append_buffer_to_list(&cmd->request, b);
+				}
+
+				toread = b->len - b->size;
+				if (toread > cmd->storebytes) toread = cmd->storebytes;
+				r = read(c->cfd, b->ptr + b->size, toread);
 			} else {
-				char *pp, **nn;
+				/* line buffer full, wait for commands in flight */
+				if (c->pos >= BUFFERLEN) break;
+
+				toread = BUFFERLEN - c->pos;
+				r = read(c->cfd, c->line + c->pos, toread);
+			}
+			curworker->syscalls ++;
+
+			if (r <= 0) {
+				if (r == 0 || (errno != EINTR && errno != EAGAIN))
+					conn_close(c);
+				return;
+			}
+			curworker->client_read += r;
+
+			if (c->state == CLIENT_NREAD) {
+				b->size += r;
+				cmd->storebytes -= r;
+				if (cmd->storebytes > 0) continue;
+
+				c->state = CLIENT_COMMAND;
+				if (process_commands(c, cmd) < 0) return;
+			} else {
+				c->pos += r;
+				c->line[c->pos] = '\0';
+				if (process_commands(c, NULL) < 0) return;
+			}
+		} while (r == toread);
+	} else if (which & EV_WRITE) {
+		/* write to client */
+		client_write(c);
+	}
+}
+
+/* setup client connection inside current worker */
+static void
+conn_new(int newfd)
+{
+	conn *c = NULL;
+
+	if (free_conns) {
+		/* reuse closed connection, line buffer is not cleared */
+		c = free_conns;
+		free_conns = c->next;
+		nfree_conns --;
+
+		c->state = CLIENT_COMMAND;
+		c->pos = 0;
+		c->cmds = c->cmdtail = NULL;
+		c->ncmds = 0;
+		c->processing = c->closed = 0;
+		c->detected = c->binary = 0;
+		c->next = NULL;
+	} else {
+		c = (struct conn *) calloc(sizeof(struct conn), 1);
+		if (c != NULL) {
+			c->response = list_init();
+			if (c->response == NULL) {
+				free(c);
+				c = NULL;
+			}
+		}
+	}
+
+	if (c == NULL) {
+		fprintf(stderr, "%s: (%s.%d) OUT OF MEMORY FOR NEW CONNECTION\n", cur_ts_str, __FILE__, __LINE__);
+		close(newfd);
+		__sync_sub_and_fetch(&curconns, 1);
+		return;
+	}
+	c->cfd = newfd;
+
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) NEW CLIENT FD %d\n", cur_ts_str, __FILE__, __LINE__, c->cfd);
+
+	set_nonblock(c->cfd);
+
+	/* setup client event handler */
+	event_assign(&(c->ev), curworker->base, c->cfd, EV_READ|EV_PERSIST, drive_client, (void *) c);
+	event_assign(&(c->wev), curworker->base, c->cfd, EV_WRITE|EV_PERSIST, drive_client, (void *) c);
+	c->ev_flags = 0;
+	client_set_event(c);
+}
+
+static void
+server_accept(const int fd, const short which, void *arg)
+{
+	int newfd;
+	struct sockaddr_in s_in;
+	socklen_t len = sizeof(s_in);
+	struct worker *w;
+
+	UNUSED(arg);
+	UNUSED(which);
+
+	memset(&s_in, 0, len);
+	newfd = accept(fd, (struct sockaddr *) &s_in, &len);
+	if (newfd < 0) {
+		fprintf(stderr, "%s: (%s.%d) ACCEPT() FAILED\n", cur_ts_str, __FILE__, __LINE__);
+		return ;
+	}
+
+	if (curconns >= maxconns) {
+		/* out of connections */
+		rejectconns ++;
+		write(newfd, OUTOFCONN, sizeof(OUTOFCONN));
+		close(newfd);
+		return;
+	}
+
+	__sync_add_and_fetch(&curconns, 1);
+	totalconns ++;
+
+	if (nthreads == 1) {
+		conn_new(newfd);
+		return;
+	}
+
+	/* round robin hand off to worker threads */
+	w = workers + nextworker;
+	nextworker = (nextworker + 1) % nthreads;
+	if (write(w->notify[1], &newfd, sizeof(newfd)) != sizeof(newfd)) {
+		fprintf(stderr, "%s: (%s.%d) CAN'T HAND OFF FD %d TO WORKER\n", cur_ts_str, __FILE__, __LINE__, newfd);
+		close(newfd);
+		__sync_sub_and_fetch(&curconns, 1);
+	}
+}
+
+/* add memcached server "ip:port[:weight]" to list ms of cnt servers
+ * return 0 if ok, return 1 if out of memory
+ */
+static int
+add_server(struct matrix **ms, int *cnt, char *spec)
+{
+	struct matrix *m;
+	char *p;
+
+	m = (struct matrix *) realloc(*ms, sizeof(struct matrix) * (*cnt + 1));
+	if (m == NULL) return 1;
+	*ms = m;
+	m += *cnt;
+	memset(m, 0, sizeof(struct matrix));
+
+	p = strchr(spec, ':');
+	if (p == NULL) {
+		m->ip = strdup(spec);
+		m->port = 11211;
+	} else {
+		*p = '\0';
+		m->ip = strdup(spec);
+		*p = ':';
+		p ++;
+		m->port = atoi(p);
+		if (m->port <= 0) m->port = 11211;
+		p = strchr(p, ':');
+		if (p) m->weight = atoi(p + 1);
+	}
+	if (m->weight <= 0) m->weight = 100;
+	if (m->ip == NULL) return 1;
+
+	m->dstaddr.sin_family = AF_INET;
+	m->dstaddr.sin_addr.s_addr = inet_addr(m->ip);
+	m->dstaddr.sin_port = htons(m->port);
+
+	(*cnt) ++;
+	return 0;
+}
+
+/* key distribution over cnt servers, NULL if failed */
+static struct ketama *
+new_ketama(struct matrix *ms, int cnt)
+{
+	struct ketama *kt;
+	char temp[65];
+	int i;
+
+	kt = (struct ketama *)calloc(sizeof(struct ketama), 1);
+	if (kt == NULL) return NULL;
+
+	kt->count = cnt;
+	kt->hash = hashfunc;
+	kt->engine = engine;
+	kt->weight = (int *)calloc(sizeof(int), cnt);
+	kt->name = (char **)calloc(sizeof(char *), cnt);
+	if (kt->weight == NULL || kt->name == NULL) {
+		free_ketama(kt);
+		return NULL;
+	}
+
+	for (i = 0; i < cnt; i ++) {
+		kt->weight[i] = ms[i].weight;
+		kt->totalweight += kt->weight[i];
+		snprintf(temp, 64, "%s-%d", ms[i].ip, ms[i].port);
+		kt->name[i] = strdup(temp);
+		if (kt->name[i] == NULL) {
+			free_ketama(kt);
+			return NULL;
+		}
+	}
+
+	if (create_ketama(kt, vnodes)) {
+		free_ketama(kt);
+		return NULL;
+	}
+
+	return kt;
+}
+
+/* return 1 if servers don't have the same weight */
+static int
+weights_differ(struct matrix *ms, int cnt)
+{
+	int i;
+
+	for (i = 1; i < cnt; i ++)
+		if (ms[i].weight != ms[0].weight) return 1;
+
+	return 0;
+}
+
+/* ketama rings of cluster servers
+ * return 0 if ok, return 1 if failed
+ */
+static int
+build_cluster(struct cluster *cl)
+{
+	if (use_ketama == 0) return 0;
+
+	/* jump gives each server the same share, weights would be ignored */
+	if (engine == KETAMA_ENGINE_JUMP && (weights_differ(cl->matrixs, cl->matrixcnt) || weights_differ(cl->backups, cl->backupcnt))) {
+		fprintf(stderr, "%s: (%s.%d) -d jump CAN'T WEIGHT SERVERS, USE THE SAME WEIGHT FOR ALL OR ANOTHER -d\n", cur_ts_str, __FILE__, __LINE__);
+		return 1;
+	}
+
+	cl->ketama = new_ketama(cl->matrixs, cl->matrixcnt);
+	if (cl->ketama == NULL) return 1;
+
+	if (cl->backupcnt > 0) {
+		cl->backupkt = new_ketama(cl->backups, cl->backupcnt);
+		if (cl->backupkt == NULL) return 1;
+	}
+
+	return 0;
+}
+
+static void
+free_cluster(struct cluster *cl)
+{
+	int i;
+
+	if (cl == NULL) return;
+
+	free_ketama(cl->ketama);
+	free_ketama(cl->backupkt);
+
+	for (i = 0; i < cl->matrixcnt; i ++)
+		free(cl->matrixs[i].ip);
+	for (i = 0; i < cl->backupcnt; i ++)
+		free(cl->backups[i].ip);
+
+	free(cl->matrixs);
+	free(cl->backups);
+	free(cl);
+}
+
+/* newest cluster, held until cluster_release() */
+static struct cluster *
+cluster_get(void)
+{
+	struct cluster *cl;
+
+	pthread_mutex_lock(&cluster_lock);
+	cl = cluster;
+	cl->refs ++;
+	pthread_mutex_unlock(&cluster_lock);
+
+	return cl;
+}
+
+static void
+cluster_release(struct cluster *cl)
+{
+	int refs;
+
+	pthread_mutex_lock(&cluster_lock);
+	refs = -- cl->refs;
+	pthread_mutex_unlock(&cluster_lock);
+
+	if (refs == 0)
+		free_cluster(cl);
+}
+
+/* servers of config file, one on each line:
+ *   server ip:port[:weight]
+ *   backup ip:port[:weight]
+ * empty lines and lines starting with # are skipped
+ * return NULL if failed
+ */
+static struct cluster *
+read_conffile(const char *path)
+{
+	struct cluster *cl;
+	char line[256], *p, *spec;
+	int r = 0, lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: (%s.%d) CAN'T OPEN %s: %s\n", cur_ts_str, __FILE__, __LINE__, path, strerror(errno));
+		return NULL;
+	}
+
+	cl = (struct cluster *) calloc(sizeof(struct cluster), 1);
+	if (cl == NULL) {
+		fclose(fp);
+		return NULL;
+	}
+
+	while (r == 0 && fgets(line, sizeof(line), fp)) {
+		lineno ++;
+		p = strtok(line, " \t\r\n");
+		if (p == NULL || *p == '#') continue;
+
+		spec = strtok(NULL, " \t\r\n");
+		if (spec && strcmp(p, "server") == 0) {
+			r = add_server(&(cl->matrixs), &(cl->matrixcnt), spec);
+		} else if (spec && strcmp(p, "backup") == 0) {
+			r = add_server(&(cl->backups), &(cl->backupcnt), spec);
+		} else {
+			fprintf(stderr, "%s: (%s.%d) %s LINE %d: UNKNOWN \"%s\"\n", cur_ts_str, __FILE__, __LINE__, path, lineno, p);
+			r = 1;
+		}
+	}
+	fclose(fp);
+
+	if (r == 0 && cl->matrixcnt == 0) {
+		fprintf(stderr, "%s: (%s.%d) NO SERVER IN %s\n", cur_ts_str, __FILE__, __LINE__, path);
+		r = 1;
+	}
+
+	if (r) {
+		free_cluster(cl);
+		return NULL;
+	}
+
+	return cl;
+}
+
+/* private copy of server, owning its pools */
+static struct matrix *
+matrix_new(struct matrix *src)
+{
+	struct matrix *m;
+
+	m = (struct matrix *) calloc(sizeof(struct matrix), 1);
+	if (m == NULL) return NULL;
+
+	m->ip = strdup(src->ip);
+	if (m->ip == NULL) {
+		free(m);
+		return NULL;
+	}
+	m->port = src->port;
+	m->weight = src->weight;
+	m->dstaddr = src->dstaddr;
+	m->idx = -1; /* not in a worker yet */
+
+	return m;
+}
+
+/* index of server with the address of m in ms, -1 if not found */
+static int
+matrix_find(struct matrix **ms, int cnt, struct matrix *m)
+{
+	int i;
+
+	for (i = 0; i < cnt; i ++) {
+		if (ms[i] && ms[i]->port == m->port && strcmp(ms[i]->ip, m->ip) == 0)
+			return i;
+	}
+
+	return -1;
+}
 
-				for (i = KEY_TOKEN, j = 0; (i < (MAX_TOKENS-1)) && (j < c->keycount); i ++, j ++)
-					c->keys[j] = strdup(tokens[i].value);
+/* server removed by reload, idle connections are closed now, busy ones when done */
+static void
+matrix_drain(struct matrix *m)
+{
+	struct server *s;
+	int i;
 
-				if (tokens[MAX_TOKENS-1].value != NULL) {
-					/* check for last TOKEN */
-					pp = strtok(tokens[MAX_TOKENS-1].value, " ");
+	m->idx = -1;
+	m->conns ++; /* not freed while closing */
 
-					while(pp != NULL) {
-						nn = (char **)realloc(c->keys, (c->keycount + 1)* sizeof(char *));
-						if (nn == NULL) {
-							/* out of memory */
-							break;
-						}
-						c->keys = nn;
-						c->keys[c->keycount] = strdup(pp);
-						c->keycount ++;
-						pp = strtok(NULL, " ");
-					}
-				} else {
-					/* last key is NULL, set keycount to actual number*/
-					c->keycount = j;
-				}
-			}
+	for (i = 0; i < m->used; i ++)
+		server_free(m->pool[i]);
+	m->used = 0;
+
+	for (i = 0; m->mux && i < muxconns; i ++) {
+		s = m->mux[i];
+		if (s && s->qhead == NULL && s->request->first == NULL)
+			server_close(s);
+	}
+
+	m->conns --;
+	matrix_put(m);
+}
+
+/* worker w routes keys with cl from now on, keeping pools of servers in both,
+ * takes the reference of cl
+ * return 0 if ok, return 1 if failed
+ */
+static int
+worker_switch(struct worker *w, struct cluster *cl)
+{
+	struct cluster *old = w->cl;
+	struct matrix **ms, **bs, **oldms, **oldbs;
+	struct hotkeys *hk, *oldhk;
+	struct latency *lat, *oldlat;
+	struct srvstat *st, *oldst;
+	int i, j, oldcnt, oldbcnt;
+
+	oldcnt = old ? old->matrixcnt : 0;
+	oldbcnt = old ? old->backupcnt : 0;
+
+	ms = (struct matrix **) calloc(sizeof(struct matrix *), cl->matrixcnt);
+	bs = (struct matrix **) calloc(sizeof(struct matrix *), cl->backupcnt + 1);
+	hk = (struct hotkeys *) calloc(sizeof(struct hotkeys), cl->matrixcnt);
+	lat = (struct latency *) calloc(sizeof(struct latency), cl->matrixcnt);
+	st = (struct srvstat *) calloc(sizeof(struct srvstat), cl->matrixcnt);
+	for (i = 0; ms && i < cl->matrixcnt; i ++) {
+		if ((ms[i] = matrix_new(cl->matrixs + i)) == NULL) break;
+	}
+	for (j = 0; bs && j < cl->backupcnt; j ++) {
+		if ((bs[j] = matrix_new(cl->backups + j)) == NULL) break;
+	}
 
-			c->flag.is_get_cmd = 1;
-			c->keyidx = 0;
-			c->flag.is_update_cmd = 0;
+	if (ms == NULL || bs == NULL || hk == NULL || lat == NULL || st == NULL || i < cl->matrixcnt || j < cl->backupcnt) {
+		for (i = 0; ms && i < cl->matrixcnt; i ++)
+			matrix_put(ms[i]);
+		for (j = 0; bs && j < cl->backupcnt; j ++)
+			matrix_put(bs[j]);
+		free(ms);
+		free(bs);
+		free(hk);
+		free(lat);
+		free(st);
+		cluster_release(cl);
+		return 1;
+	}
 
-			if (strcmp(tokens[COMMAND_TOKEN].value, "gets") == 0)
-				c->flag.is_gets_cmd = 1; /* GETS */
+	/* unchanged servers keep their connections, heavy hitters, latencies and counters */
+	for (i = 0; i < cl->matrixcnt; i ++) {
+		j = matrix_find(w->matrixs, oldcnt, ms[i]);
+		if (j >= 0) {
+			matrix_put(ms[i]);
+			ms[i] = w->matrixs[j];
+			ms[i]->weight = cl->matrixs[i].weight;
+			w->matrixs[j] = NULL;
+			memcpy(hk + i, w->hotkeys + j, sizeof(struct hotkeys));
+			memcpy(lat + i, w->latency + j, sizeof(struct latency));
+			memcpy(st + i, w->srvstats + j, sizeof(struct srvstat));
 		}
-	} else if ((ntokens == 4 || ntokens == 5) && (
-				(strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0) ||
-				(strcmp(tokens[COMMAND_TOKEN].value, "incr") == 0)
-				)) {
-		/*
-		 * incr <key> <value> [noreply]\r\n
-		 * decr <key> <value> [noreply]\r\n
-		 *
-		 * "NOT_FOUND\r\n" to indicate the item with this value was not found 
-		 * <value>\r\n , where <value> is the new value of the item's data,
-		 */
-		c->flag.is_incr_decr_cmd = 1;
-	} else if (ntokens >= 3 && ntokens <= 5 && (strcmp(tokens[COMMAND_TOKEN].value, "delete") == 0)) {
-		/*
-		 * delete <key> [<time>] [noreply]\r\n
-		 *
-		 * "DELETED\r\n" to indicate success 
-		 * "NOT_FOUND\r\n" to indicate that the item with this key was not
-		 */
-	} else if ((ntokens == 7 || ntokens == 8) && 
-			(strcmp(tokens[COMMAND_TOKEN].value, "cas") == 0)) {
-		/*
-		 * cas <key> <flags> <exptime> <bytes> <cas unqiue> [noreply]\r\n
-		 * <data block>\r\n
-		 *
-		 * "STORED\r\n", to indicate success.  
-		 * "NOT_STORED\r\n" to indicate the data was not stored, but not
-		 * "EXISTS\r\n" to indicate that the item you are trying to store with
-		 * "NOT_FOUND\r\n" to indicate that the item you are trying to store
-		 */
-		c->flag.is_set_cmd = 1;
-		c->storebytes = atol(tokens[BYTES_TOKEN].value);
-		c->storebytes += 2; /* \r\n */
-	} else if ((ntokens == 6 || ntokens == 7) && (
-			(strcmp(tokens[COMMAND_TOKEN].value, "add") == 0) ||
-			(strcmp(tokens[COMMAND_TOKEN].value, "set") == 0) ||
-			(strcmp(tokens[COMMAND_TOKEN].value, "replace") == 0) ||
-			(strcmp(tokens[COMMAND_TOKEN].value, "prepend") == 0) ||
-			(strcmp(tokens[COMMAND_TOKEN].value, "append") == 0)
-			)) {
-		/*
-		 * <cmd> <key> <flags> <exptime> <bytes> [noreply]\r\n
-		 * <data block>\r\n
-		 *
-		 * "STORED\r\n", to indicate success.  
-		 * "NOT_STORED\r\n" to indicate the data was not stored, but not
-		 * "EXISTS\r\n" to indicate that the item you are trying to store with
-		 * "NOT_FOUND\r\n" to indicate that the item you are trying to store
-		 */
-		c->flag.is_set_cmd = 1;
-		c->storebytes = atol(tokens[BYTES_TOKEN].value);
-		c->storebytes += 2; /* \r\n */
-	} else if (ntokens >= 2 && (strcmp(tokens[COMMAND_TOKEN].value, "stats") == 0)) {
-		/* END\r\n
-		 */
-		char tmp[128];
-		out_string(c, "memcached agent v" VERSION);
-		for (i = 0; i < matrixcnt; i ++) {
-			snprintf(tmp, 127, "matrix %d -> %s:%d, pool size %d", 
-					i+1, matrixs[i].ip, matrixs[i].port, matrixs[i].used);
-			out_string(c, tmp);
+		ms[i]->idx = i;
+		ms[i]->conf = cl->matrixs + i;
+	}
+
+	for (i = 0; i < cl->backupcnt; i ++) {
+		j = matrix_find(w->backups, oldbcnt, bs[i]);
+		if (j >= 0) {
+			matrix_put(bs[i]);
+			bs[i] = w->backups[j];
+			bs[i]->weight = cl->backups[i].weight;
+			w->backups[j] = NULL;
 		}
-		out_string(c, "END");
-		skip = 1;
-	} else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "quit") == 0)) {
-		buffer_free(b);
-		conn_close(c);
+		bs[i]->idx = i;
+		bs[i]->conf = cl->backups + i;
+	}
+
+	pthread_mutex_lock(&(w->hotlock));
+	oldhk = w->hotkeys;
+	oldlat = w->latency;
+	oldst = w->srvstats;
+	oldms = w->matrixs;
+	oldbs = w->backups;
+	w->hotkeys = hk;
+	w->latency = lat;
+	w->srvstats = st;
+	w->matrixs = ms;
+	w->backups = bs;
+	w->cl = cl;
+	pthread_mutex_unlock(&(w->hotlock));
+	free(oldhk);
+	free(oldlat);
+	free(oldst);
+
+	for (i = 0; i < oldcnt; i ++) {
+		if (oldms[i]) matrix_drain(oldms[i]);
+	}
+	for (i = 0; i < oldbcnt; i ++) {
+		if (oldbs[i]) matrix_drain(oldbs[i]);
+	}
+
+	free(oldms);
+	free(oldbs);
+
+	if (old) cluster_release(old);
+	return 0;
+}
+
+/* ------------- health of memcached servers, see -E ------------- */
+
+/* keys of ejected server m go to the next one, see -R */
+static void
+reroute_server(struct cluster *cl, struct matrix *m)
+{
+	struct ketama *kt;
+
+	if (reroute == 0) return;
+
+	if (m >= cl->matrixs && m < cl->matrixs + cl->matrixcnt) {
+		kt = cl->ketama;
+		if (kt) kt->down[m - cl->matrixs] = m->down;
+	} else {
+		kt = cl->backupkt;
+		if (kt) kt->down[m - cl->backups] = m->down;
+	}
+}
+
+/* count result of a connection or probe to server m of cluster cl,
+ * eject it after eject_fails failures in a row, rejoin it when it works again
+ */
+static void
+server_health(struct cluster *cl, struct matrix *m, int ok)
+{
+	int fails;
+
+	if (eject_fails == 0) return;
+
+	if (ok) {
+		if (m->fails) m->fails = 0;
+		if (m->down == 0 || !__sync_bool_compare_and_swap(&(m->down), 1, 0)) return;
+		fprintf(stderr, "%s: (%s.%d) SERVER %s:%d REJOINED\n", cur_ts_str, __FILE__, __LINE__, m->ip, m->port);
+	} else {
+		fails = __sync_add_and_fetch(&(m->fails), 1);
+		if (fails < eject_fails || m->down || !__sync_bool_compare_and_swap(&(m->down), 0, 1)) return;
+		fprintf(stderr, "%s: (%s.%d) SERVER %s:%d EJECTED AFTER %d FAILURES\n", cur_ts_str, __FILE__, __LINE__, m->ip, m->port, fails);
+	}
+
+	reroute_server(cl, m);
+}
+
+/* result of connection s in worker */
+static void
+server_result(struct server *s, int ok)
+{
+	if (s->owner && s->owner->idx >= 0)
+		server_health(curworker->cl, s->owner->conf, ok);
+}
+
+/* health of servers still in list survives reload */
+static void
+copy_health(struct cluster *to, struct cluster *from)
+{
+	struct matrix *m, *o;
+	int i, j;
+
+	for (i = 0; i < to->matrixcnt + to->backupcnt; i ++) {
+		m = (i < to->matrixcnt) ? to->matrixs + i : to->backups + i - to->matrixcnt;
+		for (j = 0; j < from->matrixcnt + from->backupcnt; j ++) {
+			o = (j < from->matrixcnt) ? from->matrixs + j : from->backups + j - from->matrixcnt;
+			if ((i < to->matrixcnt) != (j < from->matrixcnt) || o->port != m->port || strcmp(o->ip, m->ip)) continue;
+
+			m->fails = o->fails;
+			m->down = o->down;
+			reroute_server(to, m);
+			break;
+		}
+	}
+}
+
+static void
+probe_done(struct probe *p, int ok)
+{
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) PROBE %s:%d %s\n", cur_ts_str, __FILE__, __LINE__, p->m->ip, p->m->port, ok ? "OK" : "FAILED");
+
+	event_del(&(p->ev));
+	close(p->fd);
+	p->m->probing = 0;
+	server_health(p->cl, p->m, ok);
+	cluster_release(p->cl);
+	free(p);
+}
+
+/* connected, then "version" written, then "VERSION ..." read, each in HEALTH_TIMEOUT */
+static void
+probe_handler(const int fd, const short which, void *arg)
+{
+	struct probe *p = (struct probe *) arg;
+	struct timeval tv;
+	socklen_t len;
+	int r, err;
+
+	if (which & EV_TIMEOUT) {
+		probe_done(p, 0);
 		return;
-	} else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "version") == 0)) {
-		out_string(c, "VERSION memcached agent v" VERSION);
-		skip = 1;
+	}
+
+	if (p->sent == 0) {
+		len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err ||
+				write(fd, "version\r\n", 9) != 9) {
+			probe_done(p, 0);
+			return;
+		}
+		p->sent = 1;
+		event_assign(&(p->ev), main_base, fd, EV_READ, probe_handler, (void *) p);
 	} else {
-		out_string(c, "UNSUPPORTED COMMAND");
-		skip = 1;
+		r = read(fd, p->buf + p->pos, sizeof(p->buf) - 1 - p->pos);
+		if (r < 0 && (errno == EAGAIN || errno == EINTR)) r = 0;
+		else if (r <= 0) {
+			probe_done(p, 0);
+			return;
+		}
+		p->pos += r;
+		p->buf[p->pos] = '\0';
+		if (strstr(p->buf, "\r\n") || p->pos == sizeof(p->buf) - 1) {
+			probe_done(p, strncmp(p->buf, "VERSION ", 8) == 0);
+			return;
+		}
 	}
 
-	/* finish process commands */
-	if (skip == 0) {
-		/* append buffer to list */
-		append_buffer_to_list(c->request, b);
+	tv.tv_sec = HEALTH_TIMEOUT; tv.tv_usec = 0;
+	event_add(&(p->ev), &tv);
+}
+
+/* check server m of cluster cl in main loop */
+static void
+start_probe(struct cluster *cl, struct matrix *m)
+{
+	struct probe *p;
+	struct timeval tv;
+	int fd;
+
+	if (m->probing) return;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) return;
+	set_nonblock(fd);
+
+	if (connect(fd, (struct sockaddr *) &(m->dstaddr), sizeof(m->dstaddr)) && errno != EINPROGRESS) {
+		close(fd);
+		server_health(cl, m, 0);
+		return;
+	}
+
+	p = (struct probe *) calloc(sizeof(struct probe), 1);
+	if (p == NULL) {
+		close(fd);
+		return;
+	}
+
+	p->fd = fd;
+	p->m = m;
+	p->cl = cl;
+	m->probing = 1;
+
+	pthread_mutex_lock(&cluster_lock);
+	cl->refs ++;
+	pthread_mutex_unlock(&cluster_lock);
+
+	event_assign(&(p->ev), main_base, fd, EV_WRITE, probe_handler, (void *) p);
+	tv.tv_sec = HEALTH_TIMEOUT; tv.tv_usec = 0;
+	event_add(&(p->ev), &tv);
+}
+
+/* probe all servers, ejected ones rejoin when probes work again */
+static void
+probe_servers(void)
+{
+	struct cluster *cl;
+	int i;
+
+	if (eject_fails == 0 || cur_ts % HEALTH_INTERVAL) return;
+
+	cl = cluster_get();
+	for (i = 0; i < cl->matrixcnt; i ++)
+		start_probe(cl, cl->matrixs + i);
+	for (i = 0; i < cl->backupcnt; i ++)
+		start_probe(cl, cl->backups + i);
+	cluster_release(cl);
+}
+
+/* switch current worker to the newest servers */
+static void
+worker_reload(void)
+{
+	struct cluster *cl = cluster_get();
+
+	if (worker_switch(curworker, cl)) {
+		fprintf(stderr, "%s: (%s.%d) OUT OF MEMORY, KEEP OLD SERVERS\n", cur_ts_str, __FILE__, __LINE__);
+		return;
+	}
+
+	if (verbose_mode)
+		fprintf(stderr, "%s: (%s.%d) WORKER SWITCHED TO %d SERVERS, %d BACKUP SERVERS\n",
+				cur_ts_str, __FILE__, __LINE__, cl->matrixcnt, cl->backupcnt);
+}
+
+/* SIGHUP, read servers again, workers switch to them in their own loops */
+static void
+reload_servers(const int fd, const short which, void *arg)
+{
+	struct cluster *cl, *old;
+	int i, reload = -1;
+
+	UNUSED(fd);
+	UNUSED(which);
+	UNUSED(arg);
+
+	cl = read_conffile(conffile);
+	if (cl == NULL || build_cluster(cl)) {
+		fprintf(stderr, "%s: (%s.%d) CAN'T RELOAD %s, KEEP OLD SERVERS\n", cur_ts_str, __FILE__, __LINE__, conffile);
+		free_cluster(cl);
+		return;
+	}
+	cl->refs = 1;
+	copy_health(cl, cluster);
+
+	pthread_mutex_lock(&cluster_lock);
+	old = cluster;
+	cluster = cl;
+	pthread_mutex_unlock(&cluster_lock);
+	cluster_release(old);
+
+	fprintf(stderr, "%s: (%s.%d) RELOADED %d SERVERS, %d BACKUP SERVERS FROM %s\n",
+			cur_ts_str, __FILE__, __LINE__, cl->matrixcnt, cl->backupcnt, conffile);
+
+	if (nthreads == 1) {
+		worker_reload();
+		return;
+	}
+
+	/* -1 instead of client fd */
+	for (i = 0; i < nthreads; i ++) {
+		if (write(workers[i].notify[1], &reload, sizeof(reload)) != sizeof(reload))
+			fprintf(stderr, "%s: (%s.%d) CAN'T NOTIFY WORKER %d OF RELOAD\n", cur_ts_str, __FILE__, __LINE__, i);
+	}
+}
+
+/* new client fds from accept thread, -1 if servers are reloaded */
+static void
+worker_notify_handler(const int fd, const short which, void *arg)
+{
+	int newfd;
+
+	UNUSED(arg);
+
+	if (!(which & EV_READ)) return;
+
+	while (read(fd, &newfd, sizeof(newfd)) == sizeof(newfd)) {
+		if (newfd == -2)
+			event_base_loopbreak(curworker->base); /* exiting, see server_exit() */
+		else if (newfd < 0)
+			worker_reload();
+		else
+			conn_new(newfd);
+	}
+}
+
+static void *
+worker_main(void *arg)
+{
+	curworker = (struct worker *)arg;
+	event_base_dispatch(curworker->base);
+	return NULL;
+}
+
+/* changes of events on one fd are merged into one epoll_ctl() per loop */
+static struct event_base *
+new_event_base(void)
+{
+	struct event_config *cfg;
+	struct event_base *base;
+
+	cfg = event_config_new();
+	if (cfg == NULL) return NULL;
+
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_EPOLL_USE_CHANGELIST);
+	base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+
+	return base;
+}
+
+/* writing with io_uring if -U, fall back to writev() */
+static void
+start_uring(struct worker *w)
+{
+	if (use_uring == 0) return;
+
+#ifdef HAVE_IO_URING
+	w->ring = uring_init();
+	if (w->ring == NULL)
+		fprintf(stderr, "%s: (%s.%d) IO_URING UNAVAILABLE, USE WRITEV\n", cur_ts_str, __FILE__, __LINE__);
+#else
+	UNUSED(w);
+	fprintf(stderr, "%s: (%s.%d) IO_URING NOT SUPPORTED, USE WRITEV\n", cur_ts_str, __FILE__, __LINE__);
+	use_uring = 0;
+#endif
+}
+
+/* fire deadlines of slots passed since last tick */
+static void
+wheel_handler(const int fd, const short which, void *arg)
+{
+	struct worker *w = (struct worker *) arg;
+	struct wtimer list, *h, *t;
+	struct timeval tv;
+	unsigned long long now = wheel_now();
+	int n;
+
+	UNUSED(fd);
+	UNUSED(which);
+
+	/* all slots were passed if late by a whole round */
+	for (n = 0; w->wtick < now && n < WHEEL_SLOTS; n ++) {
+		w->wtick ++;
+		h = w->wheel + (w->wtick & (WHEEL_SLOTS - 1));
+		if (h->next == h) continue;
+
+		/* move slot away, fired timers may add to it again */
+		list.next = h->next;
+		list.prev = h->prev;
+		list.next->prev = list.prev->next = &list;
+		h->next = h->prev = h;
+
+		while ((t = list.next) != &list) {
+			list.next = t->next;
+			t->next->prev = &list;
+			t->prev = t->next = NULL;
+
+			if (t->expire > now) {
+				/* a later round, back into its slot */
+				t->next = h;
+				t->prev = h->prev;
+				h->prev->next = t;
+				h->prev = t;
+				continue;
+			}
+
+			w->wcount --;
+			t->fire(t->arg);
+		}
+	}
+	if (w->wtick < now) w->wtick = now;
+
+	if (w->wcount > 0) {
+		tv.tv_sec = 0;
+		tv.tv_usec = WHEEL_TICK * 1000;
+		evtimer_add(&(w->wheel_ev), &tv);
+	}
+}
+
+/* timing wheel of worker if -T
+ * return 0 if ok, return 1 if failed
+ */
+static int
+start_wheel(struct worker *w)
+{
+	int i;
+
+	if (connect_timeout == 0 && write_timeout == 0 && read_timeout == 0 && total_timeout == 0)
+		return 0;
+
+	w->wheel = (struct wtimer *) calloc(sizeof(struct wtimer), WHEEL_SLOTS);
+	if (w->wheel == NULL) return 1;
+
+	for (i = 0; i < WHEEL_SLOTS; i ++)
+		w->wheel[i].prev = w->wheel[i].next = w->wheel + i;
+
+	evtimer_assign(&(w->wheel_ev), w->base, wheel_handler, (void *) w);
+	return 0;
+}
+
+/* return 0 if ok, return 1 if failed */
+static int
+start_workers(void)
+{
+	struct worker *w;
+	int i;
+
+	workers = (struct worker *) calloc(sizeof(struct worker), nthreads);
+	if (workers == NULL) return 1;
+
+	for (i = 0; coalesce && i < nthreads; i ++) {
+		workers[i].pendings = (struct pending **) calloc(sizeof(struct pending *), PENDING_BUCKETS);
+		if (workers[i].pendings == NULL) return 1;
+	}
 
-		if (c->flag.is_get_cmd == 0) {
-			if (tokens[ntokens-2].value && strcmp(tokens[ntokens-2].value, "noreply") == 0)
-				c->flag.no_reply = 1;
-			c->keycount = 1;
-			c->keys = (char **) calloc(sizeof(char *), 1);
-			if (c->keys == NULL) {
-				fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-				conn_close(c);
-				return;
-			}
-			c->keys[0] = strdup(tokens[KEY_TOKEN].value);
-		}
-	} else {
-		buffer_free(b);
+	for (i = 0; i < nthreads; i ++) {
+		pthread_mutex_init(&(workers[i].hotlock), NULL);
+		workers[i].hotrand = 2463534242U + i;
 	}
 
-	i = p - c->line + 1;
-	if (i < c->pos) {
-		memmove(c->line, p+1, c->pos - i);
-		c->pos -= i;
-	} else {
-		c->pos = 0;
+	main_base = new_event_base();
+	if (main_base == NULL) return 1;
+
+	if (nthreads == 1) {
+		/* main loop is the only worker */
+		w = workers;
+		w->tid = pthread_self();
+		w->base = main_base;
+		if (worker_switch(w, cluster_get())) return 1;
+		event_assign(&(w->flush_ev), w->base, -1, 0, flush_servers, (void *) w);
+		start_uring(w);
+		if (start_wheel(w)) return 1;
+		curworker = w;
+		return 0;
 	}
 
-	if (c->storebytes > 0) {
-		if (c->pos > 0) {
-			/* append more buffer to list */
-			b = buffer_init_size(c->pos + 1);
-			if (b == NULL) {
-				fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-				conn_close(c);
-				return;
-			}
-			memcpy(b->ptr, c->line, c->pos);
-			b->size = c->pos;
-			c->storebytes -= b->size;
-			append_buffer_to_list(c->request, b);
-			c->pos = 0;
-		}
-		if (c->storebytes > 0)
-			c->state = CLIENT_NREAD;
-		else
-			start_magent_transcation(c);
-	} else {
-		if (skip == 0)
-			start_magent_transcation(c);
+	for (i = 0; i < nthreads; i ++) {
+		w = workers + i;
+		w->base = new_event_base();
+		if (w->base == NULL || worker_switch(w, cluster_get()))
+			return 1;
+
+		if (pipe(w->notify)) return 1;
+		fcntl(w->notify[0], F_SETFL, fcntl(w->notify[0], F_GETFL)|O_NONBLOCK);
+
+		event_assign(&(w->notify_ev), w->base, w->notify[0], EV_READ|EV_PERSIST, worker_notify_handler, (void *) w);
+		event_add(&(w->notify_ev), 0);
+		event_assign(&(w->flush_ev), w->base, -1, 0, flush_servers, (void *) w);
+		start_uring(w);
+		if (start_wheel(w)) return 1;
+
+		if (pthread_create(&(w->tid), NULL, worker_main, (void *) w))
+			return 1;
 	}
+
+	return 0;
 }
 
-/* drive machine of client connection */
-static void
-drive_client(const int fd, const short which, void *arg)
+/* ------------- admin http port with metrics in Prometheus text format, see -a ------------- */
+
+/* text of metrics, grown as needed, ptr is NULL if out of memory */
+struct page
 {
-	conn *c;
-	int r, toread;
-	buffer *b;
+	char *ptr;
+	size_t size;
+	size_t len;
+};
 
-	c = (conn *)arg;
-	if (c == NULL) return;
+static void
+page_printf(struct page *p, const char *fmt, ...)
+{
+	va_list ap;
+	char *np;
+	int n;
+
+	while (p->ptr) {
+		va_start(ap, fmt);
+		n = vsnprintf(p->ptr + p->size, p->len - p->size, fmt, ap);
+		va_end(ap);
+		if (n < 0) return;
+
+		if (p->size + n < p->len) {
+			p->size += n;
+			return;
+		}
 
-	if (which & EV_READ) {
-		/* get the byte counts of read */
-		if (ioctl(c->cfd, FIONREAD, &toread) || toread == 0) {
-			conn_close(c);
+		np = (char *) realloc(p->ptr, p->len * 2 + n);
+		if (np == NULL) {
+			free(p->ptr);
+			p->ptr = NULL;
 			return;
 		}
+		p->ptr = np;
+		p->len = p->len * 2 + n;
+	}
+}
 
-		switch(c->state) {
-		case CLIENT_TRANSCATION:
-		case CLIENT_COMMAND:
-			r = BUFFERLEN - c->pos;
-			if (r > toread) r = toread;
+static void
+page_metric(struct page *p, const char *name, const char *type, const char *help)
+{
+	page_printf(p, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
 
-			toread = read(c->cfd, c->line + c->pos, r);
-			if ((toread <= 0) && (errno != EINTR && errno != EAGAIN))  {
-				conn_close(c);
-				return;
-			}
-			c->pos += toread;
-			c->line[c->pos] = '\0';
-			process_command(c);
-			break;
-		case CLIENT_NREAD:
-			/* we are going to read */
-			if (c->flag.is_set_cmd == 0) {
-				fprintf(stderr, "%s: (%s.%d) WRONG STATE, SHOULD BE SET COMMAND\n", cur_ts_str, __FILE__, __LINE__);
-				conn_close(c);
-				return;
-			}
+/* upper bounds of histogram buckets in seconds */
+static const double metric_bounds[] = {
+	0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
 
-			if (toread > c->storebytes) toread = c->storebytes;
+/* latency histogram h with label "name=\"value\"", buckets of h are summed up to each bound */
+static void
+page_histogram(struct page *p, const char *metric, const char *label, const struct histogram *h)
+{
+	unsigned long long n = 0;
+	int i = 0, k, end;
+
+	for (k = 0; k < (int) (sizeof(metric_bounds) / sizeof(metric_bounds[0])); k ++) {
+		end = latency_bucket((unsigned long long) (metric_bounds[k] * 1000000));
+		for (; i < end; i ++)
+			n += h->counts[i];
+		page_printf(p, "%s_bucket{%s,le=\"%g\"} %llu\n", metric, label, metric_bounds[k], n);
+	}
 
-			b = buffer_init_size(toread + 1);
-			if (b == NULL) {
-				fprintf(stderr, "%s: (%s.%d) SERVER OUT OF MEMORY\n", cur_ts_str, __FILE__, __LINE__);
-				conn_close(c);
-				return;
-			}
+	/* counters may move while summed, count is what buckets say */
+	for (; i < LATENCY_BUCKETS; i ++)
+		n += h->counts[i];
+	page_printf(p, "%s_bucket{%s,le=\"+Inf\"} %llu\n", metric, label, n);
+	page_printf(p, "%s_sum{%s} %.6f\n", metric, label, h->sum / 1000000.0);
+	page_printf(p, "%s_count{%s} %llu\n", metric, label, n);
+}
 
-			r = read(c->cfd, b->ptr, toread);
-			if ((r <= 0) && (errno != EINTR && errno != EAGAIN))  {
-				buffer_free(b);
-				conn_close(c);
-				return;
-			}
-			b->size = r;
-			b->ptr[r] = '\0';
-
-			/* append buffer to list */
-			append_buffer_to_list(c->request, b);
-			c->storebytes -= r;
-			if (c->storebytes <= 0)
-				start_magent_transcation(c);
-			break;
-		}
-	} else if (which & EV_WRITE) {
-		/* write to client */
-		r = writev_list(c->cfd, c->response);
-		if (r < 0) {
-			conn_close(c);
-			return;
-		}
+/* all counters, server states and latencies of newest server list */
+static void
+render_metrics(struct page *p)
+{
+	static const char *cmdnames[] = { "get", "gets", "set", "cas", "incr_decr", "delete", "other" };
+	unsigned long long cmds[7];
+	struct cluster *cl = cluster_get();
+	struct counters c;
+	struct srvstat *st;
+	struct histogram *cmdlat;
+	struct latency *lat;
+	double *shares;
+	int *pools, i, n = cl->matrixcnt;
+	char label[128];
+
+	st = (struct srvstat *) calloc(sizeof(struct srvstat), n);
+	pools = (int *) calloc(sizeof(int), n * 2);
+	shares = (double *) calloc(sizeof(double), n);
+	cmdlat = (struct histogram *) calloc(sizeof(struct histogram), LATENCY_CLASSES);
+	lat = (struct latency *) calloc(sizeof(struct latency), n);
+	if (st == NULL || pools == NULL || shares == NULL || cmdlat == NULL || lat == NULL) {
+		free(p->ptr);
+		p->ptr = NULL;
+		goto out;
+	}
 
-		if (c->response->first == NULL) {
-			/* finish writing buffer to client
-			 * switch back to reading from client
-			 */
-			event_del(&(c->ev));
-			event_set(&(c->ev), c->cfd, EV_READ|EV_PERSIST, drive_client, (void *) c);
-			event_add(&(c->ev), 0);
-			c->ev_flags = EV_READ;
-		}
+	sum_counters(cl, &c, st, pools);
+	sum_latency(cl, cmdlat, lat);
+	if (cl->ketama) {
+		ketama_shares(cl->ketama, shares);
+	} else {
+		for (i = 0; i < n; i ++)
+			shares[i] = 1.0 / n;
+	}
+
+	page_metric(p, "magent_info", "gauge", "Version of memcached agent.");
+	page_printf(p, "magent_info{version=\"%s\"} 1\n", VERSION);
+	page_metric(p, "magent_connections", "gauge", "Client connections open.");
+	page_printf(p, "magent_connections %d\n", curconns);
+	page_metric(p, "magent_connections_max", "gauge", "Max client connections, see -n.");
+	page_printf(p, "magent_connections_max %d\n", maxconns);
+	page_metric(p, "magent_connections_accepted_total", "counter", "Client connections accepted.");
+	page_printf(p, "magent_connections_accepted_total %llu\n", totalconns);
+	page_metric(p, "magent_connections_rejected_total", "counter", "Client connections refused by max connections.");
+	page_printf(p, "magent_connections_rejected_total %llu\n", rejectconns);
+	page_metric(p, "magent_requests_total", "counter", "Client commands.");
+	page_printf(p, "magent_requests_total %llu\n", c.requests);
+	page_metric(p, "magent_syscalls_total", "counter", "read/writev/socket/connect calls.");
+	page_printf(p, "magent_syscalls_total %llu\n", c.syscalls);
+
+	cmds[0] = c.cmd_get;
+	cmds[1] = c.cmd_gets;
+	cmds[2] = c.cmd_set;
+	cmds[3] = c.cmd_cas;
+	cmds[4] = c.cmd_incr_decr;
+	cmds[5] = c.cmd_delete;
+	cmds[6] = c.cmd_other;
+	page_metric(p, "magent_commands_total", "counter", "Client commands by type.");
+	for (i = 0; i < 7; i ++)
+		page_printf(p, "magent_commands_total{command=\"%s\"} %llu\n", cmdnames[i], cmds[i]);
+
+	page_metric(p, "magent_get_hits_total", "counter", "GET keys replied with a value.");
+	page_printf(p, "magent_get_hits_total %llu\n", c.get_hits);
+	page_metric(p, "magent_get_misses_total", "counter", "GET keys replied without a value.");
+	page_printf(p, "magent_get_misses_total %llu\n", c.get_misses);
+	page_metric(p, "magent_client_read_bytes_total", "counter", "Bytes read from clients.");
+	page_printf(p, "magent_client_read_bytes_total %llu\n", c.client_read);
+	page_metric(p, "magent_client_written_bytes_total", "counter", "Bytes written to clients.");
+	page_printf(p, "magent_client_written_bytes_total %llu\n", c.client_written);
+	page_metric(p, "magent_buffered_bytes", "gauge", "Bytes of requests, responses and values in flight.");
+	page_printf(p, "magent_buffered_bytes %lld\n", c.buffered);
+	page_metric(p, "magent_backup_failovers_total", "counter", "Requests retried on backup servers.");
+	page_printf(p, "magent_backup_failovers_total %llu\n", c.failovers);
+	page_metric(p, "magent_near_cache_hits_total", "counter", "GET keys served by near cache, see -c.");
+	page_printf(p, "magent_near_cache_hits_total %llu\n", c.ncache_hits);
+	page_metric(p, "magent_near_cache_misses_total", "counter", "GET keys not in near cache, see -c.");
+	page_printf(p, "magent_near_cache_misses_total %llu\n", c.ncache_misses);
+	page_metric(p, "magent_coalesced_gets_total", "counter", "GET keys joining an identical GET in flight, see -G.");
+	page_printf(p, "magent_coalesced_gets_total %llu\n", c.coalesced);
+	page_metric(p, "magent_timeouts_total", "counter", "Memcached server connections and commands timed out, see -T.");
+	page_printf(p, "magent_timeouts_total %llu\n", c.timeouts);
+	page_metric(p, "magent_pool_max_idle_connections", "gauge", "Max keep alive connections of one server in one worker, see -i.");
+	page_printf(p, "magent_pool_max_idle_connections %d\n", maxidle);
+
+	page_metric(p, "magent_server_up", "gauge", "Memcached server is in routing, 0 if ejected.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_up{server=\"%s:%d\"} %d\n", cl->matrixs[i].ip, cl->matrixs[i].port, !cl->matrixs[i].down);
+	page_metric(p, "magent_server_key_share", "gauge", "Share of keys routed to memcached server.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_key_share{server=\"%s:%d\"} %.6f\n", cl->matrixs[i].ip, cl->matrixs[i].port, shares[i]);
+	page_metric(p, "magent_server_idle_connections", "gauge", "Connections in keep alive pools.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_idle_connections{server=\"%s:%d\"} %d\n", cl->matrixs[i].ip, cl->matrixs[i].port, pools[i * 2]);
+	page_metric(p, "magent_server_open_connections", "gauge", "Connections open, idle or busy.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_open_connections{server=\"%s:%d\"} %d\n", cl->matrixs[i].ip, cl->matrixs[i].port, pools[i * 2 + 1]);
+	page_metric(p, "magent_server_get_hits_total", "counter", "GET keys found on memcached server.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_get_hits_total{server=\"%s:%d\"} %llu\n", cl->matrixs[i].ip, cl->matrixs[i].port, st[i].hits);
+	page_metric(p, "magent_server_get_misses_total", "counter", "GET keys missed on memcached server.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_get_misses_total{server=\"%s:%d\"} %llu\n", cl->matrixs[i].ip, cl->matrixs[i].port, st[i].misses);
+	page_metric(p, "magent_server_read_bytes_total", "counter", "Bytes read from memcached server.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_read_bytes_total{server=\"%s:%d\"} %llu\n", cl->matrixs[i].ip, cl->matrixs[i].port, st[i].bytes_read);
+	page_metric(p, "magent_server_written_bytes_total", "counter", "Bytes written to memcached server.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_written_bytes_total{server=\"%s:%d\"} %llu\n", cl->matrixs[i].ip, cl->matrixs[i].port, st[i].bytes_written);
+	page_metric(p, "magent_server_pool_reuses_total", "counter", "Connections taken from keep alive pool.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_pool_reuses_total{server=\"%s:%d\"} %llu\n", cl->matrixs[i].ip, cl->matrixs[i].port, st[i].reuses);
+	page_metric(p, "magent_server_connects_total", "counter", "New connections to memcached server.");
+	for (i = 0; i < n; i ++)
+		page_printf(p, "magent_server_connects_total{server=\"%s:%d\"} %llu\n", cl->matrixs[i].ip, cl->matrixs[i].port, st[i].connects);
+
+	/* latencies restart with stats latency reset */
+	page_metric(p, "magent_command_duration_seconds", "histogram", "Client command latency by class.");
+	for (i = 0; i < LATENCY_CLASSES; i ++) {
+		snprintf(label, sizeof(label), "command=\"%s\"", latency_classes[i]);
+		page_histogram(p, "magent_command_duration_seconds", label, cmdlat + i);
 	}
+	page_metric(p, "magent_server_connect_duration_seconds", "histogram", "connect() to memcached server.");
+	for (i = 0; i < n; i ++) {
+		snprintf(label, sizeof(label), "server=\"%s:%d\"", cl->matrixs[i].ip, cl->matrixs[i].port);
+		page_histogram(p, "magent_server_connect_duration_seconds", label, &(lat[i].connect));
+	}
+	page_metric(p, "magent_server_first_byte_duration_seconds", "histogram", "Query queued until first byte of reply.");
+	for (i = 0; i < n; i ++) {
+		snprintf(label, sizeof(label), "server=\"%s:%d\"", cl->matrixs[i].ip, cl->matrixs[i].port);
+		page_histogram(p, "magent_server_first_byte_duration_seconds", label, &(lat[i].first));
+	}
+	page_metric(p, "magent_server_response_duration_seconds", "histogram", "Query queued until whole reply.");
+	for (i = 0; i < n; i ++) {
+		snprintf(label, sizeof(label), "server=\"%s:%d\"", cl->matrixs[i].ip, cl->matrixs[i].port);
+		page_histogram(p, "magent_server_response_duration_seconds", label, &(lat[i].total));
+	}
+
+out:
+	free(st);
+	free(pools);
+	free(shares);
+	free(cmdlat);
+	free(lat);
+	cluster_release(cl);
 }
 
-static void
-server_accept(const int fd, const short which, void *arg)
+/* socket timeout opt of fd is what is left until deadline of whole request,
+ * a client sending or reading a byte now and then can't hold admin thread
+ * return 0 if ok, return -1 if deadline passed
+ */
+static int
+admin_timeout(int fd, int opt, unsigned long long deadline)
 {
-	conn *c = NULL;
-	int newfd;
-	struct sockaddr_in s_in;
-	socklen_t len = sizeof(s_in);
+	unsigned long long now = latency_now();
+	struct timeval tv;
 
-	UNUSED(arg);
-	UNUSED(which);
+	if (now >= deadline) return -1;
 
-	memset(&s_in, 0, len);
-	newfd = accept(fd, (struct sockaddr *) &s_in, &len);
-	if (newfd < 0) {
-		fprintf(stderr, "%s: (%s.%d) ACCEPT() FAILED\n", cur_ts_str, __FILE__, __LINE__);
-		return ;
+	tv.tv_sec = (deadline - now) / 1000000;
+	tv.tv_usec = (deadline - now) % 1000000;
+	setsockopt(fd, SOL_SOCKET, opt, (void *) &tv, sizeof(tv));
+	return 0;
+}
+
+/* return 0 if ok, return -1 if failed */
+static int
+write_all(int fd, const char *buf, size_t len, unsigned long long deadline)
+{
+	ssize_t r;
+
+	while (len > 0) {
+		if (admin_timeout(fd, SO_SNDTIMEO, deadline)) return -1;
+		r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return -1;
+		buf += r;
+		len -= r;
 	}
 
-	if (curconns >= maxconns) {
-		/* out of connections */
-		write(newfd, OUTOFCONN, sizeof(OUTOFCONN));
-		close(newfd);
+	return 0;
+}
+
+/* one http request, GET /metrics */
+static void
+admin_serve(int fd)
+{
+	unsigned long long deadline = latency_now() + ADMIN_TIMEOUT * 1000000ULL;
+	struct page p;
+	char req[1024], head[256];
+	int pos = 0, r, len;
+
+	/* request line and headers */
+	while (pos < (int) sizeof(req) - 1) {
+		if (admin_timeout(fd, SO_RCVTIMEO, deadline)) return;
+		r = read(fd, req + pos, sizeof(req) - 1 - pos);
+		if (r < 0 && errno == EINTR) continue;
+		if (r <= 0) return;
+		pos += r;
+		req[pos] = '\0';
+		if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) break;
+	}
+	req[pos] = '\0';
+
+	if (strncmp(req, "GET /metrics ", 13) && strncmp(req, "GET / ", 6)) {
+		len = snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+				"Content-Length: 10\r\nConnection: close\r\n\r\nnot found\n");
+		write_all(fd, head, len, deadline);
 		return;
 	}
 
-	c = (struct conn *) calloc(sizeof(struct conn), 1);
-	if (c == NULL) {
-		fprintf(stderr, "%s: (%s.%d) OUT OF MEMORY FOR NEW CONNECTION\n", cur_ts_str, __FILE__, __LINE__);
-		close(newfd);
+	p.size = 0;
+	p.len = 65536;
+	p.ptr = (char *) malloc(p.len);
+	render_metrics(&p);
+	if (p.ptr == NULL) {
+		len = snprintf(head, sizeof(head), "HTTP/1.0 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+		write_all(fd, head, len, deadline);
 		return;
 	}
-	c->request = list_init();
-	c->response = list_init();
-	c->cfd = newfd;
-	curconns ++;
 
-	if (verbose_mode)
-		fprintf(stderr, "%s: (%s.%d) NEW CLIENT FD %d\n", cur_ts_str, __FILE__, __LINE__, c->cfd);
+	len = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+			"Content-Length: %lu\r\nConnection: close\r\n\r\n", (unsigned long) p.size);
+	if (write_all(fd, head, len, deadline) == 0)
+		write_all(fd, p.ptr, p.size, deadline);
+	free(p.ptr);
+}
 
-	set_nonblock(c->cfd);
+/* admin thread, scrapes are served one by one apart from client connections */
+static void *
+admin_main(void *arg)
+{
+	int fd;
 
-	/* setup client event handler */
-	memset(&(c->ev), 0, sizeof(struct event));
-	event_set(&(c->ev), c->cfd, EV_READ|EV_PERSIST, drive_client, (void *) c);
-	event_add(&(c->ev), 0);
-	c->ev_flags = EV_READ;
-	
-	return;
+	UNUSED(arg);
+
+	for (;;) {
+		fd = accept(adminfd, NULL, NULL);
+		if (fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				fprintf(stderr, "%s: (%s.%d) ADMIN ACCEPT() FAILED\n", cur_ts_str, __FILE__, __LINE__);
+				sleep(1);
+			}
+			continue;
+		}
+
+		admin_serve(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* listen on admin port of bindhost, return 0 if ok, return 1 if failed */
+static int
+admin_socket(const char *bindhost)
+{
+	struct sockaddr_in addr;
+	int flags = 1;
+
+	if ((adminfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		fprintf(stderr, "CAN'T CREATE ADMIN SOCKET\n");
+		return 1;
+	}
+	setsockopt(adminfd, SOL_SOCKET, SO_REUSEADDR, (void *) &flags, sizeof(flags));
+
+	memset((char *) &addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = bindhost ? inet_addr(bindhost) : htonl(INADDR_ANY);
+	addr.sin_port = htons(adminport);
+
+	if (bind(adminfd, (struct sockaddr *) &addr, sizeof(addr)) || listen(adminfd, 64)) {
+		fprintf(stderr, "admin port %d errno = %d: %s\n", adminport, errno, strerror(errno));
+		close(adminfd);
+		adminfd = -1;
+		return 1;
+	}
+
+	return 0;
 }
 
 static void
@@ -1956,42 +6281,75 @@ free_matrix(matrix *m)
 		s = m->pool[i];
 		if (s->sfd > 0) close(s->sfd);
 		list_free(s->request, 0);
-		list_free(s->response, 0);
+		free(s);
+	}
+
+	for (i = 0; m->mux && i < muxconns; i ++) {
+		s = m->mux[i];
+		if (s == NULL) continue;
+		if (s->sfd > 0) close(s->sfd);
+		list_free(s->request, 0);
 		free(s);
 	}
 
 	free(m->pool);
+	free(m->mux);
 	free(m->ip);
+	free(m);
 }
 
+/* SIGTERM/SIGINT, main loop returns to main() and server_exit() */
 static void
-server_exit(int sig)
+server_stop(const int fd, const short which, void *arg)
 {
-	int i;
+	UNUSED(fd);
+	UNUSED(which);
+	UNUSED(arg);
+
+	event_base_loopbreak(main_base);
+}
+
+/* stop workers, free connections to memcached servers after they are gone */
+static void
+server_exit(void)
+{
+	struct worker *w;
+	int i, j, stop = -2;
 
 	if (verbose_mode)
 		fprintf(stderr, "\nexiting\n");
 
-	UNUSED(sig);
-
 	if (sockfd > 0) close(sockfd);
 	if (unixfd > 0) close(unixfd);
 
-	free_ketama(ketama);
-	free_ketama(backupkt);
-
-	for (i = 0; i < matrixcnt; i ++) {
-		free_matrix(matrixs + i);
+	/* -2 instead of client fd */
+	for (i = 0; workers && nthreads > 1 && i < nthreads; i ++) {
+		w = workers + i;
+		if (write(w->notify[1], &stop, sizeof(stop)) != sizeof(stop)) {
+			fprintf(stderr, "%s: (%s.%d) CAN'T STOP WORKER %d\n", cur_ts_str, __FILE__, __LINE__, i);
+			exit(0);
+		}
 	}
-
-	free(matrixs);
-
-	for (i = 0; i < backupcnt; i ++) {
-		free_matrix(backups + i);
+	for (i = 0; workers && nthreads > 1 && i < nthreads; i ++)
+		pthread_join(workers[i].tid, NULL);
+
+	for (i = 0; workers && i < nthreads; i ++) {
+		w = workers + i;
+		if (w->cl == NULL) continue;
+
+		/* admin thread may still read pool sizes */
+		pthread_mutex_lock(&(w->hotlock));
+		for (j = 0; j < w->cl->matrixcnt; j ++) {
+			free_matrix(w->matrixs[j]);
+			w->matrixs[j] = NULL;
+		}
+		for (j = 0; j < w->cl->backupcnt; j ++) {
+			free_matrix(w->backups[j]);
+			w->backups[j] = NULL;
+		}
+		pthread_mutex_unlock(&(w->hotlock));
 	}
 
-	free(backups);
-
 	exit(0);
 }
 
@@ -2053,6 +6411,8 @@ timer_service(const int fd, short which, void *arg)
 	
 	cur_ts = time(NULL);
 	strftime(cur_ts_str, 127, "%Y-%m-%d %H:%M:%S", localtime(&cur_ts));
+
+	probe_servers();
 	
 	tv.tv_sec = 1; tv.tv_usec = 0; /* check for every 1 seconds */
 	event_add(&ev_timer, &tv);
@@ -2061,13 +6421,19 @@ timer_service(const int fd, short which, void *arg)
 int
 main(int argc, char **argv)
 {
-	char *p = NULL, *bindhost = NULL, temp[65];
+	char *bindhost = NULL;
 	int uid, gid, todaemon = 1, c, i;
 	struct sockaddr_in server;
-	struct matrix *m; 
 	struct timeval tv;
+
+	cluster = (struct cluster *) calloc(sizeof(struct cluster), 1);
+	if (cluster == NULL) {
+		fprintf(stderr, "out of memory for server list\n");
+		exit(1);
+	}
+	cluster->refs = 1;
 	
-	while(-1 != (c = getopt(argc, argv, "p:u:g:s:Dhvn:l:kb:f:i:"))) {
+	while(-1 != (c = getopt(argc, argv, "p:u:g:s:Dhvn:l:kb:f:i:t:m:Uc:e:GH:d:V:F:E:RT:a:"))) {
 		switch (c) {
 		case 'u':
 			uid = atoi(optarg);
@@ -2100,6 +6466,74 @@ main(int argc, char **argv)
 			maxidle = atoi(optarg);
 			if (maxidle <= 0) maxidle = 20;
 			break;
+		case 'm':
+			muxconns = atoi(optarg);
+			if (muxconns < 0) muxconns = 0;
+			break;
+		case 'U':
+			use_uring = 1;
+			break;
+		case 'G':
+			coalesce = 1;
+			break;
+		case 'H':
+			if (strcmp(optarg, "murmur") == 0) {
+				hashfunc = KETAMA_HASH_MURMUR;
+			} else if (strcmp(optarg, "md5") != 0) {
+				fprintf(stderr, "unknown hash function %s, use md5 or murmur\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'd':
+			use_ketama = 1;
+			if (strcmp(optarg, "jump") == 0) {
+				engine = KETAMA_ENGINE_JUMP;
+			} else if (strcmp(optarg, "maglev") == 0) {
+				engine = KETAMA_ENGINE_MAGLEV;
+			} else if (strcmp(optarg, "rendezvous") == 0) {
+				engine = KETAMA_ENGINE_RENDEZVOUS;
+			} else if (strcmp(optarg, "ketama") == 0) {
+				engine = KETAMA_ENGINE_RING;
+			} else {
+				fprintf(stderr, "unknown distribution %s, use ketama, jump, maglev or rendezvous\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'E':
+			eject_fails = atoi(optarg);
+			if (eject_fails < 0) eject_fails = 0;
+			break;
+		case 'R':
+			reroute = 1;
+			break;
+		case 'a':
+			adminport = atoi(optarg);
+			break;
+		case 'T':
+			/* connect,write,read[,total], one number for the first three */
+			if (sscanf(optarg, "%d,%d,%d,%d", &connect_timeout, &write_timeout, &read_timeout, &total_timeout) == 1)
+				write_timeout = read_timeout = connect_timeout;
+			if (connect_timeout < 0) connect_timeout = 0;
+			if (write_timeout < 0) write_timeout = 0;
+			if (read_timeout < 0) read_timeout = 0;
+			if (total_timeout < 0) total_timeout = 0;
+			break;
+		case 'V':
+			vnodes = atoi(optarg);
+			if (vnodes <= 0) vnodes = 500;
+			break;
+		case 'c':
+			i = atoi(optarg);
+			ncache_size = (i > 0) ? (size_t) i << 20 : 0;
+			break;
+		case 'e':
+			ncache_ttl = atoi(optarg);
+			if (ncache_ttl <= 0) ncache_ttl = 1;
+			break;
+		case 't':
+			nthreads = atoi(optarg);
+			if (nthreads <= 0) nthreads = 1;
+			break;
 		case 'n':
 			maxconns = atoi(optarg);
 			if (maxconns <= 0) maxconns = 4096;
@@ -2112,78 +6546,25 @@ main(int argc, char **argv)
 			break;
 
 		case 'b':
-			if (backupcnt == 0) {
-				backups = (struct matrix *) calloc(sizeof(struct matrix), 1);
-				if (backups == NULL) {
-					fprintf(stderr, "out of memory for %s\n", optarg);
-					exit(1);
-				}
-				m = backups;
-				backupcnt = 1;
-			} else {
-				backups = (struct matrix *)realloc(backups, sizeof(struct matrix)*(backupcnt+1));
-				if (backups == NULL) {
-					fprintf(stderr, "out of memory for %s\n", optarg);
-					exit(1);
-				}
-				m = backups + backupcnt;
-				backupcnt ++;
-			}
-			
-			p = strchr(optarg, ':');
-			if (p == NULL) {
-				m->ip = strdup(optarg);
-				m->port = 11211;
-			} else {
-				*p = '\0';
-				m->ip = strdup(optarg);
-				*p = ':';
-				p ++;
-				m->port = atoi(p);
-				if (m->port <= 0) m->port = 11211;
+			if (add_server(&(cluster->backups), &(cluster->backupcnt), optarg)) {
+				fprintf(stderr, "out of memory for %s\n", optarg);
+				exit(1);
 			}
-
-			m->dstaddr.sin_family = AF_INET;
-			m->dstaddr.sin_addr.s_addr = inet_addr(m->ip);
-			m->dstaddr.sin_port = htons(m->port);
-			
 			break;
 
 		case 's': /* server string */
-			if (matrixcnt == 0) {
-				matrixs = (struct matrix *) calloc(sizeof(struct matrix), 1);
-				if (matrixs == NULL) {
-					fprintf(stderr, "out of memory for %s\n", optarg);
-					exit(1);
-				}
-				m = matrixs;
-				matrixcnt = 1;
-			} else {
-				matrixs = (struct matrix *)realloc(matrixs, sizeof(struct matrix)*(matrixcnt+1));
-				if (matrixs == NULL) {
-					fprintf(stderr, "out of memory for %s\n", optarg);
-					exit(1);
-				}
-				m = matrixs + matrixcnt;
-				matrixcnt ++;
+			if (add_server(&(cluster->matrixs), &(cluster->matrixcnt), optarg)) {
+				fprintf(stderr, "out of memory for %s\n", optarg);
+				exit(1);
 			}
-			
-			p = strchr(optarg, ':');
-			if (p == NULL) {
-				m->ip = strdup(optarg);
-				m->port = 11211;
-			} else {
-				*p = '\0';
-				m->ip = strdup(optarg);
-				*p = ':';
-				p ++;
-				m->port = atoi(p);
-				if (m->port <= 0) m->port = 11211;
+			break;
+		case 'F':
+			/* absolute, daemon() changes directory */
+			conffile = realpath(optarg, NULL);
+			if (conffile == NULL) {
+				fprintf(stderr, "can't find %s\n", optarg);
+				exit(1);
 			}
-			m->dstaddr.sin_family = AF_INET;
-			m->dstaddr.sin_addr.s_addr = inet_addr(m->ip);
-			m->dstaddr.sin_port = htons(m->port);
-			
 			break;
 		case 'h':
 		default:
@@ -2192,7 +6573,21 @@ main(int argc, char **argv)
 		}
 	}
 
-	if (matrixcnt == 0) {
+	if (conffile) {
+		if (cluster->matrixcnt > 0 || cluster->backupcnt > 0) {
+			fprintf(stderr, "please provide servers with either -s/-b or -F\n");
+			exit(1);
+		}
+		free_cluster(cluster);
+		cluster = read_conffile(conffile);
+		if (cluster == NULL) {
+			fprintf(stderr, "can't read servers from %s\n", conffile);
+			exit(1);
+		}
+		cluster->refs = 1;
+	}
+
+	if (cluster->matrixcnt == 0) {
 		fprintf(stderr, "please provide -s \"ip:port\" argument\n\n");
 		show_help();
 		exit(1);
@@ -2210,73 +6605,20 @@ main(int argc, char **argv)
 
 	cur_ts = time(NULL);
 	strftime(cur_ts_str, 127, "%Y-%m-%d %H:%M:%S", localtime(&cur_ts));
+	latency_since = cur_ts;
 
-	if (use_ketama) {
-		ketama = (struct ketama *)calloc(sizeof(struct ketama), 1);
-		if (ketama == NULL) {
-			fprintf(stderr, "not enough memory to create ketama\n");
-			exit(1);
-		} else {
-			ketama->count = matrixcnt;
-			ketama->weight = (int *)calloc(sizeof(int), ketama->count);
-			ketama->name = (char **)calloc(sizeof(char *), ketama->count);
-			
-			if (ketama->weight == NULL || ketama->name == NULL) {
-				fprintf(stderr, "not enough memory to create ketama\n");
-				exit(1);
-			}
-
-			for (i = 0; i < ketama->count; i ++) {
-				ketama->weight[i] = 100;
-				ketama->totalweight += ketama->weight[i];
-				snprintf(temp, 64, "%s-%d", matrixs[i].ip, matrixs[i].port);
-				ketama->name[i] = strdup(temp);
-				if (ketama->name[i] == NULL) {
-					fprintf(stderr, "not enough memory to create ketama\n");
-					exit(1);
-				}
-			}
-		}
-		if (create_ketama(ketama, 500)) {
-			fprintf(stderr, "can't create ketama\n");
-			exit(1);
-		}
-
-		/* update backup server ketama */
-		if (backupcnt > 0) {
-			backupkt = (struct ketama *)calloc(sizeof(struct ketama), 1);
-			if (backupkt == NULL) {
-				fprintf(stderr, "not enough memory to create ketama\n");
-				exit(1);
-			} else {
-				backupkt->count = backupcnt;
-				backupkt->weight = (int *)calloc(sizeof(int), backupkt->count);
-				backupkt->name = (char **)calloc(sizeof(char *), backupkt->count);
-				
-				if (backupkt->weight == NULL || backupkt->name == NULL) {
-					fprintf(stderr, "not enough memory to create ketama\n");
-					exit(1);
-				}
+	if (ncache_size > 0 && ncache_init()) {
+		fprintf(stderr, "out of memory for near cache\n");
+		exit(1);
+	}
 
-				for (i = 0; i < backupkt->count; i ++) {
-					backupkt->weight[i] = 100;
-					backupkt->totalweight += backupkt->weight[i];
-					snprintf(temp, 64, "%s-%d", backups[i].ip, backups[i].port);
-					backupkt->name[i] = strdup(temp);
-					if (backupkt->name[i] == NULL) {
-						fprintf(stderr, "not enough memory to create ketama\n");
-						exit(1);
-					}
-				}
-			}
-			if (create_ketama(backupkt, 500)) {
-				fprintf(stderr, "can't create backup ketama\n");
-				exit(1);
-			}
-		}
+	if (build_cluster(cluster)) {
+		fprintf(stderr, "can't create ketama\n");
+		exit(1);
+	}
 
+	if (use_ketama)
 		fprintf(stderr, "using ketama algorithm\n");
-	}
 
 	if (port > 0) {
 		sockfd = socket(AF_INET, SOCK_STREAM, 0);
@@ -2314,30 +6656,58 @@ main(int argc, char **argv)
 	if (socketpath) 
 		server_socket_unix();
 
-	signal(SIGTERM, server_exit);
-	signal(SIGINT, server_exit);
+	if (adminport > 0 && admin_socket(bindhost))
+		exit(1);
+
+	/* client may close before its replies are written */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (start_workers()) {
+		fprintf(stderr, "can't start %d worker threads\n", nthreads);
+		exit(1);
+	}
+
+	if (adminfd >= 0) {
+		pthread_t tid;
 
-	event_init();
+		if (verbose_mode)
+			fprintf(stderr, "memcached agent metrics at http port %d\n", adminport);
+		if (pthread_create(&tid, NULL, admin_main, NULL)) {
+			fprintf(stderr, "can't start admin thread\n");
+			exit(1);
+		}
+	}
 
 	if (sockfd > 0) {
 		if (verbose_mode)
 			fprintf(stderr, "memcached agent listen at port %d\n", port);
-		event_set(&ev_master, sockfd, EV_READ|EV_PERSIST, server_accept, NULL);
+		event_assign(&ev_master, main_base, sockfd, EV_READ|EV_PERSIST, server_accept, NULL);
 		event_add(&ev_master, 0);
 	}
 
 	if (unixfd > 0) {
 		if (verbose_mode)
 			fprintf(stderr, "memcached agent listen at unix domain socket \"%s\"\n", socketpath);
-		event_set(&ev_unix, unixfd, EV_READ|EV_PERSIST, server_accept, NULL);
+		event_assign(&ev_unix, main_base, unixfd, EV_READ|EV_PERSIST, server_accept, NULL);
 		event_add(&ev_unix, 0);
 	}
 
-	evtimer_set(&ev_timer, timer_service, NULL);
+	if (conffile) {
+		evsignal_assign(&ev_reload, main_base, SIGHUP, reload_servers, NULL);
+		event_add(&ev_reload, 0);
+	}
+
+	/* not exiting inside signal handler, workers may be using everything freed */
+	evsignal_assign(&ev_term, main_base, SIGTERM, server_stop, NULL);
+	event_add(&ev_term, 0);
+	evsignal_assign(&ev_int, main_base, SIGINT, server_stop, NULL);
+	event_add(&ev_int, 0);
+
+	evtimer_assign(&ev_timer, main_base, timer_service, NULL);
 	tv.tv_sec = 1; tv.tv_usec = 0; /* check for every 1 seconds */
 	event_add(&ev_timer, &tv);
 
-	event_loop(0);
-	server_exit(0);
+	event_base_dispatch(main_base);
+	server_exit();
 	return 0;
 }